@@ -0,0 +1,100 @@
+#include "MicroBench.h"
+#include "CombainAllocCounter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static std::string Filter;
+static uint64_t MinTimeNs = 200 * 1000 * 1000;
+
+bool MicroBench::ParseOption(const char *arg)
+{
+    if (strncmp(arg, "--filter=", 9) == 0)
+    {
+        Filter = arg + 9;
+        return true;
+    }
+    if (strncmp(arg, "--min-time-ms=", 14) == 0)
+    {
+        MinTimeNs = strtoull(arg + 14, NULL, 10) * 1000 * 1000;
+        return true;
+    }
+    return false;
+}
+
+const char *MicroBench::GetOptionsHelp(void)
+{
+    return
+        "  --filter=SUBSTRING       Run only benchmarks whose names contain this\n"
+        "  --min-time-ms=N          Time to run each benchmark for. Default: 200\n";
+}
+
+void MicroBench::PrintHeader(void)
+{
+    printf("%-40s %12s %12s %10s %10s\n", "benchmark", "iterations", "ns/op", "B/op", "allocs/op");
+}
+
+MicroBench::Result MicroBench::Run(
+    const std::string &name, const std::function<void()> &fn, uint64_t opsPerCall)
+{
+    Result result = {};
+    if (!IsSelected(name))
+    {
+        return result;
+    }
+
+    // Once outside the measurement, so that one-off setup such as growing reused buffers doesn't
+    // count against the steady state
+    fn();
+
+    uint64_t calls = 1;
+    for (;;)
+    {
+        const uint64_t allocsBefore = CombainAllocCounterGet();
+        const uint64_t bytesBefore = CombainAllocCounterGetBytes();
+        const auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < calls; i++)
+        {
+            fn();
+        }
+        const auto end = std::chrono::steady_clock::now();
+        const uint64_t elapsedNs =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+        if (elapsedNs >= MinTimeNs || calls >= (UINT64_C(1) << 40))
+        {
+            const double ops = static_cast<double>(calls * opsPerCall);
+            result.iterations = calls * opsPerCall;
+            result.nsPerOp = elapsedNs / ops;
+            result.allocsPerOp = (CombainAllocCounterGet() - allocsBefore) / ops;
+            result.bytesPerOp = (CombainAllocCounterGetBytes() - bytesBefore) / ops;
+            break;
+        }
+
+        // Aim a little past the minimum time so that the next batch is usually the last
+        const uint64_t estimate = elapsedNs > 0 ? calls * MinTimeNs * 5 / 4 / elapsedNs : 0;
+        calls = std::max(calls * 2, std::min(estimate, calls * 100));
+    }
+
+    Print(name, result);
+    return result;
+}
+
+bool MicroBench::IsSelected(const std::string &name)
+{
+    return Filter.empty() || name.find(Filter) != std::string::npos;
+}
+
+void MicroBench::Print(const std::string &name, const Result &result)
+{
+    printf("%-40s %12llu %12.1f %10.1f %10.2f\n",
+        name.c_str(),
+        static_cast<unsigned long long>(result.iterations),
+        result.nsPerOp,
+        result.bytesPerOp,
+        result.allocsPerOp);
+    fflush(stdout);
+}
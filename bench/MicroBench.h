@@ -0,0 +1,56 @@
+#ifndef MICRO_BENCH_H
+#define MICRO_BENCH_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * A minimal microbenchmark runner, shared by the benchmark programs so that their numbers are
+ * measured and reported the same way.
+ *
+ * Each benchmark is a function which performs one operation. It is called in batches of growing
+ * size until a batch takes at least the minimum time, and that batch is reported as time per
+ * operation and, when the program is built with COMBAIN_COUNT_ALLOCATIONS, heap allocations and
+ * bytes allocated per operation on the calling thread.
+ */
+//--------------------------------------------------------------------------------------------------
+class MicroBench
+{
+public:
+    struct Result
+    {
+        uint64_t iterations;
+        double nsPerOp;
+        double allocsPerOp;
+        double bytesPerOp;
+    };
+
+    // Applies --filter=SUBSTRING or --min-time-ms=N. Returns false if it isn't a runner option.
+    static bool ParseOption(const char *arg);
+    static const char *GetOptionsHelp(void);
+
+    static void PrintHeader(void);
+
+    // Runs the benchmark and prints its result, unless its name doesn't match --filter.
+    // opsPerCall is the number of operations each call of fn performs, for per-operation figures.
+    static Result Run(const std::string &name, const std::function<void()> &fn,
+        uint64_t opsPerCall = 1);
+
+    // Whether a benchmark should be run, given --filter
+    static bool IsSelected(const std::string &name);
+
+    // Prints a result measured by the caller, for benchmarks which Run() can't measure, e.g.
+    // because they allocate on more than one thread
+    static void Print(const std::string &name, const Result &result);
+
+    // Stops the compiler from optimizing away a value that the benchmark doesn't otherwise use.
+    template <typename T>
+    static void KeepValue(const T &value)
+    {
+        asm volatile("" : : "r"(&value) : "memory");
+    }
+};
+
+#endif // MICRO_BENCH_H
@@ -0,0 +1,1056 @@
+#include "MockCombainServer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <set>
+
+// Response bodies in the format of the Combain positioning API
+#define DEFAULT_SUCCESS_BODY \
+    "{\"location\":{\"lat\":59.3293235,\"lng\":18.0685808},\"accuracy\":25,\"logId\":4711}"
+#define DEFAULT_ERROR_BODY \
+    "{\"error\":{\"errors\":[{\"domain\":\"global\",\"reason\":\"parseError\"," \
+    "\"message\":\"Parse Error\"}],\"code\":400,\"message\":\"Parse Error\"}}"
+#define DEFAULT_GARBAGE_BODY "<html><body><h1>502 Bad Gateway</h1></body></html>"
+
+#define READ_CHUNK_BYTES 16384
+#define MAX_EPOLL_EVENTS 64
+
+// HTTP/2 (RFC 7540)
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_BYTES 24
+#define HTTP2_FRAME_HEADER_BYTES 9
+#define HTTP2_MAX_FRAME_BYTES 16384
+#define HTTP2_MAX_CONCURRENT_STREAMS 100
+
+#define HTTP2_DATA 0x0
+#define HTTP2_HEADERS 0x1
+#define HTTP2_RST_STREAM 0x3
+#define HTTP2_SETTINGS 0x4
+#define HTTP2_PING 0x6
+#define HTTP2_GOAWAY 0x7
+#define HTTP2_WINDOW_UPDATE 0x8
+
+#define HTTP2_FLAG_END_STREAM 0x1
+#define HTTP2_FLAG_ACK 0x1
+#define HTTP2_FLAG_END_HEADERS 0x4
+
+#define HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+
+struct MockCombainServer::Connection
+{
+    uint64_t id;
+    int fd;
+    SSL *ssl;
+    bool handshakeDone;
+    bool continueSent;
+    bool waitingForWrite;
+    bool http2;
+    bool prefaceReceived;
+    uint64_t readyUs;             ///< When connectDelayMs is up
+    uint64_t lastActiveUs;
+    uint32_t outstanding;         ///< Requests received but not yet answered
+    uint32_t lastStreamId;
+    std::set<uint32_t> streams;   ///< HTTP/2 streams which haven't been reset or answered
+    std::string in;
+    std::string out;
+};
+
+static uint64_t NowUs(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int SelectAlpn(
+    SSL *ssl,
+    const unsigned char **out,
+    unsigned char *outLen,
+    const unsigned char *in,
+    unsigned int inLen,
+    void *arg)
+{
+    static const unsigned char Http1[] = "\x08http/1.1";
+    static const unsigned char Http2[] = "\x02h2\x08http/1.1";
+    const bool http2 = *static_cast<const bool *>(arg);
+    unsigned char *selected;
+    if (SSL_select_next_proto(
+            &selected,
+            outLen,
+            http2 ? Http2 : Http1,
+            http2 ? sizeof(Http2) - 1 : sizeof(Http1) - 1,
+            in,
+            inLen) != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+
+MockCombainServer::MockCombainServer(const Options &options)
+    : options(options),
+      sslCtx(NULL),
+      listenFd(-1),
+      epollFd(-1),
+      stopFd(-1),
+      port(0),
+      random(options.seed),
+      nextConnectionId(1),
+      numConnections(0),
+      numHttp2Connections(0),
+      numRequests(0),
+      numSuccesses(0),
+      numErrors(0),
+      numServerErrors(0),
+      numGarbage(0)
+{
+    if (this->options.successBody.empty())
+    {
+        this->options.successBody = DEFAULT_SUCCESS_BODY;
+    }
+    if (this->options.errorBody.empty())
+    {
+        this->options.errorBody = DEFAULT_ERROR_BODY;
+    }
+    if (this->options.garbageBody.empty())
+    {
+        this->options.garbageBody = DEFAULT_GARBAGE_BODY;
+    }
+}
+
+MockCombainServer::~MockCombainServer()
+{
+    this->stop();
+    for (auto &it : this->connections)
+    {
+        SSL_free(it.second->ssl);
+        close(it.second->fd);
+    }
+    SSL_CTX_free(this->sslCtx);
+    if (!this->caFile.empty())
+    {
+        unlink(this->caFile.c_str());
+    }
+    for (int fd : {this->listenFd, this->epollFd, this->stopFd})
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+}
+
+static bool ReadFile(const char *path, std::string *contents)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        perror(path);
+        return false;
+    }
+    char buf[4096];
+    size_t n;
+    contents->clear();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        contents->append(buf, n);
+    }
+    fclose(f);
+    return true;
+}
+
+bool MockCombainServer::ParseOption(const char *arg, Options *options)
+{
+    const char *eq = strchr(arg, '=');
+    const std::string name(arg, eq ? eq - arg : strlen(arg));
+    const char *value = eq ? eq + 1 : "";
+    if (name == "--port")
+    {
+        options->port = atoi(value);
+    }
+    else if (name == "--tls")
+    {
+        options->tls = true;
+    }
+    else if (name == "--http2")
+    {
+        options->http2 = true;
+    }
+    else if (name == "--connect-delay-ms")
+    {
+        options->connectDelayMs = strtoul(value, NULL, 10);
+    }
+    else if (name == "--idle-timeout-ms")
+    {
+        options->idleTimeoutMs = strtoul(value, NULL, 10);
+    }
+    else if (name == "--latency-ms")
+    {
+        options->latencyMs = strtoul(value, NULL, 10);
+    }
+    else if (name == "--jitter-ms")
+    {
+        options->jitterMs = strtoul(value, NULL, 10);
+    }
+    else if (name == "--error-rate")
+    {
+        options->errorRate = atof(value);
+    }
+    else if (name == "--server-error-rate")
+    {
+        options->serverErrorRate = atof(value);
+    }
+    else if (name == "--garbage-rate")
+    {
+        options->garbageRate = atof(value);
+    }
+    else if (name == "--seed")
+    {
+        options->seed = strtoul(value, NULL, 10);
+    }
+    else if (name == "--success-body")
+    {
+        return ReadFile(value, &options->successBody);
+    }
+    else if (name == "--error-body")
+    {
+        return ReadFile(value, &options->errorBody);
+    }
+    else if (name == "--garbage-body")
+    {
+        return ReadFile(value, &options->garbageBody);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+const char *MockCombainServer::GetOptionsHelp(void)
+{
+    return
+        "  --port=N                 Port to listen on. Default: any free port\n"
+        "  --tls                    Serve HTTPS with a self-signed certificate\n"
+        "  --http2                  Offer HTTP/2 as well as HTTP/1.1 over TLS\n"
+        "  --connect-delay-ms=N     Delay before serving a new connection, like handshakes\n"
+        "  --idle-timeout-ms=N      Close connections which are idle for this long\n"
+        "  --latency-ms=N           Delay before each response\n"
+        "  --jitter-ms=N            Up to this much extra delay, at random\n"
+        "  --error-rate=F           Fraction of lookups answered with a Combain error\n"
+        "  --server-error-rate=F    Fraction of lookups answered with HTTP 503\n"
+        "  --garbage-rate=F         Fraction of lookups answered with a body that isn't JSON\n"
+        "  --seed=N                 Seed for picking responses and jitter\n"
+        "  --success-body=FILE      Body to answer successful lookups with\n"
+        "  --error-body=FILE        Body to answer failed lookups with\n"
+        "  --garbage-body=FILE      Body to answer garbage lookups with\n";
+}
+
+bool MockCombainServer::start(void)
+{
+    if (this->options.http2 && !this->options.tls)
+    {
+        fprintf(stderr, "mock server: HTTP/2 is only offered over TLS, so needs --tls\n");
+        return false;
+    }
+    if (this->options.tls && !this->createTlsContext())
+    {
+        return false;
+    }
+
+    this->listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    const int one = 1;
+    setsockopt(this->listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(this->options.port);
+    socklen_t addrLen = sizeof(addr);
+    if (bind(this->listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(this->listenFd, SOMAXCONN) != 0 ||
+        getsockname(this->listenFd, (struct sockaddr *)&addr, &addrLen) != 0)
+    {
+        perror("mock server");
+        return false;
+    }
+    this->port = ntohs(addr.sin_port);
+
+    this->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    this->stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    epoll_ctl(this->epollFd, EPOLL_CTL_ADD, this->listenFd, &ev);
+    ev.data.u64 = UINT64_MAX;
+    epoll_ctl(this->epollFd, EPOLL_CTL_ADD, this->stopFd, &ev);
+
+    this->thread = std::thread(&MockCombainServer::run, this);
+    return true;
+}
+
+void MockCombainServer::stop(void)
+{
+    if (this->thread.joinable())
+    {
+        const uint64_t one = 1;
+        if (write(this->stopFd, &one, sizeof(one)) == sizeof(one))
+        {
+            this->thread.join();
+        }
+    }
+}
+
+std::string MockCombainServer::getUrl(void) const
+{
+    return std::string(this->options.tls ? "https" : "http") + "://127.0.0.1:" +
+        std::to_string(this->port) + "/";
+}
+
+const std::string &MockCombainServer::getCaFile(void) const
+{
+    return this->caFile;
+}
+
+MockCombainServer::Stats MockCombainServer::getStats(void) const
+{
+    return Stats{
+        this->numConnections.load(),
+        this->numHttp2Connections.load(),
+        this->numRequests.load(),
+        this->numSuccesses.load(),
+        this->numErrors.load(),
+        this->numServerErrors.load(),
+        this->numGarbage.load()};
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Generates a self-signed certificate for 127.0.0.1 and writes it to a temporary file for clients
+ * to trust.
+ */
+//--------------------------------------------------------------------------------------------------
+bool MockCombainServer::createTlsContext(void)
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -60 * 60);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(
+        name, "CN", MBSTRING_ASC, (const unsigned char *)"127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509V3_CTX v3;
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+    X509_EXTENSION *san =
+        X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name, "IP:127.0.0.1,DNS:localhost");
+    X509_add_ext(cert, san, -1);
+    X509_EXTENSION_free(san);
+    X509_sign(cert, key, EVP_sha256());
+
+    char path[] = "/tmp/combainMockCaXXXXXX";
+    const int fd = mkstemp(path);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    bool ok = (f != NULL) && PEM_write_X509(f, cert);
+    if (f)
+    {
+        ok = (fclose(f) == 0) && ok;
+        this->caFile = path;
+    }
+
+    this->sslCtx = SSL_CTX_new(TLS_server_method());
+    ok = ok && SSL_CTX_use_certificate(this->sslCtx, cert) == 1 &&
+        SSL_CTX_use_PrivateKey(this->sslCtx, key) == 1;
+    SSL_CTX_set_mode(
+        this->sslCtx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_alpn_select_cb(this->sslCtx, SelectAlpn, &this->options.http2);
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    if (!ok)
+    {
+        fprintf(stderr, "mock server: couldn't set up TLS\n");
+        ERR_print_errors_fp(stderr);
+    }
+    return ok;
+}
+
+void MockCombainServer::run(void)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    for (;;)
+    {
+        const int n = epoll_wait(
+            this->epollFd, events, MAX_EPOLL_EVENTS, this->getWaitTimeoutMs(NowUs()));
+        for (int i = 0; i < n; i++)
+        {
+            const uint64_t id = events[i].data.u64;
+            if (id == UINT64_MAX)
+            {
+                return;
+            }
+            if (id == 0)
+            {
+                this->accept();
+                continue;
+            }
+            auto it = this->connections.find(id);
+            if (it == this->connections.end())
+            {
+                continue;
+            }
+            Connection *c = it->second.get();
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            {
+                this->handleReadable(c);
+            }
+            else if ((events[i].events & EPOLLOUT) && !this->flushOutput(c))
+            {
+                this->closeConnection(c);
+            }
+            else
+            {
+                this->updateEvents(c);
+            }
+        }
+        const uint64_t nowUs = NowUs();
+        this->serveDelayedConnections(nowUs);
+        this->sendDueResponses(nowUs);
+        this->closeIdleConnections(nowUs);
+    }
+}
+
+void MockCombainServer::accept(void)
+{
+    for (;;)
+    {
+        const int fd = accept4(this->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            return;
+        }
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::unique_ptr<Connection> c(new Connection());
+        c->id = this->nextConnectionId++;
+        c->fd = fd;
+        c->ssl = NULL;
+        c->handshakeDone = !this->options.tls;
+        c->continueSent = false;
+        c->waitingForWrite = false;
+        c->http2 = false;
+        c->prefaceReceived = false;
+        c->readyUs = NowUs() + this->options.connectDelayMs * 1000ULL;
+        c->lastActiveUs = c->readyUs;
+        c->outstanding = 0;
+        c->lastStreamId = 0;
+        if (this->options.tls)
+        {
+            c->ssl = SSL_new(this->sslCtx);
+            SSL_set_fd(c->ssl, fd);
+            SSL_set_accept_state(c->ssl);
+        }
+
+        // Not watched until its delay is up, so the client's first bytes wait in the socket
+        if (this->options.connectDelayMs > 0)
+        {
+            this->delayedConnections.push_back(c->id);
+        }
+        else
+        {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.u64 = c->id;
+            epoll_ctl(this->epollFd, EPOLL_CTL_ADD, fd, &ev);
+        }
+        this->connections.emplace(c->id, std::move(c));
+        this->numConnections++;
+    }
+}
+
+void MockCombainServer::serveDelayedConnections(uint64_t nowUs)
+{
+    while (!this->delayedConnections.empty())
+    {
+        auto it = this->connections.find(this->delayedConnections.front());
+        if (it != this->connections.end())
+        {
+            Connection *c = it->second.get();
+            if (c->readyUs > nowUs)
+            {
+                return;
+            }
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.u64 = c->id;
+            epoll_ctl(this->epollFd, EPOLL_CTL_ADD, c->fd, &ev);
+        }
+        this->delayedConnections.pop_front();
+    }
+}
+
+void MockCombainServer::closeIdleConnections(uint64_t nowUs)
+{
+    if (this->options.idleTimeoutMs == 0)
+    {
+        return;
+    }
+    const uint64_t timeoutUs = this->options.idleTimeoutMs * 1000ULL;
+    for (auto it = this->connections.begin(); it != this->connections.end();)
+    {
+        Connection *c = (it++)->second.get();
+        if (c->outstanding == 0 && nowUs - c->lastActiveUs >= timeoutUs && c->readyUs <= nowUs)
+        {
+            if (c->http2)
+            {
+                // Tell the client that no more streams will be accepted, as a real server would
+                char payload[8] = {};
+                payload[0] = static_cast<char>(c->lastStreamId >> 24);
+                payload[1] = static_cast<char>(c->lastStreamId >> 16);
+                payload[2] = static_cast<char>(c->lastStreamId >> 8);
+                payload[3] = static_cast<char>(c->lastStreamId);
+                this->sendHttp2Frame(c, HTTP2_GOAWAY, 0, 0, payload, sizeof(payload));
+                this->flushOutput(c);
+            }
+            this->closeConnection(c);
+        }
+    }
+}
+
+void MockCombainServer::closeConnection(Connection *c)
+{
+    epoll_ctl(this->epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+    SSL_free(c->ssl);
+    close(c->fd);
+    // Responses still pending for it are dropped when they come due
+    this->connections.erase(c->id);
+}
+
+void MockCombainServer::handleReadable(Connection *c)
+{
+    if (!c->handshakeDone && !this->handshake(c))
+    {
+        this->closeConnection(c);
+        return;
+    }
+    if (c->handshakeDone)
+    {
+        c->lastActiveUs = NowUs();
+        bool open = this->readInput(c);
+        if (c->http2)
+        {
+            open = this->processHttp2(c) && open;
+        }
+        else
+        {
+            this->processHttp1(c);
+        }
+        if (!open || !this->flushOutput(c))
+        {
+            this->closeConnection(c);
+            return;
+        }
+    }
+    this->updateEvents(c);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Advances the TLS handshake.
+ *
+ * @return false if it failed
+ */
+//--------------------------------------------------------------------------------------------------
+bool MockCombainServer::handshake(Connection *c)
+{
+    const int res = SSL_do_handshake(c->ssl);
+    if (res == 1)
+    {
+        c->handshakeDone = true;
+        const unsigned char *protocol;
+        unsigned int protocolLen;
+        SSL_get0_alpn_selected(c->ssl, &protocol, &protocolLen);
+        if (protocolLen == 2 && memcmp(protocol, "h2", 2) == 0)
+        {
+            c->http2 = true;
+            this->numHttp2Connections++;
+
+            // The server's preface is its SETTINGS
+            char settings[6] = {0, HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0,
+                HTTP2_MAX_CONCURRENT_STREAMS};
+            this->sendHttp2Frame(c, HTTP2_SETTINGS, 0, 0, settings, sizeof(settings));
+        }
+        return true;
+    }
+    const int err = SSL_get_error(c->ssl, res);
+    return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads everything available from the connection into its input buffer.
+ *
+ * @return false if the peer has closed the connection or it failed
+ */
+//--------------------------------------------------------------------------------------------------
+bool MockCombainServer::readInput(Connection *c)
+{
+    char buf[READ_CHUNK_BYTES];
+    for (;;)
+    {
+        if (c->ssl)
+        {
+            const int n = SSL_read(c->ssl, buf, sizeof(buf));
+            if (n > 0)
+            {
+                c->in.append(buf, n);
+                continue;
+            }
+            const int err = SSL_get_error(c->ssl, n);
+            return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+        }
+
+        const ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n > 0)
+        {
+            c->in.append(buf, n);
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Writes as much of the output buffer as the connection will take.
+ *
+ * @return false if the connection failed
+ */
+//--------------------------------------------------------------------------------------------------
+bool MockCombainServer::flushOutput(Connection *c)
+{
+    while (!c->out.empty())
+    {
+        if (c->ssl)
+        {
+            const int n = SSL_write(c->ssl, c->out.data(), c->out.size());
+            if (n > 0)
+            {
+                c->out.erase(0, n);
+                continue;
+            }
+            const int err = SSL_get_error(c->ssl, n);
+            return err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ;
+        }
+
+        const ssize_t n = send(c->fd, c->out.data(), c->out.size(), MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            c->out.erase(0, n);
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    }
+    return true;
+}
+
+void MockCombainServer::updateEvents(Connection *c)
+{
+    const bool wantWrite = !c->out.empty();
+    if (wantWrite != c->waitingForWrite)
+    {
+        struct epoll_event ev = {};
+        ev.events = wantWrite ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        ev.data.u64 = c->id;
+        epoll_ctl(this->epollFd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->waitingForWrite = wantWrite;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Schedules a response to every complete HTTP/1.1 request in the input buffer.
+ */
+//--------------------------------------------------------------------------------------------------
+void MockCombainServer::processHttp1(Connection *c)
+{
+    for (;;)
+    {
+        const size_t headerEnd = c->in.find("\r\n\r\n");
+        if (headerEnd == std::string::npos)
+        {
+            return;
+        }
+
+        size_t contentLength = 0;
+        bool expectContinue = false;
+        size_t lineStart = c->in.find("\r\n") + 2;
+        while (lineStart < headerEnd)
+        {
+            const size_t lineEnd = c->in.find("\r\n", lineStart);
+            std::string line = c->in.substr(lineStart, lineEnd - lineStart);
+            std::transform(line.begin(), line.end(), line.begin(), ::tolower);
+            if (line.compare(0, 15, "content-length:") == 0)
+            {
+                contentLength = strtoul(line.c_str() + 15, NULL, 10);
+            }
+            else if (line.compare(0, 7, "expect:") == 0 &&
+                     line.find("100-continue") != std::string::npos)
+            {
+                expectContinue = true;
+            }
+            lineStart = lineEnd + 2;
+        }
+
+        const size_t requestEnd = headerEnd + 4 + contentLength;
+        if (c->in.size() < requestEnd)
+        {
+            if (expectContinue && !c->continueSent)
+            {
+                c->out += "HTTP/1.1 100 Continue\r\n\r\n";
+                c->continueSent = true;
+            }
+            return;
+        }
+
+        // Only POSTs are lookups. Anything else, such as the service's warm-up HEAD, gets an
+        // empty 200.
+        const bool isPost = (c->in.compare(0, 5, "POST ") == 0);
+        c->in.erase(0, requestEnd);
+        c->continueSent = false;
+        c->outstanding++;
+        if (isPost)
+        {
+            this->scheduleResponse(c, 0);
+        }
+        else
+        {
+            this->pending.push(PendingResponse{NowUs(), c->id, 0, 200, NULL});
+        }
+    }
+}
+
+static uint32_t ReadUint32(const std::string &s, size_t offset)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(s.data() + offset);
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Handles every complete HTTP/2 frame in the input buffer, scheduling a response to each stream
+ * whose request has ended.
+ *
+ * @return false if the client didn't start with the HTTP/2 preface
+ */
+//--------------------------------------------------------------------------------------------------
+bool MockCombainServer::processHttp2(Connection *c)
+{
+    if (!c->prefaceReceived)
+    {
+        if (c->in.size() < HTTP2_PREFACE_BYTES)
+        {
+            return true;
+        }
+        if (c->in.compare(0, HTTP2_PREFACE_BYTES, HTTP2_PREFACE) != 0)
+        {
+            return false;
+        }
+        c->in.erase(0, HTTP2_PREFACE_BYTES);
+        c->prefaceReceived = true;
+    }
+
+    size_t offset = 0;
+    while (c->in.size() - offset >= HTTP2_FRAME_HEADER_BYTES)
+    {
+        const uint32_t length = ReadUint32(c->in, offset) >> 8;
+        if (c->in.size() - offset - HTTP2_FRAME_HEADER_BYTES < length)
+        {
+            break;
+        }
+        const uint8_t type = c->in[offset + 3];
+        const uint8_t flags = c->in[offset + 4];
+        const uint32_t streamId = ReadUint32(c->in, offset + 5) & 0x7fffffff;
+        const char *payload = c->in.data() + offset + HTTP2_FRAME_HEADER_BYTES;
+        offset += HTTP2_FRAME_HEADER_BYTES + length;
+
+        switch (type)
+        {
+            case HTTP2_HEADERS:
+                // Lookups are POSTs with a body. Anything else, such as a warm-up, ends its stream
+                // with its headers and gets an empty 200.
+                c->streams.insert(streamId);
+                c->lastStreamId = std::max(c->lastStreamId, streamId);
+                c->outstanding++;
+                if (flags & HTTP2_FLAG_END_STREAM)
+                {
+                    this->pending.push(PendingResponse{NowUs(), c->id, streamId, 200, NULL});
+                }
+                break;
+
+            case HTTP2_DATA:
+                if (length > 0)
+                {
+                    // Give back the flow control window that the data used, for the connection and
+                    // for the stream if more is to come on it
+                    char increment[4] = {static_cast<char>(length >> 24),
+                        static_cast<char>(length >> 16), static_cast<char>(length >> 8),
+                        static_cast<char>(length)};
+                    this->sendHttp2Frame(c, HTTP2_WINDOW_UPDATE, 0, 0, increment, 4);
+                    if (!(flags & HTTP2_FLAG_END_STREAM))
+                    {
+                        this->sendHttp2Frame(c, HTTP2_WINDOW_UPDATE, 0, streamId, increment, 4);
+                    }
+                }
+                if ((flags & HTTP2_FLAG_END_STREAM) && c->streams.count(streamId))
+                {
+                    this->scheduleResponse(c, streamId);
+                }
+                break;
+
+            case HTTP2_RST_STREAM:
+                // Its response is dropped when it comes due
+                c->streams.erase(streamId);
+                break;
+
+            case HTTP2_SETTINGS:
+                if (!(flags & HTTP2_FLAG_ACK))
+                {
+                    this->sendHttp2Frame(c, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+                }
+                break;
+
+            case HTTP2_PING:
+                if (!(flags & HTTP2_FLAG_ACK))
+                {
+                    this->sendHttp2Frame(c, HTTP2_PING, HTTP2_FLAG_ACK, 0, payload, length);
+                }
+                break;
+
+            default:
+                // WINDOW_UPDATE, PRIORITY, GOAWAY, CONTINUATION. Response bodies are small enough
+                // not to need the client's flow control window, and a client which is going away
+                // closes the connection itself.
+                break;
+        }
+    }
+    c->in.erase(0, offset);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Picks the kind of response for a lookup and when to send it.
+ */
+//--------------------------------------------------------------------------------------------------
+void MockCombainServer::scheduleResponse(Connection *c, uint32_t streamId)
+{
+    this->numRequests++;
+    PendingResponse r;
+    r.connectionId = c->id;
+    r.streamId = streamId;
+
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    double x = unit(this->random);
+    if ((x -= this->options.serverErrorRate) < 0.0)
+    {
+        r.status = 503;
+        r.body = NULL;
+        this->numServerErrors++;
+    }
+    else if ((x -= this->options.errorRate) < 0.0)
+    {
+        r.status = 400;
+        r.body = &this->options.errorBody;
+        this->numErrors++;
+    }
+    else if ((x -= this->options.garbageRate) < 0.0)
+    {
+        r.status = 200;
+        r.body = &this->options.garbageBody;
+        this->numGarbage++;
+    }
+    else
+    {
+        r.status = 200;
+        r.body = &this->options.successBody;
+        this->numSuccesses++;
+    }
+
+    uint64_t delayUs = this->options.latencyMs * 1000ULL;
+    if (this->options.jitterMs > 0)
+    {
+        delayUs += std::uniform_int_distribution<uint64_t>(
+            0, this->options.jitterMs * 1000ULL)(this->random);
+    }
+    r.dueUs = NowUs() + delayUs;
+    this->pending.push(r);
+}
+
+void MockCombainServer::sendDueResponses(uint64_t nowUs)
+{
+    static const std::string NoBody;
+    while (!this->pending.empty() && this->pending.top().dueUs <= nowUs)
+    {
+        const PendingResponse r = this->pending.top();
+        this->pending.pop();
+        auto it = this->connections.find(r.connectionId);
+        if (it == this->connections.end())
+        {
+            continue;
+        }
+        Connection *c = it->second.get();
+        c->outstanding--;
+        c->lastActiveUs = nowUs;
+        if (!c->http2)
+        {
+            this->sendHttp1Response(c, r.status, r.body ? *r.body : NoBody);
+        }
+        else if (c->streams.erase(r.streamId))
+        {
+            this->sendHttp2Response(c, r.streamId, r.status, r.body ? *r.body : NoBody);
+        }
+        if (!this->flushOutput(c))
+        {
+            this->closeConnection(c);
+            continue;
+        }
+        this->updateEvents(c);
+    }
+}
+
+void MockCombainServer::sendHttp1Response(Connection *c, int status, const std::string &body)
+{
+    const char *reason = status == 200 ? "OK" : status == 400 ? "Bad Request" :
+        "Service Unavailable";
+    char header[160];
+    snprintf(
+        header,
+        sizeof(header),
+        "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n",
+        status,
+        reason,
+        body.size());
+    c->out += header;
+    c->out += body;
+}
+
+void MockCombainServer::sendHttp2Frame(
+    Connection *c, uint8_t type, uint8_t flags, uint32_t streamId, const char *payload,
+    size_t length)
+{
+    const char header[HTTP2_FRAME_HEADER_BYTES] = {
+        static_cast<char>(length >> 16),
+        static_cast<char>(length >> 8),
+        static_cast<char>(length),
+        static_cast<char>(type),
+        static_cast<char>(flags),
+        static_cast<char>(streamId >> 24),
+        static_cast<char>(streamId >> 16),
+        static_cast<char>(streamId >> 8),
+        static_cast<char>(streamId)};
+    c->out.append(header, sizeof(header));
+    c->out.append(payload, length);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sends a response on an HTTP/2 stream. The header block is HPACK-encoded without using the dynamic
+ * table or Huffman coding, so it can be written directly.
+ */
+//--------------------------------------------------------------------------------------------------
+void MockCombainServer::sendHttp2Response(
+    Connection *c, uint32_t streamId, int status, const std::string &body)
+{
+    std::string block;
+    if (status == 200)
+    {
+        // Indexed ":status: 200"
+        block += '\x88';
+    }
+    else
+    {
+        // Literal value for the name ":status"
+        const std::string value = std::to_string(status);
+        block += '\x08';
+        block += static_cast<char>(value.size());
+        block += value;
+    }
+    // Literal values for the names "content-type" and "content-length"
+    block += "\x0f\x10\x10" "application/json";
+    const std::string length = std::to_string(body.size());
+    block += "\x0f\x0d";
+    block += static_cast<char>(length.size());
+    block += length;
+
+    this->sendHttp2Frame(
+        c,
+        HTTP2_HEADERS,
+        HTTP2_FLAG_END_HEADERS | (body.empty() ? HTTP2_FLAG_END_STREAM : 0),
+        streamId,
+        block.data(),
+        block.size());
+    for (size_t offset = 0; offset < body.size(); offset += HTTP2_MAX_FRAME_BYTES)
+    {
+        const size_t n = std::min<size_t>(body.size() - offset, HTTP2_MAX_FRAME_BYTES);
+        this->sendHttp2Frame(
+            c,
+            HTTP2_DATA,
+            offset + n == body.size() ? HTTP2_FLAG_END_STREAM : 0,
+            streamId,
+            body.data() + offset,
+            n);
+    }
+}
+
+int MockCombainServer::getWaitTimeoutMs(uint64_t nowUs) const
+{
+    uint64_t dueUs = UINT64_MAX;
+    if (!this->pending.empty())
+    {
+        dueUs = this->pending.top().dueUs;
+    }
+    if (!this->delayedConnections.empty())
+    {
+        auto it = this->connections.find(this->delayedConnections.front());
+        dueUs = std::min(dueUs, it != this->connections.end() ? it->second->readyUs : nowUs);
+    }
+    if (this->options.idleTimeoutMs > 0)
+    {
+        for (const auto &it : this->connections)
+        {
+            if (it.second->outstanding == 0)
+            {
+                dueUs = std::min<uint64_t>(
+                    dueUs, it.second->lastActiveUs + this->options.idleTimeoutMs * 1000ULL);
+            }
+        }
+    }
+    if (dueUs == UINT64_MAX)
+    {
+        return -1;
+    }
+    // Round up so that whatever is due is due when epoll_wait() returns
+    return dueUs <= nowUs ? 0 : static_cast<int>((dueUs - nowUs + 999) / 1000);
+}
@@ -0,0 +1,146 @@
+#ifndef MOCK_COMBAIN_SERVER_H
+#define MOCK_COMBAIN_SERVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_st SSL;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * A local stand-in for the Combain positioning server, so that the service can be exercised and
+ * benchmarked without network access or API quota.
+ *
+ * Every POST is answered after a configurable latency with either a success body, a Combain error
+ * body with HTTP 400, an HTTP 503 with no body, or a body which isn't JSON, in proportions set by
+ * the options. With TLS, a self-signed certificate for 127.0.0.1 is generated at startup and
+ * written to a file that clients can trust with CURLOPT_CAINFO (the service's /CaFile), and
+ * HTTP/2 can be offered with ALPN. Only as much of HTTP/2 as libcurl needs is implemented: there's
+ * no HPACK decoding, so a request with a body is taken to be a lookup and one without to be a
+ * warm-up.
+ *
+ * To make the cost of setting up connections visible, new connections can be left unserved for a
+ * while, standing in for TCP and TLS handshake round trips, and idle connections can be closed as
+ * a real server would between bursts of lookups.
+ *
+ * The server runs on its own thread with a single epoll loop, so it adds little noise of its own
+ * to what is being measured.
+ */
+//--------------------------------------------------------------------------------------------------
+class MockCombainServer
+{
+public:
+    struct Options
+    {
+        uint16_t port = 0;             ///< 0 picks a free port
+        bool tls = false;
+        bool http2 = false;            ///< Offer HTTP/2 during the TLS handshake
+        uint32_t connectDelayMs = 0;   ///< Delay before a new connection is served
+        uint32_t idleTimeoutMs = 0;    ///< Close connections idle for this long. 0 never does.
+        uint32_t latencyMs = 0;        ///< Delay before each response is sent
+        uint32_t jitterMs = 0;         ///< Up to this much is added to the latency at random
+        double errorRate = 0.0;        ///< Fraction answered with a Combain error body
+        double serverErrorRate = 0.0;  ///< Fraction answered with HTTP 503
+        double garbageRate = 0.0;      ///< Fraction answered with a body which isn't JSON
+        uint32_t seed = 1;
+        std::string successBody;       ///< Empty for a built-in body
+        std::string errorBody;
+        std::string garbageBody;
+    };
+
+    struct Stats
+    {
+        uint64_t connections;
+        uint64_t http2Connections;
+        uint64_t requests;
+        uint64_t successes;
+        uint64_t errors;
+        uint64_t serverErrors;
+        uint64_t garbage;
+    };
+
+    explicit MockCombainServer(const Options &options);
+    ~MockCombainServer();
+
+    // Applies a --name=value command line option. Returns false if it isn't a server option.
+    static bool ParseOption(const char *arg, Options *options);
+    static const char *GetOptionsHelp(void);
+
+    bool start(void);
+    void stop(void);
+    std::string getUrl(void) const;
+    const std::string &getCaFile(void) const;
+    Stats getStats(void) const;
+
+private:
+    struct Connection;
+    struct PendingResponse
+    {
+        uint64_t dueUs;
+        uint64_t connectionId;
+        uint32_t streamId;
+        int status;
+        const std::string *body;
+
+        bool operator>(const PendingResponse &other) const { return dueUs > other.dueUs; }
+    };
+
+    bool createTlsContext(void);
+    void run(void);
+    void accept(void);
+    void serveDelayedConnections(uint64_t nowUs);
+    void closeIdleConnections(uint64_t nowUs);
+    void closeConnection(Connection *c);
+    void handleReadable(Connection *c);
+    bool handshake(Connection *c);
+    bool readInput(Connection *c);
+    bool flushOutput(Connection *c);
+    void updateEvents(Connection *c);
+    void processHttp1(Connection *c);
+    bool processHttp2(Connection *c);
+    void sendHttp2Frame(
+        Connection *c, uint8_t type, uint8_t flags, uint32_t streamId, const char *payload,
+        size_t length);
+    void scheduleResponse(Connection *c, uint32_t streamId);
+    void sendDueResponses(uint64_t nowUs);
+    void sendHttp1Response(Connection *c, int status, const std::string &body);
+    void sendHttp2Response(Connection *c, uint32_t streamId, int status, const std::string &body);
+    int getWaitTimeoutMs(uint64_t nowUs) const;
+
+    Options options;
+    std::string caFile;
+    SSL_CTX *sslCtx;
+    int listenFd;
+    int epollFd;
+    int stopFd;
+    uint16_t port;
+    std::thread thread;
+    std::mt19937 random;
+    uint64_t nextConnectionId;
+    std::map<uint64_t, std::unique_ptr<Connection>> connections;
+    // Connections waiting out connectDelayMs, oldest first
+    std::deque<uint64_t> delayedConnections;
+    typedef std::priority_queue<
+        PendingResponse, std::vector<PendingResponse>, std::greater<PendingResponse>>
+        PendingQueue;
+    PendingQueue pending;
+
+    std::atomic<uint64_t> numConnections;
+    std::atomic<uint64_t> numHttp2Connections;
+    std::atomic<uint64_t> numRequests;
+    std::atomic<uint64_t> numSuccesses;
+    std::atomic<uint64_t> numErrors;
+    std::atomic<uint64_t> numServerErrors;
+    std::atomic<uint64_t> numGarbage;
+};
+
+#endif // MOCK_COMBAIN_SERVER_H
@@ -0,0 +1,122 @@
+#include "JanssonResponseParser.h"
+
+#include <jansson.h>
+
+namespace baseline
+{
+
+static bool TryParseAsSuccess(json_t *responseJson, std::shared_ptr<CombainResult>& result);
+static bool TryParseAsError(json_t *responseJson, std::shared_ptr<CombainResult>& result);
+
+
+CombainResult::CombainResult(ma_combainLocation_Result_t type)
+    : type(type)
+{}
+
+
+ma_combainLocation_Result_t CombainResult::getType(void) const
+{
+    return this->type;
+}
+
+
+CombainSuccessResponse::CombainSuccessResponse(
+    double latitude, double longitude, double accuracyInMeters)
+    : CombainResult(MA_COMBAINLOCATION_RESULT_SUCCESS),
+      latitude(latitude),
+      longitude(longitude),
+      accuracyInMeters(accuracyInMeters)
+{}
+
+
+CombainErrorResponse::CombainErrorResponse(
+    uint16_t code, const std::string &message, std::initializer_list<CombainError> errors)
+    : CombainResult(MA_COMBAINLOCATION_RESULT_ERROR),
+      code(code),
+      message(message),
+      errors(errors)
+{}
+
+
+CombainResponseParseFailure::CombainResponseParseFailure(const std::string &unparsed)
+    : CombainResult(MA_COMBAINLOCATION_RESULT_RESPONSE_PARSE_FAILURE),
+      unparsed(unparsed)
+{}
+
+
+void JanssonParseResponse(
+    const std::string &responseJsonStr, std::shared_ptr<CombainResult>& result)
+{
+    // try to parse the response as json
+    json_error_t loadError;
+    const size_t loadFlags = 0;
+    json_t *responseJson = json_loads(responseJsonStr.c_str(), loadFlags, &loadError);
+    if (responseJson == NULL)
+    {
+        result.reset(new CombainResponseParseFailure(responseJsonStr));
+    }
+    else if (!TryParseAsSuccess(responseJson, result) &&
+             !TryParseAsError(responseJson, result))
+    {
+        result.reset(new CombainResponseParseFailure(responseJsonStr));
+    }
+
+    json_decref(responseJson);
+}
+
+static bool TryParseAsError(json_t *responseJson, std::shared_ptr<CombainResult>& result)
+{
+    const char *domain;
+    const char *reason;
+    const char *errorMessage;
+    int code;
+    const char *message;
+    const int errorUnpackRes = json_unpack(
+        responseJson,
+        "{s:{s:{s:s,s:s,s:s},s:i,s:s}}",
+        "error",
+        "errors",
+        "domain",
+        &domain,
+        "reason",
+        &reason,
+        "message",
+        &errorMessage,
+        "code",
+        &code,
+        "message",
+        &message);
+    const bool parseSuccess = (errorUnpackRes == 0);
+    if (parseSuccess)
+    {
+        result.reset(new CombainErrorResponse(code, message, {{domain, reason, errorMessage}}));
+    }
+
+    return parseSuccess;
+}
+
+static bool TryParseAsSuccess(json_t *responseJson, std::shared_ptr<CombainResult>& result)
+{
+    double latitude;
+    double longitude;
+    int accuracy;
+    const int successUnpackRes = json_unpack(
+        responseJson,
+        "{s:{s:F,s:F},s:i}",
+        "location",
+        "lat",
+        &latitude,
+        "lng",
+        &longitude,
+        "accuracy",
+        &accuracy);
+    const bool parseSuccess = (successUnpackRes == 0);
+    if (parseSuccess)
+    {
+        result.reset(new CombainSuccessResponse(latitude, longitude, accuracy));
+    }
+
+    return parseSuccess;
+}
+
+} // namespace baseline
@@ -0,0 +1,64 @@
+#ifndef JANSSON_RESPONSE_PARSER_H
+#define JANSSON_RESPONSE_PARSER_H
+
+#include "legato.h"
+#include "interfaces.h"
+
+#include <initializer_list>
+#include <list>
+#include <memory>
+#include <string>
+
+// Response parsing as it was before CombainParseResponse replaced it: json_loads() followed by a
+// json_unpack() pass for each kind of response, producing heap-allocated results. Kept unchanged,
+// apart from the namespace, as a baseline for combainMicroBench.
+namespace baseline
+{
+
+class CombainResult
+{
+public:
+    explicit CombainResult(ma_combainLocation_Result_t type);
+    ma_combainLocation_Result_t getType(void) const;
+
+private:
+    ma_combainLocation_Result_t type;
+};
+
+struct CombainSuccessResponse : public CombainResult
+{
+    CombainSuccessResponse(double latitude, double longitude, double accuracyInMeters);
+    double latitude;
+    double longitude;
+    double accuracyInMeters;
+};
+
+struct CombainError
+{
+    std::string domain;
+    std::string reason;
+    std::string message;
+};
+
+struct CombainErrorResponse : public CombainResult
+{
+    CombainErrorResponse(
+        uint16_t code, const std::string &message, std::initializer_list<CombainError> errors);
+    uint16_t code;
+    std::string message;
+    std::list<CombainError> errors;
+};
+
+struct CombainResponseParseFailure : public CombainResult
+{
+    explicit CombainResponseParseFailure(const std::string& unparsed);
+    std::string unparsed;
+};
+
+// The body of the old HandleResponseAvailable() for a non-empty response
+void JanssonParseResponse(
+    const std::string &responseJsonStr, std::shared_ptr<CombainResult>& result);
+
+} // namespace baseline
+
+#endif // JANSSON_RESPONSE_PARSER_H
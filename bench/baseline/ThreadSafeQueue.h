@@ -5,6 +5,9 @@
 #include <mutex>
 #include <condition_variable>
 
+// The queue which passed requests and responses between the main and HTTP threads before
+// SpscChannel replaced it, kept unchanged as a baseline for combainQueueBench.
+//
 // A threadsafe-queue.
 template <class T> class ThreadSafeQueue
 {
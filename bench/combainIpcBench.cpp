@@ -0,0 +1,548 @@
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compares the time a client spends handing a scan to the service one AP per call, with
+ * AppendWifiAccessPoint() and AppendCellTower(), against the batched AppendWifiAccessPoints() and
+ * AppendCellTowers().
+ *
+ *     combainIpcBench --min-time-ms=1000
+ *
+ * Legato IPC isn't available on a PC, so each call is made as Legato makes it: the client packs
+ * the parameters into a message, sends it over a Unix SOCK_SEQPACKET socket and blocks for the
+ * reply, while the service, on another thread, unpacks it, calls the service's function and
+ * replies. A scan is CreateLocationRequest(), the appends and DestroyLocationRequest(). The same
+ * scans are also timed with direct calls, which is the service's share of the cost.
+ *
+ * Allocations aren't counted, as the service is built without COMBAIN_COUNT_ALLOCATIONS here.
+ */
+//--------------------------------------------------------------------------------------------------
+#include "legato.h"
+#include "interfaces.h"
+#include "LegatoHost.h"
+#include "MicroBench.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Large enough for the biggest message, AppendWifiAccessPoints()
+#define MAX_MESSAGE_BYTES 4096
+
+enum MessageId : uint32_t
+{
+    MSG_CREATE,
+    MSG_APPEND_WIFI_AP,
+    MSG_APPEND_WIFI_APS,
+    MSG_APPEND_CELL_TOWER,
+    MSG_APPEND_CELL_TOWERS,
+    MSG_DESTROY,
+    MSG_STOP,
+};
+
+static const uint32_t ScanSizes[] = {10, 50, 100, 200};
+static const uint32_t CellsPerScan = 4;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * A scan in the packed layout of the batched functions. The per-AP path passes one entry at a time.
+ */
+//--------------------------------------------------------------------------------------------------
+struct Scan
+{
+    uint32_t numAps;
+    std::vector<uint8_t> bssids;
+    std::vector<uint8_t> ssids;
+    std::vector<uint8_t> ssidLengths;
+    std::vector<size_t> ssidOffsets;
+    std::vector<int16_t> signalStrengths;
+
+    std::vector<uint8_t> cellularTechnologies;
+    std::vector<uint16_t> mccs;
+    std::vector<uint16_t> mncs;
+    std::vector<uint32_t> lacs;
+    std::vector<uint32_t> cellIds;
+    std::vector<int32_t> cellSignalStrengths;
+};
+
+static Scan MakeScan(uint32_t numAps, uint32_t numCells, std::mt19937 &random)
+{
+    Scan scan;
+    scan.numAps = numAps;
+    for (uint32_t i = 0; i < numAps; i++)
+    {
+        for (int j = 0; j < MA_COMBAINLOCATION_WIFI_BSSID_BYTES; j++)
+        {
+            scan.bssids.push_back((j == 0) ? (random() & 0xfc) : random());
+        }
+        const uint8_t ssidLen = 4 + random() % 16;
+        scan.ssidOffsets.push_back(scan.ssids.size());
+        scan.ssidLengths.push_back(ssidLen);
+        for (uint8_t j = 0; j < ssidLen; j++)
+        {
+            scan.ssids.push_back('a' + random() % 26);
+        }
+        scan.signalStrengths.push_back(-30 - static_cast<int16_t>(random() % 65));
+    }
+    for (uint32_t i = 0; i < numCells; i++)
+    {
+        scan.cellularTechnologies.push_back(MA_COMBAINLOCATION_CELL_TECH_LTE);
+        scan.mccs.push_back(240);
+        scan.mncs.push_back(1 + random() % 8);
+        scan.lacs.push_back(random() % 65536);
+        scan.cellIds.push_back(random() % 268435456);
+        scan.cellSignalStrengths.push_back(-60 - static_cast<int32_t>(random() % 60));
+    }
+    return scan;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Packs values and arrays into a message, each array preceded by its number of elements.
+ */
+//--------------------------------------------------------------------------------------------------
+class Packer
+{
+public:
+    explicit Packer(MessageId id) : size(0) { this->put(id); }
+
+    template <typename T>
+    void put(const T &value)
+    {
+        memcpy(this->buf + this->size, &value, sizeof(value));
+        this->size += sizeof(value);
+    }
+
+    template <typename T>
+    void putArray(const T *values, size_t count)
+    {
+        this->put(static_cast<uint32_t>(count));
+        memcpy(this->buf + this->size, values, count * sizeof(T));
+        this->size += count * sizeof(T);
+    }
+
+    char buf[MAX_MESSAGE_BYTES];
+    size_t size;
+};
+
+class Unpacker
+{
+public:
+    Unpacker(const char *buf) : buf(buf), offset(0) {}
+
+    template <typename T>
+    T get(void)
+    {
+        T value;
+        memcpy(&value, this->buf + this->offset, sizeof(value));
+        this->offset += sizeof(value);
+        return value;
+    }
+
+    // The array is copied out, as ifgen's server stubs copy arrays out of the message
+    template <typename T>
+    size_t getArray(T *values)
+    {
+        const uint32_t count = this->get<uint32_t>();
+        memcpy(values, this->buf + this->offset, count * sizeof(T));
+        this->offset += count * sizeof(T);
+        return count;
+    }
+
+private:
+    const char *buf;
+    size_t offset;
+};
+
+static int ClientFd;
+
+static uint64_t Call(const Packer &message)
+{
+    LE_ASSERT(send(ClientFd, message.buf, message.size, 0) == (ssize_t)message.size);
+    uint64_t reply;
+    LE_ASSERT(recv(ClientFd, &reply, sizeof(reply), 0) == sizeof(reply));
+    return reply;
+}
+
+//----------------- Client side, as an ifgen client stub would be
+
+static ma_combainLocation_LocReqHandleRef_t IpcCreateLocationRequest(void)
+{
+    return reinterpret_cast<ma_combainLocation_LocReqHandleRef_t>(Call(Packer(MSG_CREATE)));
+}
+
+static le_result_t IpcAppendWifiAccessPoint(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const uint8_t *bssid,
+    const uint8_t *ssid,
+    size_t ssidSize,
+    int16_t signalStrength)
+{
+    Packer m(MSG_APPEND_WIFI_AP);
+    m.put(handle);
+    m.putArray(bssid, MA_COMBAINLOCATION_WIFI_BSSID_BYTES);
+    m.putArray(ssid, ssidSize);
+    m.put(signalStrength);
+    return static_cast<le_result_t>(Call(m));
+}
+
+static le_result_t IpcAppendWifiAccessPoints(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const uint8_t *bssids,
+    size_t bssidsSize,
+    const uint8_t *ssids,
+    size_t ssidsSize,
+    const uint8_t *ssidLengths,
+    size_t ssidLengthsSize,
+    const int16_t *signalStrengths,
+    size_t signalStrengthsSize)
+{
+    Packer m(MSG_APPEND_WIFI_APS);
+    m.put(handle);
+    m.putArray(bssids, bssidsSize);
+    m.putArray(ssids, ssidsSize);
+    m.putArray(ssidLengths, ssidLengthsSize);
+    m.putArray(signalStrengths, signalStrengthsSize);
+    return static_cast<le_result_t>(Call(m));
+}
+
+static le_result_t IpcAppendCellTower(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    ma_combainLocation_CellularTech_t cellularTechnology,
+    uint16_t mcc,
+    uint16_t mnc,
+    uint32_t lac,
+    uint32_t cellId,
+    int32_t signalStrength)
+{
+    Packer m(MSG_APPEND_CELL_TOWER);
+    m.put(handle);
+    m.put(cellularTechnology);
+    m.put(mcc);
+    m.put(mnc);
+    m.put(lac);
+    m.put(cellId);
+    m.put(signalStrength);
+    return static_cast<le_result_t>(Call(m));
+}
+
+static le_result_t IpcAppendCellTowers(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const uint8_t *cellularTechnologies,
+    const uint16_t *mccs,
+    const uint16_t *mncs,
+    const uint32_t *lacs,
+    const uint32_t *cellIds,
+    const int32_t *signalStrengths,
+    size_t count)
+{
+    Packer m(MSG_APPEND_CELL_TOWERS);
+    m.put(handle);
+    m.putArray(cellularTechnologies, count);
+    m.putArray(mccs, count);
+    m.putArray(mncs, count);
+    m.putArray(lacs, count);
+    m.putArray(cellIds, count);
+    m.putArray(signalStrengths, count);
+    return static_cast<le_result_t>(Call(m));
+}
+
+static void IpcDestroyLocationRequest(ma_combainLocation_LocReqHandleRef_t handle)
+{
+    Packer m(MSG_DESTROY);
+    m.put(handle);
+    Call(m);
+}
+
+//----------------- Service side, as an ifgen server stub would be
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Handles calls until the client stops. Runs on the thread which initialized the service.
+ */
+//--------------------------------------------------------------------------------------------------
+static void Serve(int fd)
+{
+    char buf[MAX_MESSAGE_BYTES];
+    bool stop = false;
+    while (!stop)
+    {
+        LE_ASSERT(recv(fd, buf, sizeof(buf), 0) > 0);
+        Unpacker u(buf);
+        uint64_t reply = 0;
+        switch (u.get<uint32_t>())
+        {
+            case MSG_CREATE:
+                reply = reinterpret_cast<uint64_t>(ma_combainLocation_CreateLocationRequest());
+                break;
+
+            case MSG_APPEND_WIFI_AP:
+            {
+                const auto handle = u.get<ma_combainLocation_LocReqHandleRef_t>();
+                uint8_t bssid[MA_COMBAINLOCATION_WIFI_BSSID_BYTES];
+                uint8_t ssid[MA_COMBAINLOCATION_WIFI_SSID_MAX_BYTES];
+                const size_t bssidSize = u.getArray(bssid);
+                const size_t ssidSize = u.getArray(ssid);
+                const auto signalStrength = u.get<int16_t>();
+                reply = ma_combainLocation_AppendWifiAccessPoint(
+                    handle, bssid, bssidSize, ssid, ssidSize, signalStrength);
+                break;
+            }
+
+            case MSG_APPEND_WIFI_APS:
+            {
+                const auto handle = u.get<ma_combainLocation_LocReqHandleRef_t>();
+                uint8_t bssids[MA_COMBAINLOCATION_WIFI_BSSID_BATCH_BYTES];
+                uint8_t ssids[MA_COMBAINLOCATION_WIFI_SSID_BATCH_BYTES];
+                uint8_t ssidLengths[MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND];
+                int16_t signalStrengths[MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND];
+                const size_t bssidsSize = u.getArray(bssids);
+                const size_t ssidsSize = u.getArray(ssids);
+                const size_t ssidLengthsSize = u.getArray(ssidLengths);
+                const size_t signalStrengthsSize = u.getArray(signalStrengths);
+                reply = ma_combainLocation_AppendWifiAccessPoints(
+                    handle, bssids, bssidsSize, ssids, ssidsSize, ssidLengths, ssidLengthsSize,
+                    signalStrengths, signalStrengthsSize);
+                break;
+            }
+
+            case MSG_APPEND_CELL_TOWER:
+            {
+                const auto handle = u.get<ma_combainLocation_LocReqHandleRef_t>();
+                const auto cellularTechnology = u.get<ma_combainLocation_CellularTech_t>();
+                const auto mcc = u.get<uint16_t>();
+                const auto mnc = u.get<uint16_t>();
+                const auto lac = u.get<uint32_t>();
+                const auto cellId = u.get<uint32_t>();
+                const auto signalStrength = u.get<int32_t>();
+                reply = ma_combainLocation_AppendCellTower(
+                    handle, cellularTechnology, mcc, mnc, lac, cellId, signalStrength);
+                break;
+            }
+
+            case MSG_APPEND_CELL_TOWERS:
+            {
+                const auto handle = u.get<ma_combainLocation_LocReqHandleRef_t>();
+                uint8_t technologies[MA_COMBAINLOCATION_MAX_CELL_TOWERS_PER_APPEND];
+                uint16_t mccs[MA_COMBAINLOCATION_MAX_CELL_TOWERS_PER_APPEND];
+                uint16_t mncs[MA_COMBAINLOCATION_MAX_CELL_TOWERS_PER_APPEND];
+                uint32_t lacs[MA_COMBAINLOCATION_MAX_CELL_TOWERS_PER_APPEND];
+                uint32_t cellIds[MA_COMBAINLOCATION_MAX_CELL_TOWERS_PER_APPEND];
+                int32_t signalStrengths[MA_COMBAINLOCATION_MAX_CELL_TOWERS_PER_APPEND];
+                const size_t technologiesSize = u.getArray(technologies);
+                const size_t mccsSize = u.getArray(mccs);
+                const size_t mncsSize = u.getArray(mncs);
+                const size_t lacsSize = u.getArray(lacs);
+                const size_t cellIdsSize = u.getArray(cellIds);
+                const size_t signalStrengthsSize = u.getArray(signalStrengths);
+                reply = ma_combainLocation_AppendCellTowers(
+                    handle, technologies, technologiesSize, mccs, mccsSize, mncs, mncsSize, lacs,
+                    lacsSize, cellIds, cellIdsSize, signalStrengths, signalStrengthsSize);
+                break;
+            }
+
+            case MSG_DESTROY:
+                ma_combainLocation_DestroyLocationRequest(
+                    u.get<ma_combainLocation_LocReqHandleRef_t>());
+                break;
+
+            case MSG_STOP:
+                stop = true;
+                break;
+        }
+        LE_ASSERT(send(fd, &reply, sizeof(reply), 0) == sizeof(reply));
+    }
+}
+
+//----------------- Scans
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * The functions that a scan is made with, either through IPC or called directly.
+ */
+//--------------------------------------------------------------------------------------------------
+struct Api
+{
+    ma_combainLocation_LocReqHandleRef_t (*create)(void);
+    le_result_t (*appendWifiAccessPoint)(
+        ma_combainLocation_LocReqHandleRef_t, const uint8_t *, const uint8_t *, size_t, int16_t);
+    le_result_t (*appendWifiAccessPoints)(
+        ma_combainLocation_LocReqHandleRef_t, const uint8_t *, size_t, const uint8_t *, size_t,
+        const uint8_t *, size_t, const int16_t *, size_t);
+    le_result_t (*appendCellTower)(
+        ma_combainLocation_LocReqHandleRef_t, ma_combainLocation_CellularTech_t, uint16_t,
+        uint16_t, uint32_t, uint32_t, int32_t);
+    le_result_t (*appendCellTowers)(
+        ma_combainLocation_LocReqHandleRef_t, const uint8_t *, const uint16_t *,
+        const uint16_t *, const uint32_t *, const uint32_t *, const int32_t *, size_t);
+    void (*destroy)(ma_combainLocation_LocReqHandleRef_t);
+};
+
+static le_result_t DirectAppendWifiAccessPoint(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const uint8_t *bssid,
+    const uint8_t *ssid,
+    size_t ssidSize,
+    int16_t signalStrength)
+{
+    return ma_combainLocation_AppendWifiAccessPoint(
+        handle, bssid, MA_COMBAINLOCATION_WIFI_BSSID_BYTES, ssid, ssidSize, signalStrength);
+}
+
+static le_result_t DirectAppendCellTowers(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const uint8_t *cellularTechnologies,
+    const uint16_t *mccs,
+    const uint16_t *mncs,
+    const uint32_t *lacs,
+    const uint32_t *cellIds,
+    const int32_t *signalStrengths,
+    size_t count)
+{
+    return ma_combainLocation_AppendCellTowers(
+        handle, cellularTechnologies, count, mccs, count, mncs, count, lacs, count, cellIds,
+        count, signalStrengths, count);
+}
+
+static const Api IpcApi = {
+    IpcCreateLocationRequest,
+    IpcAppendWifiAccessPoint,
+    IpcAppendWifiAccessPoints,
+    IpcAppendCellTower,
+    IpcAppendCellTowers,
+    IpcDestroyLocationRequest};
+
+static const Api DirectApi = {
+    ma_combainLocation_CreateLocationRequest,
+    DirectAppendWifiAccessPoint,
+    ma_combainLocation_AppendWifiAccessPoints,
+    ma_combainLocation_AppendCellTower,
+    DirectAppendCellTowers,
+    ma_combainLocation_DestroyLocationRequest};
+
+static void SubmitScanPerAp(const Api &api, const Scan &scan)
+{
+    const ma_combainLocation_LocReqHandleRef_t handle = api.create();
+    LE_ASSERT(handle != NULL);
+    for (uint32_t i = 0; i < scan.numAps; i++)
+    {
+        LE_ASSERT_OK(api.appendWifiAccessPoint(
+            handle,
+            &scan.bssids[i * MA_COMBAINLOCATION_WIFI_BSSID_BYTES],
+            &scan.ssids[scan.ssidOffsets[i]],
+            scan.ssidLengths[i],
+            scan.signalStrengths[i]));
+    }
+    for (size_t i = 0; i < scan.mccs.size(); i++)
+    {
+        LE_ASSERT_OK(api.appendCellTower(
+            handle,
+            static_cast<ma_combainLocation_CellularTech_t>(scan.cellularTechnologies[i]),
+            scan.mccs[i],
+            scan.mncs[i],
+            scan.lacs[i],
+            scan.cellIds[i],
+            scan.cellSignalStrengths[i]));
+    }
+    api.destroy(handle);
+}
+
+static void SubmitScanBatched(const Api &api, const Scan &scan)
+{
+    const ma_combainLocation_LocReqHandleRef_t handle = api.create();
+    LE_ASSERT(handle != NULL);
+    for (uint32_t first = 0; first < scan.numAps;
+         first += MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND)
+    {
+        const uint32_t n =
+            std::min<uint32_t>(scan.numAps - first, MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND);
+        const size_t ssidsStart = scan.ssidOffsets[first];
+        const size_t ssidsEnd =
+            (first + n < scan.numAps) ? scan.ssidOffsets[first + n] : scan.ssids.size();
+        LE_ASSERT_OK(api.appendWifiAccessPoints(
+            handle,
+            &scan.bssids[first * MA_COMBAINLOCATION_WIFI_BSSID_BYTES],
+            n * MA_COMBAINLOCATION_WIFI_BSSID_BYTES,
+            &scan.ssids[ssidsStart],
+            ssidsEnd - ssidsStart,
+            &scan.ssidLengths[first],
+            n,
+            &scan.signalStrengths[first],
+            n));
+    }
+    if (!scan.mccs.empty())
+    {
+        LE_ASSERT_OK(api.appendCellTowers(
+            handle,
+            scan.cellularTechnologies.data(),
+            scan.mccs.data(),
+            scan.mncs.data(),
+            scan.lacs.data(),
+            scan.cellIds.data(),
+            scan.cellSignalStrengths.data(),
+            scan.mccs.size()));
+    }
+    api.destroy(handle);
+}
+
+static void RunBenchmarks(void)
+{
+    std::mt19937 random(1);
+    for (uint32_t numAps : ScanSizes)
+    {
+        const Scan scan = MakeScan(numAps, CellsPerScan, random);
+        const uint32_t perApCalls = 2 + numAps + CellsPerScan;
+        const uint32_t batchedCalls = 3 +
+            (numAps + MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND - 1) /
+            MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND;
+        char name[64];
+
+        snprintf(name, sizeof(name), "per-ap ipc/%u aps (%u calls)", numAps, perApCalls);
+        MicroBench::Run(name, [&] (void) { SubmitScanPerAp(IpcApi, scan); });
+        snprintf(name, sizeof(name), "batched ipc/%u aps (%u calls)", numAps, batchedCalls);
+        MicroBench::Run(name, [&] (void) { SubmitScanBatched(IpcApi, scan); });
+        snprintf(name, sizeof(name), "per-ap direct/%u aps", numAps);
+        MicroBench::Run(name, [&] (void) { SubmitScanPerAp(DirectApi, scan); });
+        snprintf(name, sizeof(name), "batched direct/%u aps", numAps);
+        MicroBench::Run(name, [&] (void) { SubmitScanBatched(DirectApi, scan); });
+    }
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (!MicroBench::ParseOption(argv[i]))
+        {
+            fprintf(stderr, "Usage: %s [options]\n%s", argv[0], MicroBench::GetOptionsHelp());
+            return 1;
+        }
+    }
+
+    // Nothing is submitted, so the server is never contacted
+    LeHostConfigSet("/ServerUrl", "http://127.0.0.1:1/");
+    LeHostInitComponent();
+    LeHostSetCurrentSession(LeHostCreateSession());
+
+    int fds[2];
+    LE_ASSERT(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == 0);
+    ClientFd = fds[0];
+
+    // The client runs the benchmarks, and the direct calls too while the service waits for it
+    std::thread client([] (void) {
+        MicroBench::PrintHeader();
+        RunBenchmarks();
+        Call(Packer(MSG_STOP));
+    });
+    Serve(fds[1]);
+    client.join();
+
+    fflush(stdout);
+    // The service's HTTP thread is still running, so don't tear it down from under it
+    _exit(0);
+}
@@ -0,0 +1,481 @@
+//--------------------------------------------------------------------------------------------------
+/**
+ * End-to-end load test of the combainLocation service against the mock Combain server.
+ *
+ * The service's sources run in this process on top of the host Legato shim, with its HTTP thread
+ * talking to a MockCombainServer over loopback. Simulated clients each create a request with a
+ * random scan, submit it and wait for the result before starting the next one, as the combain CLI
+ * does. Throughput and the percentiles of the end-to-end latency, from CreateLocationRequest() to
+ * the result handler, are reported at the end.
+ *
+ * With --burst, all clients instead submit a request at the same moment, as when several apps
+ * want a location at once, and wait for the whole burst to be answered before the next one. The
+ * time to answer each burst is reported too. With the mock server's --connect-delay-ms and an
+ * --idle-timeout-ms shorter than --burst-gap-ms, each burst has to set up its connections again.
+ *
+ *     combainLoadTest --clients=32 --requests=5000 --latency-ms=100 --jitter-ms=50
+ *     combainLoadTest --burst=20 --tls --http2 --connect-delay-ms=300 --idle-timeout-ms=500
+ */
+//--------------------------------------------------------------------------------------------------
+#include "legato.h"
+#include "interfaces.h"
+#include "LegatoHost.h"
+#include "MockCombainServer.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#define API_KEY "bench"
+
+struct LoadOptions
+{
+    uint32_t clients = 8;
+    uint32_t requests = 1000;
+    uint32_t aps = 10;
+    uint32_t cells = 0;
+    uint32_t thinkMs = 0;
+    uint32_t burst = 0;         ///< Requests in each burst. 0 for a steady load.
+    uint32_t bursts = 10;
+    uint32_t burstGapMs = 1000;
+    std::string url;            ///< Server to use instead of starting the mock server
+    std::vector<std::pair<std::string, std::string>> config;
+};
+
+struct Client
+{
+    le_msg_SessionRef_t session;
+    ma_combainLocation_LocReqHandleRef_t handle;
+    uint64_t startUs;
+    le_timer_Ref_t thinkTimer;
+};
+
+static LoadOptions Options;
+static std::vector<std::unique_ptr<Client>> Clients;
+static std::mt19937 Random(1);
+static uint32_t NumStarted;
+static uint32_t NumCompleted;
+static uint32_t NumSubmitFailures;
+static uint32_t ResultCounts[MA_COMBAINLOCATION_MAX_RESULT_TYPES];
+static std::vector<uint64_t> LatenciesUs;
+static uint64_t FirstStartUs;
+static uint64_t LastCompleteUs;
+static le_timer_Ref_t BurstTimer;
+static uint64_t BurstStartUs;
+static uint32_t BurstCompleted;
+static std::vector<uint64_t> BurstDurationsUs;
+
+static void StartRequest(Client *client);
+
+static uint64_t NowUs(void)
+{
+    const le_clk_Time_t now = le_clk_GetRelativeTime();
+    return static_cast<uint64_t>(now.sec) * 1000000 + now.usec;
+}
+
+static uint64_t Percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    // Nearest rank
+    size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.999999);
+    return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Appends a random scan, as a client would after a WiFi scan, in batches of the maximum size.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool AppendScan(ma_combainLocation_LocReqHandleRef_t handle)
+{
+    std::uniform_int_distribution<uint32_t> byte(0, 255);
+    std::uniform_int_distribution<int> signal(-90, -40);
+    const uint32_t batchSize = MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND;
+    for (uint32_t first = 0; first < Options.aps; first += batchSize)
+    {
+        const uint32_t n = std::min(Options.aps - first, batchSize);
+        uint8_t bssids[MA_COMBAINLOCATION_WIFI_BSSID_BATCH_BYTES];
+        uint8_t ssids[MA_COMBAINLOCATION_WIFI_SSID_BATCH_BYTES];
+        uint8_t ssidLengths[MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND];
+        int16_t signalStrengths[MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND];
+        size_t ssidBytes = 0;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            for (int b = 0; b < MA_COMBAINLOCATION_WIFI_BSSID_BYTES; b++)
+            {
+                bssids[i * MA_COMBAINLOCATION_WIFI_BSSID_BYTES + b] = byte(Random);
+            }
+            // Globally administered unicast, like a real AP
+            bssids[i * MA_COMBAINLOCATION_WIFI_BSSID_BYTES] &= 0xFC;
+            const int len = snprintf(
+                (char *)&ssids[ssidBytes], MA_COMBAINLOCATION_WIFI_SSID_MAX_BYTES, "bench-ap-%u",
+                first + i);
+            ssidLengths[i] = len;
+            ssidBytes += len;
+            signalStrengths[i] = signal(Random);
+        }
+        if (ma_combainLocation_AppendWifiAccessPoints(
+                handle,
+                bssids,
+                n * MA_COMBAINLOCATION_WIFI_BSSID_BYTES,
+                ssids,
+                ssidBytes,
+                ssidLengths,
+                n,
+                signalStrengths,
+                n) != LE_OK)
+        {
+            return false;
+        }
+    }
+
+    std::uniform_int_distribution<uint32_t> cellId(1, 0xFFFFFFF);
+    for (uint32_t i = 0; i < Options.cells; i++)
+    {
+        if (ma_combainLocation_AppendCellTower(
+                handle, MA_COMBAINLOCATION_CELL_TECH_LTE, 240, 1, 1000 + i, cellId(Random),
+                signal(Random) - 20) != LE_OK)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void ThinkTimerExpired(le_timer_Ref_t timer)
+{
+    StartRequest(static_cast<Client *>(le_timer_GetContextPtr(timer)));
+}
+
+static void StartRequestDeferred(void *clientPtr, void *unused)
+{
+    StartRequest(static_cast<Client *>(clientPtr));
+}
+
+static void StartBurst(void)
+{
+    BurstStartUs = NowUs();
+    BurstCompleted = 0;
+    for (auto &client : Clients)
+    {
+        NumStarted++;
+        le_event_QueueFunction(StartRequestDeferred, client.get(), NULL);
+    }
+}
+
+static void BurstTimerExpired(le_timer_Ref_t timer)
+{
+    StartBurst();
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Records the outcome of a client's request and starts its next one.
+ *
+ * @param result    ma_combainLocation_Result_t, or -1 if the request couldn't be submitted
+ */
+//--------------------------------------------------------------------------------------------------
+static void CompleteRequest(Client *client, int result)
+{
+    const uint64_t nowUs = NowUs();
+    LatenciesUs.push_back(nowUs - client->startUs);
+    LastCompleteUs = nowUs;
+    if (result >= 0 && result < MA_COMBAINLOCATION_MAX_RESULT_TYPES)
+    {
+        ResultCounts[result]++;
+    }
+    else
+    {
+        NumSubmitFailures++;
+    }
+    NumCompleted++;
+    if (NumCompleted == Options.requests)
+    {
+        if (Options.burst > 0)
+        {
+            BurstDurationsUs.push_back(nowUs - BurstStartUs);
+        }
+        LeHostStopLoop();
+        return;
+    }
+
+    if (Options.burst > 0)
+    {
+        if (++BurstCompleted == Options.burst)
+        {
+            BurstDurationsUs.push_back(nowUs - BurstStartUs);
+            LE_ASSERT_OK(le_timer_Start(BurstTimer));
+        }
+        return;
+    }
+
+    // Not from within the result handler, as a client in another process couldn't either. The
+    // request is counted as started now so that clients completing together don't overshoot.
+    if (NumStarted < Options.requests)
+    {
+        NumStarted++;
+        if (Options.thinkMs > 0)
+        {
+            LE_ASSERT_OK(le_timer_Start(client->thinkTimer));
+        }
+        else
+        {
+            le_event_QueueFunction(StartRequestDeferred, client, NULL);
+        }
+    }
+}
+
+static void ResultHandler(
+    ma_combainLocation_LocReqHandleRef_t handle, ma_combainLocation_Result_t result, void *context)
+{
+    Client *client = static_cast<Client *>(context);
+    LeHostSetCurrentSession(client->session);
+    if (result == MA_COMBAINLOCATION_RESULT_SUCCESS)
+    {
+        double latitude, longitude, accuracy;
+        LE_ASSERT_OK(
+            ma_combainLocation_GetSuccessResponse(handle, &latitude, &longitude, &accuracy));
+    }
+    ma_combainLocation_DestroyLocationRequest(handle);
+    client->handle = NULL;
+    CompleteRequest(client, result);
+}
+
+static void StartRequest(Client *client)
+{
+    LeHostSetCurrentSession(client->session);
+    client->startUs = NowUs();
+    if (FirstStartUs == 0)
+    {
+        FirstStartUs = client->startUs;
+    }
+
+    client->handle = ma_combainLocation_CreateLocationRequest();
+    if (client->handle == NULL ||
+        !AppendScan(client->handle) ||
+        ma_combainLocation_SubmitLocationRequest(
+            client->handle, API_KEY, ResultHandler, client) != LE_OK)
+    {
+        if (client->handle)
+        {
+            ma_combainLocation_DestroyLocationRequest(client->handle);
+            client->handle = NULL;
+        }
+        CompleteRequest(client, -1);
+    }
+}
+
+static void PrintReport(const MockCombainServer *server)
+{
+    std::sort(LatenciesUs.begin(), LatenciesUs.end());
+    const double elapsedS = (LastCompleteUs - FirstStartUs) / 1e6;
+    printf("clients=%u requests=%u aps=%u cells=%u\n",
+        Options.clients, NumCompleted, Options.aps, Options.cells);
+    printf("elapsed %.3f s, throughput %.1f requests/s\n",
+        elapsedS, elapsedS > 0 ? NumCompleted / elapsedS : 0.0);
+    printf("latency ms: p50 %.2f  p95 %.2f  p99 %.2f  max %.2f\n",
+        Percentile(LatenciesUs, 50) / 1e3,
+        Percentile(LatenciesUs, 95) / 1e3,
+        Percentile(LatenciesUs, 99) / 1e3,
+        LatenciesUs.empty() ? 0.0 : LatenciesUs.back() / 1e3);
+    if (Options.burst > 0)
+    {
+        std::sort(BurstDurationsUs.begin(), BurstDurationsUs.end());
+        printf("burst ms: p50 %.2f  p95 %.2f  max %.2f  (%zu bursts of %u)\n",
+            Percentile(BurstDurationsUs, 50) / 1e3,
+            Percentile(BurstDurationsUs, 95) / 1e3,
+            BurstDurationsUs.empty() ? 0.0 : BurstDurationsUs.back() / 1e3,
+            BurstDurationsUs.size(),
+            Options.burst);
+    }
+    printf("results: success %u, error %u, parse failure %u, communication failure %u, "
+        "timeout %u, submit failed %u\n",
+        ResultCounts[MA_COMBAINLOCATION_RESULT_SUCCESS],
+        ResultCounts[MA_COMBAINLOCATION_RESULT_ERROR],
+        ResultCounts[MA_COMBAINLOCATION_RESULT_RESPONSE_PARSE_FAILURE],
+        ResultCounts[MA_COMBAINLOCATION_RESULT_COMMUNICATION_FAILURE],
+        ResultCounts[MA_COMBAINLOCATION_RESULT_TIMEOUT],
+        NumSubmitFailures);
+
+    ma_combainLocation_CircuitState_t circuitState;
+    uint32_t consecutiveFailures, circuitTrips, retries, fastFailures, cancelled;
+    uint32_t connectionsOpened, connectionsReused, http2Requests;
+    ma_combainLocation_GetConnectionStats(
+        &circuitState, &consecutiveFailures, &circuitTrips, &retries, &fastFailures, &cancelled,
+        &connectionsOpened, &connectionsReused, &http2Requests);
+    printf("service: connections opened %u, reused %u, http2 %u, retries %u, fast failures %u\n",
+        connectionsOpened, connectionsReused, http2Requests, retries, fastFailures);
+
+    if (server)
+    {
+        const MockCombainServer::Stats s = server->getStats();
+        printf("server: connections %" PRIu64 " (http2 %" PRIu64 "), lookups %" PRIu64 "\n",
+            s.connections, s.http2Connections, s.requests);
+    }
+}
+
+static void PrintUsage(const char *program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [options]\n"
+        "  --clients=N              Simulated clients, each with one request at a time\n"
+        "  --requests=N             Requests to complete in total\n"
+        "  --aps=N                  WiFi APs in each scan\n"
+        "  --cells=N                Cell towers in each scan\n"
+        "  --think-ms=N             Pause between a client's requests\n"
+        "  --burst=N                Submit N requests at once, in bursts, instead\n"
+        "  --bursts=N               Bursts to submit. Default: 10\n"
+        "  --burst-gap-ms=N         Pause after each burst is answered. Default: 1000\n"
+        "  --url=URL                Use this server instead of starting the mock server\n"
+        "  --config=/PATH=VALUE     Set a service config value, e.g. --config=/Http2=false\n"
+        "Mock server options:\n%s",
+        program,
+        MockCombainServer::GetOptionsHelp());
+}
+
+static bool ParseOption(const char *arg)
+{
+    const char *eq = strchr(arg, '=');
+    const std::string name(arg, eq ? eq - arg : strlen(arg));
+    const char *value = eq ? eq + 1 : "";
+    if (name == "--clients")
+    {
+        Options.clients = std::max(1, atoi(value));
+    }
+    else if (name == "--requests")
+    {
+        Options.requests = std::max(1, atoi(value));
+    }
+    else if (name == "--aps")
+    {
+        Options.aps = atoi(value);
+    }
+    else if (name == "--cells")
+    {
+        Options.cells = atoi(value);
+    }
+    else if (name == "--think-ms")
+    {
+        Options.thinkMs = atoi(value);
+    }
+    else if (name == "--burst")
+    {
+        Options.burst = atoi(value);
+    }
+    else if (name == "--bursts")
+    {
+        Options.bursts = std::max(1, atoi(value));
+    }
+    else if (name == "--burst-gap-ms")
+    {
+        Options.burstGapMs = atoi(value);
+    }
+    else if (name == "--url")
+    {
+        Options.url = value;
+    }
+    else if (name == "--config")
+    {
+        const char *valueEq = strchr(value, '=');
+        if (valueEq == NULL)
+        {
+            return false;
+        }
+        Options.config.emplace_back(std::string(value, valueEq - value), valueEq + 1);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    MockCombainServer::Options serverOptions;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!ParseOption(argv[i]) && !MockCombainServer::ParseOption(argv[i], &serverOptions))
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (Options.burst > 0)
+    {
+        Options.clients = Options.burst;
+        Options.requests = Options.burst * Options.bursts;
+    }
+
+    std::unique_ptr<MockCombainServer> server;
+    if (Options.url.empty())
+    {
+        server.reset(new MockCombainServer(serverOptions));
+        if (!server->start())
+        {
+            return 1;
+        }
+        LeHostConfigSet("/ServerUrl", server->getUrl().c_str());
+        LeHostConfigSet("/CaFile", server->getCaFile().c_str());
+    }
+    else
+    {
+        LeHostConfigSet("/ServerUrl", Options.url.c_str());
+    }
+    // Every client needs a request object, and results mustn't come from the cache
+    LeHostConfigSet("/MaxRequests", std::to_string(std::max(Options.clients, 64u)).c_str());
+    LeHostConfigSet("/ResultCache/Capacity", "0");
+    for (auto const& c : Options.config)
+    {
+        LeHostConfigSet(c.first.c_str(), c.second.c_str());
+    }
+
+    LeHostInitComponent();
+
+    LatenciesUs.reserve(Options.requests);
+    if (Options.burst > 0)
+    {
+        BurstTimer = le_timer_Create("Burst");
+        LE_ASSERT_OK(le_timer_SetHandler(BurstTimer, BurstTimerExpired));
+        LE_ASSERT_OK(le_timer_SetMsInterval(BurstTimer, Options.burstGapMs));
+    }
+    for (uint32_t i = 0; i < Options.clients && i < Options.requests; i++)
+    {
+        std::unique_ptr<Client> client(new Client());
+        client->session = LeHostCreateSession();
+        client->handle = NULL;
+        client->thinkTimer = le_timer_Create("ClientThink");
+        LE_ASSERT_OK(le_timer_SetHandler(client->thinkTimer, ThinkTimerExpired));
+        LE_ASSERT_OK(le_timer_SetContextPtr(client->thinkTimer, client.get()));
+        LE_ASSERT_OK(le_timer_SetMsInterval(client->thinkTimer, Options.thinkMs));
+        Clients.push_back(std::move(client));
+    }
+    if (Options.burst > 0)
+    {
+        StartBurst();
+    }
+    else
+    {
+        for (auto &client : Clients)
+        {
+            NumStarted++;
+            le_event_QueueFunction(StartRequestDeferred, client.get(), NULL);
+        }
+    }
+
+    LeHostRunLoop();
+    PrintReport(server.get());
+    // The service's HTTP thread is still running, so don't tear it down from under it
+    fflush(stdout);
+    _exit(0);
+}
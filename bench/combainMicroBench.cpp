@@ -0,0 +1,343 @@
+//--------------------------------------------------------------------------------------------------
+/**
+ * Measures the CPU and heap cost of building request bodies and parsing responses, so that
+ * serializer and parser changes can be compared on a PC and on target hardware.
+ *
+ *     combainMicroBench
+ *     combainMicroBench --filter=body/ --min-time-ms=1000
+ *     combainMicroBench --trace=combainTrace.bin
+ *
+ * Requests are built from synthetic scans of 1 to 500 APs, with and without cell towers. Responses
+ * are parsed from the files in bench/corpus and, with --trace, from the responses recorded in a
+ * trace file written by the service (see /Trace/Enable). When jansson is available, responses are
+ * also parsed the way the service did before CombainParseResponse, for comparison.
+ */
+//--------------------------------------------------------------------------------------------------
+#include "legato.h"
+#include "interfaces.h"
+#include "CombainRequestBuilder.h"
+#include "CombainResponseParser.h"
+#include "CombainTrace.h"
+#include "MicroBench.h"
+
+#include <dirent.h>
+#ifdef COMBAIN_BENCH_JANSSON
+#include <jansson.h>
+#include "baseline/JanssonResponseParser.h"
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+// As written by CombainTrace
+#define TRACE_FILE_MAGIC 0x43525443
+#define TRACE_FILE_VERSION 1
+
+static const uint32_t ScanSizes[] = {1, 10, 50, 200, 500};
+static const uint32_t CellsPerScan = 4;
+
+static std::string CorpusDir = COMBAIN_BENCH_CORPUS_DIR;
+static std::string TracePath;
+
+static std::vector<WifiApScanItem> MakeWifiScan(uint32_t numAps, std::mt19937 &random)
+{
+    static const char SsidChars[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_";
+    std::vector<WifiApScanItem> aps;
+    aps.reserve(numAps);
+    for (uint32_t i = 0; i < numAps; i++)
+    {
+        uint8_t bssid[6];
+        for (uint8_t &b : bssid)
+        {
+            b = random();
+        }
+        bssid[0] &= 0xfc;
+
+        // A few hidden networks, otherwise names of typical lengths
+        uint8_t ssid[32];
+        const size_t ssidLen = (random() % 10 == 0) ? 0 : 4 + random() % 16;
+        for (size_t j = 0; j < ssidLen; j++)
+        {
+            ssid[j] = SsidChars[random() % (sizeof(SsidChars) - 1)];
+        }
+
+        const int16_t signalStrength = -30 - static_cast<int16_t>(random() % 65);
+        aps.emplace_back(bssid, sizeof(bssid), ssid, ssidLen, signalStrength);
+    }
+    return aps;
+}
+
+static std::vector<CellTowerScanItem> MakeCellScan(uint32_t numCells, std::mt19937 &random)
+{
+    std::vector<CellTowerScanItem> towers;
+    for (uint32_t i = 0; i < numCells; i++)
+    {
+        CellTowerScanItem tower;
+        tower.cellularTechnology = MA_COMBAINLOCATION_CELL_TECH_LTE;
+        tower.mcc = 240;
+        tower.mnc = 1 + random() % 8;
+        tower.lac = random() % 65536;
+        tower.cellId = random() % 268435456;
+        tower.signalStrength = -60 - static_cast<int32_t>(random() % 60);
+        towers.push_back(tower);
+    }
+    return towers;
+}
+
+static void RunRequestBenchmarks(void)
+{
+    std::mt19937 random(1);
+    for (uint32_t numAps : ScanSizes)
+    {
+        for (uint32_t numCells : {0u, CellsPerScan})
+        {
+            const std::vector<WifiApScanItem> aps = MakeWifiScan(numAps, random);
+            const std::vector<CellTowerScanItem> towers = MakeCellScan(numCells, random);
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "/%u aps%s", numAps, numCells ? " + cells" : "");
+
+            // A reused builder, as the service keeps one in each pooled request record
+            CombainRequestBuilder builder;
+            MicroBench::Run(std::string("append") + suffix, [&] (void) {
+                builder.clear();
+                for (const WifiApScanItem &ap : aps)
+                {
+                    builder.appendWifiAccessPoint(ap);
+                }
+                for (const CellTowerScanItem &tower : towers)
+                {
+                    builder.appendCellTower(tower);
+                }
+            });
+
+            builder.clear();
+            builder.appendWifiAccessPoints(aps);
+            builder.appendCellTowers(towers);
+
+            // Includes formatting every BSSID and escaping every SSID
+            MicroBench::Run(std::string("body") + suffix, [&] (void) {
+                const std::string body = builder.generateRequestBody();
+                MicroBench::KeepValue(body);
+            });
+
+            std::string fingerprint;
+            MicroBench::Run(std::string("fingerprint") + suffix, [&] (void) {
+                builder.generateFingerprint(&fingerprint);
+                MicroBench::KeepValue(fingerprint);
+            });
+        }
+    }
+}
+
+static bool ReadFile(const std::string &path, std::string *contents)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+    {
+        perror(path.c_str());
+        return false;
+    }
+    char buf[4096];
+    size_t n;
+    contents->clear();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        contents->append(buf, n);
+    }
+    fclose(f);
+    return true;
+}
+
+#ifdef COMBAIN_BENCH_JANSSON
+// Through operator new, so that jansson's allocations are counted too
+static void *CountedJsonAlloc(size_t size)
+{
+    return ::operator new(size, std::nothrow);
+}
+
+static void CountedJsonFree(void *p)
+{
+    ::operator delete(p);
+}
+#endif
+
+static void RunParseBenchmark(const std::string &name, const std::string &body)
+{
+    CombainResult result;
+    MicroBench::Run("parse/" + name, [&] (void) {
+        result.clear();
+        CombainParseResponse(body, &result);
+        MicroBench::KeepValue(result);
+    });
+
+#ifdef COMBAIN_BENCH_JANSSON
+    std::shared_ptr<baseline::CombainResult> janssonResult;
+    MicroBench::Run("parse-jansson/" + name, [&] (void) {
+        janssonResult.reset();
+        baseline::JanssonParseResponse(body, janssonResult);
+        MicroBench::KeepValue(janssonResult);
+    });
+#endif
+}
+
+static bool RunCorpusBenchmarks(void)
+{
+    DIR *dir = opendir(CorpusDir.c_str());
+    if (dir == NULL)
+    {
+        perror(CorpusDir.c_str());
+        return false;
+    }
+    std::vector<std::string> names;
+    while (const struct dirent *entry = readdir(dir))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    for (const std::string &name : names)
+    {
+        std::string body;
+        if (!ReadFile(CorpusDir + "/" + name, &body))
+        {
+            return false;
+        }
+        RunParseBenchmark(name, body);
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Parses every response recorded in a trace file as one batch, reported per response.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool RunTraceBenchmark(void)
+{
+    std::string trace;
+    if (!ReadFile(TracePath, &trace))
+    {
+        return false;
+    }
+
+    CombainTrace::TraceFileHeader fileHeader;
+    if (trace.size() < sizeof(fileHeader))
+    {
+        fprintf(stderr, "%s: Not a trace file\n", TracePath.c_str());
+        return false;
+    }
+    memcpy(&fileHeader, trace.data(), sizeof(fileHeader));
+    if (fileHeader.magic != TRACE_FILE_MAGIC || fileHeader.version != TRACE_FILE_VERSION)
+    {
+        fprintf(stderr, "%s: Not a trace file, or an unsupported version\n", TracePath.c_str());
+        return false;
+    }
+
+    std::vector<std::string> responses;
+    size_t offset = sizeof(fileHeader);
+    CombainTrace::TraceRecordHeader header;
+    while (offset + sizeof(header) <= trace.size())
+    {
+        memcpy(&header, trace.data() + offset, sizeof(header));
+        offset += sizeof(header);
+        if (header.length > trace.size() - offset)
+        {
+            // Cut short, e.g. copied while the service was writing it
+            break;
+        }
+        const size_t length = header.length;
+        if (header.type == CombainTrace::RECORD_RESPONSE && length > 0)
+        {
+            responses.emplace_back(trace.data() + offset, length);
+        }
+        offset += length;
+    }
+    if (responses.empty())
+    {
+        fprintf(stderr, "%s: No responses recorded\n", TracePath.c_str());
+        return false;
+    }
+
+    CombainResult result;
+    char name[64];
+    snprintf(name, sizeof(name), "trace (%zu responses)", responses.size());
+    MicroBench::Run(std::string("parse/") + name, [&] (void) {
+        for (const std::string &body : responses)
+        {
+            result.clear();
+            CombainParseResponse(body, &result);
+            MicroBench::KeepValue(result);
+        }
+    }, responses.size());
+
+#ifdef COMBAIN_BENCH_JANSSON
+    std::shared_ptr<baseline::CombainResult> janssonResult;
+    MicroBench::Run(std::string("parse-jansson/") + name, [&] (void) {
+        for (const std::string &body : responses)
+        {
+            janssonResult.reset();
+            baseline::JanssonParseResponse(body, janssonResult);
+            MicroBench::KeepValue(janssonResult);
+        }
+    }, responses.size());
+#endif
+    return true;
+}
+
+static void PrintUsage(const char *program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --corpus=DIR             Directory of response bodies to parse. Default: %s\n"
+        "  --trace=FILE             Also parse the responses recorded in this trace file\n"
+        "%s",
+        program,
+        COMBAIN_BENCH_CORPUS_DIR,
+        MicroBench::GetOptionsHelp());
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--corpus=", 9) == 0)
+        {
+            CorpusDir = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--trace=", 8) == 0)
+        {
+            TracePath = argv[i] + 8;
+        }
+        else if (!MicroBench::ParseOption(argv[i]))
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+#ifdef COMBAIN_BENCH_JANSSON
+    json_set_alloc_funcs(CountedJsonAlloc, CountedJsonFree);
+#endif
+
+    MicroBench::PrintHeader();
+    RunRequestBenchmarks();
+    if (!RunCorpusBenchmarks())
+    {
+        return 1;
+    }
+    if (!TracePath.empty() && !RunTraceBenchmark())
+    {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+//--------------------------------------------------------------------------------------------------
+/**
+ * Runs the mock Combain server on its own, e.g. to point a device or the combain CLI at it:
+ *
+ *     combainMockServer --port=8080 --latency-ms=150 --error-rate=0.05
+ *     config set combainLocation:/ServerUrl http://<host>:8080/
+ */
+//--------------------------------------------------------------------------------------------------
+#include "MockCombainServer.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+static void PrintUsage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options]\n%s", program, MockCombainServer::GetOptionsHelp());
+}
+
+int main(int argc, char **argv)
+{
+    MockCombainServer::Options options;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!MockCombainServer::ParseOption(argv[i], &options))
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    MockCombainServer server(options);
+    if (!server.start())
+    {
+        return 1;
+    }
+    printf("Listening on %s\n", server.getUrl().c_str());
+    if (options.tls)
+    {
+        printf("CA certificate: %s\n", server.getCaFile().c_str());
+    }
+    fflush(stdout);
+
+    int signal;
+    sigwait(&signals, &signal);
+    server.stop();
+
+    const MockCombainServer::Stats stats = server.getStats();
+    printf(
+        "connections=%" PRIu64 " http2Connections=%" PRIu64 " requests=%" PRIu64
+        " successes=%" PRIu64 " errors=%" PRIu64 " serverErrors=%" PRIu64 " garbage=%" PRIu64 "\n",
+        stats.connections,
+        stats.http2Connections,
+        stats.requests,
+        stats.successes,
+        stats.errors,
+        stats.serverErrors,
+        stats.garbage);
+    return 0;
+}
@@ -0,0 +1,236 @@
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compares passing requests from one thread to another through SpscChannel, as the service does
+ * between its main and HTTP threads, with the mutex-based ThreadSafeQueue it replaced.
+ *
+ *     combainQueueBench --messages=500000
+ *
+ * A producer thread sends CombainHttpRequests with bodies of typical sizes to a consumer thread.
+ * Each new request's body is copied from a template, which stands in for generating it. Time is
+ * per message, end to end. Allocations are counted on both threads together.
+ *
+ * Where the service waits in its event loop or in curl_multi_wait(), the channel's producer and
+ * consumer yield the CPU, and ThreadSafeQueue's consumer waits on its condition variable.
+ */
+//--------------------------------------------------------------------------------------------------
+#include "legato.h"
+#include "interfaces.h"
+#include "CombainAllocCounter.h"
+#include "CombainHttp.h"
+#include "SpscChannel.h"
+#include "MicroBench.h"
+#include "baseline/ThreadSafeQueue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// As in combainLocationApi.cpp
+#define REQUEST_CHANNEL_CAPACITY 64
+#define DRAIN_BATCH_SIZE 64
+
+static uint64_t NumMessages = 200000;
+
+// Allocations made by a thread over the life of a benchmark
+struct ThreadAllocs
+{
+    uint64_t count;
+    uint64_t bytes;
+};
+
+class AllocMeter
+{
+public:
+    AllocMeter(void)
+        : count(CombainAllocCounterGet()), bytes(CombainAllocCounterGetBytes())
+    {}
+
+    ThreadAllocs get(void) const
+    {
+        const ThreadAllocs allocs = {
+            CombainAllocCounterGet() - this->count,
+            CombainAllocCounterGetBytes() - this->bytes};
+        return allocs;
+    }
+
+private:
+    uint64_t count;
+    uint64_t bytes;
+};
+
+static CombainHttpRequest MakeRequest(size_t bodyBytes)
+{
+    CombainHttpRequest request;
+    request.handle = reinterpret_cast<ma_combainLocation_LocReqHandleRef_t>(1);
+    request.apiKey = "ABCDEFGHIJKLMNOPQRSTUVWXYZ012345";
+    request.body.assign(bodyBytes, 'x');
+    request.submitTimeUs = 0;
+    request.priority = MA_COMBAINLOCATION_PRIORITY_NORMAL;
+    request.deadlineUs = 0;
+    return request;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Runs a producer on a new thread and a consumer on this one, and prints the time and allocations
+ * per message.
+ */
+//--------------------------------------------------------------------------------------------------
+template <typename Producer, typename Consumer>
+static void RunPair(const std::string &name, Producer producer, Consumer consumer)
+{
+    if (!MicroBench::IsSelected(name))
+    {
+        return;
+    }
+
+    ThreadAllocs producerAllocs = {};
+    const auto start = std::chrono::steady_clock::now();
+    std::thread producerThread([&] (void) {
+        AllocMeter meter;
+        producer();
+        producerAllocs = meter.get();
+    });
+    AllocMeter meter;
+    consumer();
+    const ThreadAllocs consumerAllocs = meter.get();
+    producerThread.join();
+    const auto end = std::chrono::steady_clock::now();
+
+    const double ops = static_cast<double>(NumMessages);
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    MicroBench::Result result;
+    result.iterations = NumMessages;
+    result.nsPerOp = elapsed.count() / ops;
+    result.allocsPerOp = (producerAllocs.count + consumerAllocs.count) / ops;
+    result.bytesPerOp = (producerAllocs.bytes + consumerAllocs.bytes) / ops;
+    MicroBench::Print(name, result);
+}
+
+static void RunThreadSafeQueue(const std::string &name, const CombainHttpRequest &prototype)
+{
+    ThreadSafeQueue<CombainHttpRequest> queue;
+    size_t received = 0;
+    RunPair(name,
+        [&] (void) {
+            for (uint64_t i = 0; i < NumMessages; i++)
+            {
+                // As the service used it, passing the request by value
+                queue.enqueue(prototype);
+            }
+        },
+        [&] (void) {
+            for (uint64_t i = 0; i < NumMessages; i++)
+            {
+                const CombainHttpRequest request = queue.dequeue();
+                received += request.body.size();
+            }
+        });
+    MicroBench::KeepValue(received);
+}
+
+static void RunChannelProducer(
+    SpscChannel<CombainHttpRequest> &channel, const CombainHttpRequest &prototype)
+{
+    for (uint64_t i = 0; i < NumMessages; i++)
+    {
+        CombainHttpRequest request = prototype;
+        while (!channel.tryPush(std::move(request)))
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static void RunSpscChannel(const std::string &name, const CombainHttpRequest &prototype)
+{
+    SpscChannel<CombainHttpRequest> channel(REQUEST_CHANNEL_CAPACITY);
+    size_t received = 0;
+    RunPair(name,
+        [&] (void) { RunChannelProducer(channel, prototype); },
+        [&] (void) {
+            CombainHttpRequest request;
+            for (uint64_t i = 0; i < NumMessages; i++)
+            {
+                while (!channel.tryPop(request))
+                {
+                    std::this_thread::yield();
+                }
+                received += request.body.size();
+            }
+        });
+    MicroBench::KeepValue(received);
+}
+
+static void RunSpscChannelDrain(const std::string &name, const CombainHttpRequest &prototype)
+{
+    SpscChannel<CombainHttpRequest> channel(REQUEST_CHANNEL_CAPACITY);
+    size_t received = 0;
+    RunPair(name,
+        [&] (void) { RunChannelProducer(channel, prototype); },
+        [&] (void) {
+            std::vector<CombainHttpRequest> batch;
+            batch.reserve(DRAIN_BATCH_SIZE);
+            uint64_t remaining = NumMessages;
+            while (remaining > 0)
+            {
+                batch.clear();
+                if (channel.drain(batch, DRAIN_BATCH_SIZE) == 0)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                for (const CombainHttpRequest &request : batch)
+                {
+                    received += request.body.size();
+                }
+                remaining -= batch.size();
+            }
+        });
+    MicroBench::KeepValue(received);
+}
+
+static void PrintUsage(const char *program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --messages=N             Requests to pass between the threads in each benchmark\n"
+        "  --filter=SUBSTRING       Run only benchmarks whose names contain this\n",
+        program);
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--messages=", 11) == 0)
+        {
+            NumMessages = std::max<uint64_t>(1, strtoull(argv[i] + 11, NULL, 10));
+        }
+        else if (strncmp(argv[i], "--filter=", 9) != 0 || !MicroBench::ParseOption(argv[i]))
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Bodies of about 1, 10 and 50 APs
+    static const size_t BodySizes[] = {340, 2800, 13700};
+
+    MicroBench::PrintHeader();
+    for (size_t bodyBytes : BodySizes)
+    {
+        const CombainHttpRequest prototype = MakeRequest(bodyBytes);
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "/%zu B", bodyBytes);
+        RunThreadSafeQueue(std::string("ThreadSafeQueue") + suffix, prototype);
+        RunSpscChannel(std::string("SpscChannel tryPop") + suffix, prototype);
+        RunSpscChannelDrain(std::string("SpscChannel drain") + suffix, prototype);
+    }
+    return 0;
+}
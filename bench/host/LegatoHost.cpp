@@ -0,0 +1,582 @@
+#include "legato.h"
+#include "interfaces.h"
+#include "LegatoHost.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct le_thread
+{
+    std::string name;
+    le_thread_MainFunc_t mainFunc;
+    void *context;
+    pthread_t pthread;
+
+    // Deferred functions and event reports queued from any thread
+    std::mutex queueMutex;
+    std::deque<std::function<void()>> queue;
+    int wakeupFd;
+
+    // Running timers, by expiry time. Only touched by the thread itself.
+    std::multimap<uint64_t, le_timer_Ref_t> timers;
+    bool stopRequested;
+};
+
+struct le_timer
+{
+    std::string name;
+    le_timer_ExpiryHandler_t handler;
+    uint32_t intervalMs;
+    uint32_t repeatCount;  ///< 0 repeats forever
+    uint32_t expiryCount;
+    void *context;
+    le_thread_Ref_t thread; ///< Thread the timer was started on, if it is running
+    uint64_t expiryUs;
+};
+
+struct le_event_Handler
+{
+    le_event_HandlerFunc_t func;
+    le_thread_Ref_t thread;
+};
+
+struct le_event_Id
+{
+    std::string name;
+    size_t payloadSize;
+    std::mutex handlersMutex;
+    std::vector<le_event_Handler> handlers;
+};
+
+struct le_msg_Session
+{
+    int unused;
+};
+
+struct le_msg_Service
+{
+    std::vector<std::pair<le_msg_SessionEventHandler_t, void *>> closeHandlers;
+};
+
+static thread_local le_thread_Ref_t CurrentThread;
+static std::map<std::string, std::string> ConfigValues;
+static le_msg_Service Service;
+static le_msg_SessionRef_t CurrentSession;
+static std::atomic<int> LogLevel(-1);
+
+// Weak so that programs which only use the framework, without the component, still link
+LE_HOST_CI_LINKAGE void _le_host_COMPONENT_INIT(void) __attribute__((weak));
+
+static uint64_t NowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static le_thread_Ref_t NewThread(const char *name)
+{
+    le_thread_Ref_t t = new le_thread();
+    t->name = name;
+    t->mainFunc = NULL;
+    t->context = NULL;
+    t->wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    LE_ASSERT(t->wakeupFd >= 0);
+    t->stopRequested = false;
+    return t;
+}
+
+static le_thread_Ref_t GetCurrentThread(void)
+{
+    // Threads not started with le_thread_Start(), such as the process's main thread, get a record
+    // the first time they use the event loop
+    if (CurrentThread == NULL)
+    {
+        CurrentThread = NewThread("main");
+        CurrentThread->pthread = pthread_self();
+    }
+    return CurrentThread;
+}
+
+static void Queue(le_thread_Ref_t thread, std::function<void()> &&func)
+{
+    {
+        std::lock_guard<std::mutex> lock(thread->queueMutex);
+        thread->queue.push_back(std::move(func));
+    }
+    const uint64_t one = 1;
+    LE_ASSERT(write(thread->wakeupFd, &one, sizeof(one)) == sizeof(one));
+}
+
+static void ArmTimer(le_timer_Ref_t timer, uint64_t nowUs)
+{
+    timer->expiryUs = nowUs + timer->intervalMs * 1000ULL;
+    timer->thread->timers.emplace(timer->expiryUs, timer);
+}
+
+static void DisarmTimer(le_timer_Ref_t timer)
+{
+    auto range = timer->thread->timers.equal_range(timer->expiryUs);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (it->second == timer)
+        {
+            timer->thread->timers.erase(it);
+            break;
+        }
+    }
+}
+
+static void RunExpiredTimers(le_thread_Ref_t thread)
+{
+    const uint64_t nowUs = NowUs();
+    while (!thread->timers.empty() && thread->timers.begin()->first <= nowUs)
+    {
+        le_timer_Ref_t timer = thread->timers.begin()->second;
+        thread->timers.erase(thread->timers.begin());
+        timer->expiryCount++;
+        if (timer->repeatCount == 0 || timer->expiryCount < timer->repeatCount)
+        {
+            ArmTimer(timer, nowUs);
+        }
+        else
+        {
+            timer->thread = NULL;
+        }
+        if (timer->handler)
+        {
+            timer->handler(timer);
+        }
+    }
+}
+
+static void RunQueuedFunctions(le_thread_Ref_t thread)
+{
+    uint64_t count;
+    (void)read(thread->wakeupFd, &count, sizeof(count));
+
+    std::deque<std::function<void()>> queue;
+    {
+        std::lock_guard<std::mutex> lock(thread->queueMutex);
+        queue.swap(thread->queue);
+    }
+    for (auto &func : queue)
+    {
+        func();
+    }
+}
+
+static void RunLoop(le_thread_Ref_t thread)
+{
+    while (!thread->stopRequested)
+    {
+        int timeoutMs = -1;
+        if (!thread->timers.empty())
+        {
+            const uint64_t nowUs = NowUs();
+            const uint64_t expiryUs = thread->timers.begin()->first;
+            // Round up so that the timer has expired when poll() returns
+            timeoutMs = expiryUs <= nowUs ? 0 : static_cast<int>((expiryUs - nowUs + 999) / 1000);
+        }
+        struct pollfd pfd = {thread->wakeupFd, POLLIN, 0};
+        const int n = poll(&pfd, 1, timeoutMs);
+        LE_ASSERT(n >= 0 || errno == EINTR);
+        if (n > 0)
+        {
+            RunQueuedFunctions(thread);
+        }
+        RunExpiredTimers(thread);
+    }
+    thread->stopRequested = false;
+}
+
+static void *ThreadMain(void *context)
+{
+    le_thread_Ref_t thread = static_cast<le_thread_Ref_t>(context);
+    CurrentThread = thread;
+    pthread_setname_np(pthread_self(), thread->name.substr(0, 15).c_str());
+    return thread->mainFunc(thread->context);
+}
+
+
+//----------------- LOGGING
+void _le_log_Send(
+    le_log_Level_t level, const char *file, unsigned int line, const char *format, ...)
+{
+    static const char *const Names[] = {"DEBUG", "INFO", "WARN", "ERR", "CRIT", "EMERG"};
+    int minLevel = LogLevel.load();
+    if (minLevel < 0)
+    {
+        const char *env = getenv("LE_LOG_LEVEL");
+        minLevel = LE_LOG_WARN;
+        for (int i = 0; env && i <= LE_LOG_EMERG; i++)
+        {
+            if (strcmp(env, Names[i]) == 0)
+            {
+                minLevel = i;
+            }
+        }
+        LogLevel.store(minLevel);
+    }
+    if (level < minLevel)
+    {
+        return;
+    }
+
+    const char *slash = strrchr(file, '/');
+    char message[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    fprintf(
+        stderr,
+        "%s | %s %s:%u | %s\n",
+        Names[level],
+        CurrentThread ? CurrentThread->name.c_str() : "main",
+        slash ? slash + 1 : file,
+        line,
+        message);
+}
+
+void _le_log_Fatal(void)
+{
+    abort();
+}
+
+
+//----------------- CLOCK
+le_clk_Time_t le_clk_GetRelativeTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return le_clk_Time_t{ts.tv_sec, ts.tv_nsec / 1000};
+}
+
+le_clk_Time_t le_clk_GetAbsoluteTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return le_clk_Time_t{ts.tv_sec, ts.tv_nsec / 1000};
+}
+
+le_clk_Time_t le_clk_Add(le_clk_Time_t timeA, le_clk_Time_t timeB)
+{
+    le_clk_Time_t t = {timeA.sec + timeB.sec, timeA.usec + timeB.usec};
+    if (t.usec >= 1000000)
+    {
+        t.sec++;
+        t.usec -= 1000000;
+    }
+    return t;
+}
+
+le_clk_Time_t le_clk_Sub(le_clk_Time_t timeA, le_clk_Time_t timeB)
+{
+    le_clk_Time_t t = {timeA.sec - timeB.sec, timeA.usec - timeB.usec};
+    if (t.usec < 0)
+    {
+        t.sec--;
+        t.usec += 1000000;
+    }
+    return t;
+}
+
+bool le_clk_GreaterThan(le_clk_Time_t timeA, le_clk_Time_t timeB)
+{
+    return timeA.sec > timeB.sec || (timeA.sec == timeB.sec && timeA.usec > timeB.usec);
+}
+
+
+//----------------- THREADS
+le_thread_Ref_t le_thread_Create(const char *name, le_thread_MainFunc_t mainFunc, void *context)
+{
+    le_thread_Ref_t t = NewThread(name);
+    t->mainFunc = mainFunc;
+    t->context = context;
+    return t;
+}
+
+void le_thread_Start(le_thread_Ref_t thread)
+{
+    LE_ASSERT(pthread_create(&thread->pthread, NULL, ThreadMain, thread) == 0);
+    pthread_detach(thread->pthread);
+}
+
+le_thread_Ref_t le_thread_GetCurrent(void)
+{
+    return GetCurrentThread();
+}
+
+
+//----------------- EVENTS
+le_event_Id_t le_event_CreateId(const char *name, size_t payloadSize)
+{
+    le_event_Id_t id = new le_event_Id();
+    id->name = name;
+    id->payloadSize = payloadSize;
+    return id;
+}
+
+le_event_HandlerRef_t le_event_AddHandler(
+    const char *name, le_event_Id_t eventId, le_event_HandlerFunc_t handlerFunc)
+{
+    std::lock_guard<std::mutex> lock(eventId->handlersMutex);
+    eventId->handlers.push_back(le_event_Handler{handlerFunc, GetCurrentThread()});
+    // Handlers are never removed, so the index is a stable reference
+    return reinterpret_cast<le_event_HandlerRef_t>(eventId->handlers.size());
+}
+
+void le_event_Report(le_event_Id_t eventId, void *payloadPtr, size_t payloadSize)
+{
+    LE_ASSERT(payloadSize <= eventId->payloadSize);
+    std::lock_guard<std::mutex> lock(eventId->handlersMutex);
+    for (auto const& h : eventId->handlers)
+    {
+        // Each handler gets its own copy of the payload, as in Legato
+        std::string payload(static_cast<const char *>(payloadPtr), payloadSize);
+        le_event_HandlerFunc_t func = h.func;
+        Queue(h.thread, [func, payload] () mutable { func(&payload[0]); });
+    }
+}
+
+void le_event_QueueFunction(le_event_DeferredFunc_t func, void *param1Ptr, void *param2Ptr)
+{
+    le_event_QueueFunctionToThread(GetCurrentThread(), func, param1Ptr, param2Ptr);
+}
+
+void le_event_QueueFunctionToThread(
+    le_thread_Ref_t thread, le_event_DeferredFunc_t func, void *param1Ptr, void *param2Ptr)
+{
+    Queue(thread, [func, param1Ptr, param2Ptr] () { func(param1Ptr, param2Ptr); });
+}
+
+void le_event_RunLoop(void)
+{
+    le_thread_Ref_t thread = GetCurrentThread();
+    for (;;)
+    {
+        RunLoop(thread);
+    }
+}
+
+
+//----------------- TIMERS
+le_timer_Ref_t le_timer_Create(const char *name)
+{
+    le_timer_Ref_t timer = new le_timer();
+    timer->name = name;
+    timer->handler = NULL;
+    timer->intervalMs = 0;
+    timer->repeatCount = 1;
+    timer->expiryCount = 0;
+    timer->context = NULL;
+    timer->thread = NULL;
+    timer->expiryUs = 0;
+    return timer;
+}
+
+void le_timer_Delete(le_timer_Ref_t timer)
+{
+    le_timer_Stop(timer);
+    delete timer;
+}
+
+le_result_t le_timer_SetHandler(le_timer_Ref_t timer, le_timer_ExpiryHandler_t handler)
+{
+    timer->handler = handler;
+    return LE_OK;
+}
+
+le_result_t le_timer_SetMsInterval(le_timer_Ref_t timer, uint32_t interval)
+{
+    if (timer->thread)
+    {
+        return LE_BUSY;
+    }
+    timer->intervalMs = interval;
+    return LE_OK;
+}
+
+le_result_t le_timer_SetRepeat(le_timer_Ref_t timer, uint32_t repeatCount)
+{
+    if (timer->thread)
+    {
+        return LE_BUSY;
+    }
+    timer->repeatCount = repeatCount;
+    return LE_OK;
+}
+
+le_result_t le_timer_SetContextPtr(le_timer_Ref_t timer, void *contextPtr)
+{
+    timer->context = contextPtr;
+    return LE_OK;
+}
+
+void *le_timer_GetContextPtr(le_timer_Ref_t timer)
+{
+    return timer->context;
+}
+
+le_result_t le_timer_Start(le_timer_Ref_t timer)
+{
+    if (timer->thread)
+    {
+        return LE_BUSY;
+    }
+    timer->thread = GetCurrentThread();
+    timer->expiryCount = 0;
+    ArmTimer(timer, NowUs());
+    return LE_OK;
+}
+
+le_result_t le_timer_Stop(le_timer_Ref_t timer)
+{
+    if (!timer->thread)
+    {
+        return LE_FAULT;
+    }
+    LE_ASSERT(timer->thread == GetCurrentThread());
+    DisarmTimer(timer);
+    timer->thread = NULL;
+    return LE_OK;
+}
+
+
+//----------------- IPC
+le_msg_SessionEventHandlerRef_t le_msg_AddServiceCloseHandler(
+    le_msg_ServiceRef_t serviceRef, le_msg_SessionEventHandler_t handlerFunc, void *contextPtr)
+{
+    serviceRef->closeHandlers.emplace_back(handlerFunc, contextPtr);
+    return reinterpret_cast<le_msg_SessionEventHandlerRef_t>(serviceRef->closeHandlers.size());
+}
+
+le_msg_SessionRef_t ma_combainLocation_GetClientSessionRef(void)
+{
+    return CurrentSession;
+}
+
+le_msg_ServiceRef_t ma_combainLocation_GetServiceRef(void)
+{
+    return &Service;
+}
+
+
+//----------------- STRINGS
+le_result_t le_utf8_Copy(char *destStr, const char *srcStr, size_t destSize, size_t *numBytesPtr)
+{
+    LE_ASSERT(destSize > 0);
+    size_t len = strlen(srcStr);
+    le_result_t res = LE_OK;
+    if (len >= destSize)
+    {
+        // Don't split a multi-byte character
+        len = destSize - 1;
+        while (len > 0 && (static_cast<uint8_t>(srcStr[len]) & 0xC0) == 0x80)
+        {
+            len--;
+        }
+        res = LE_OVERFLOW;
+    }
+    memcpy(destStr, srcStr, len);
+    destStr[len] = '\0';
+    if (numBytesPtr)
+    {
+        *numBytesPtr = len;
+    }
+    return res;
+}
+
+
+//----------------- CONFIG
+static const std::string *FindConfigValue(const char *path)
+{
+    auto it = ConfigValues.find(path);
+    return it == ConfigValues.end() ? NULL : &it->second;
+}
+
+int32_t le_cfg_QuickGetInt(const char *path, int32_t defaultValue)
+{
+    const std::string *v = FindConfigValue(path);
+    return v ? static_cast<int32_t>(strtol(v->c_str(), NULL, 0)) : defaultValue;
+}
+
+bool le_cfg_QuickGetBool(const char *path, bool defaultValue)
+{
+    const std::string *v = FindConfigValue(path);
+    return v ? (*v == "true" || *v == "1") : defaultValue;
+}
+
+double le_cfg_QuickGetFloat(const char *path, double defaultValue)
+{
+    const std::string *v = FindConfigValue(path);
+    return v ? strtod(v->c_str(), NULL) : defaultValue;
+}
+
+le_result_t le_cfg_QuickGetString(
+    const char *path, char *value, size_t valueSize, const char *defaultValue)
+{
+    const std::string *v = FindConfigValue(path);
+    return le_utf8_Copy(value, v ? v->c_str() : defaultValue, valueSize, NULL);
+}
+
+
+//----------------- HOST CONTROL
+void LeHostConfigSet(const char *path, const char *value)
+{
+    ConfigValues[path] = value;
+}
+
+void LeHostInitComponent(void)
+{
+    LE_ASSERT(_le_host_COMPONENT_INIT != NULL);
+    GetCurrentThread();
+    _le_host_COMPONENT_INIT();
+}
+
+le_msg_SessionRef_t LeHostCreateSession(void)
+{
+    return new le_msg_Session();
+}
+
+void LeHostSetCurrentSession(le_msg_SessionRef_t session)
+{
+    CurrentSession = session;
+}
+
+void LeHostCloseSession(le_msg_SessionRef_t session)
+{
+    for (auto const& h : Service.closeHandlers)
+    {
+        h.first(session, h.second);
+    }
+    if (CurrentSession == session)
+    {
+        CurrentSession = NULL;
+    }
+    delete session;
+}
+
+void LeHostRunLoop(void)
+{
+    RunLoop(GetCurrentThread());
+}
+
+void LeHostStopLoop(void)
+{
+    GetCurrentThread()->stopRequested = true;
+}
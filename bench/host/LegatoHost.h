@@ -0,0 +1,30 @@
+#ifndef LEGATO_HOST_CONTROL_H
+#define LEGATO_HOST_CONTROL_H
+
+#include "legato.h"
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Controls for host builds that stand in for what the Legato framework would otherwise do: config
+ * tree contents, starting the component, simulated client sessions and stopping an event loop.
+ */
+//--------------------------------------------------------------------------------------------------
+
+// Sets a config tree value for the le_cfg_QuickGet functions. Must be called before the component
+// reads its config.
+void LeHostConfigSet(const char *path, const char *value);
+
+// Calls the component's COMPONENT_INIT on the calling thread, which becomes its main thread
+void LeHostInitComponent(void);
+
+// Creates a simulated client session. API calls made while it is current see it as the caller.
+le_msg_SessionRef_t LeHostCreateSession(void);
+void LeHostSetCurrentSession(le_msg_SessionRef_t session);
+// Calls the service close handlers, as when a client process exits
+void LeHostCloseSession(le_msg_SessionRef_t session);
+
+// Runs the calling thread's event loop until LeHostStopLoop() is called on that thread
+void LeHostRunLoop(void);
+void LeHostStopLoop(void);
+
+#endif // LEGATO_HOST_CONTROL_H
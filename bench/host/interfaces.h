@@ -0,0 +1,253 @@
+#ifndef INTERFACES_HOST_H
+#define INTERFACES_HOST_H
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * What ifgen generates from ma_combainLocation.api for the server side, and the le_cfg functions
+ * the component uses, for host builds. Keep in step with ma_combainLocation.api: the component's
+ * definitions of these functions won't compile against a declaration that has drifted.
+ */
+//--------------------------------------------------------------------------------------------------
+
+#include "legato.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//--------------------------------------------------------------------------------------------------
+// le_cfg. Values can be set with LeHostConfigSet(). Anything not set reads as the default.
+//--------------------------------------------------------------------------------------------------
+int32_t le_cfg_QuickGetInt(const char *path, int32_t defaultValue);
+bool le_cfg_QuickGetBool(const char *path, bool defaultValue);
+double le_cfg_QuickGetFloat(const char *path, double defaultValue);
+le_result_t le_cfg_QuickGetString(
+    const char *path, char *value, size_t valueSize, const char *defaultValue);
+
+//--------------------------------------------------------------------------------------------------
+// ma_combainLocation
+//--------------------------------------------------------------------------------------------------
+#define MA_COMBAINLOCATION_WIFI_BSSID_BYTES 6
+#define MA_COMBAINLOCATION_WIFI_SSID_MAX_BYTES 32
+#define MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND 64
+#define MA_COMBAINLOCATION_MAX_CELL_TOWERS_PER_APPEND 16
+#define MA_COMBAINLOCATION_WIFI_BSSID_BATCH_BYTES 384
+#define MA_COMBAINLOCATION_WIFI_SSID_BATCH_BYTES 2048
+#define MA_COMBAINLOCATION_LATENCY_HISTOGRAM_BUCKETS 22
+#define MA_COMBAINLOCATION_MAX_RESULT_TYPES 8
+
+typedef struct ma_combainLocation_LocReqHandle *ma_combainLocation_LocReqHandleRef_t;
+
+typedef enum
+{
+    MA_COMBAINLOCATION_CELL_TECH_GSM = 0,
+    MA_COMBAINLOCATION_CELL_TECH_CDMA = 1,
+    MA_COMBAINLOCATION_CELL_TECH_LTE = 2,
+    MA_COMBAINLOCATION_CELL_TECH_WCDMA = 3
+}
+ma_combainLocation_CellularTech_t;
+
+typedef enum
+{
+    MA_COMBAINLOCATION_RESULT_SUCCESS = 0,
+    MA_COMBAINLOCATION_RESULT_ERROR = 1,
+    MA_COMBAINLOCATION_RESULT_RESPONSE_PARSE_FAILURE = 2,
+    MA_COMBAINLOCATION_RESULT_COMMUNICATION_FAILURE = 3,
+    MA_COMBAINLOCATION_RESULT_TIMEOUT = 4
+}
+ma_combainLocation_Result_t;
+
+typedef enum
+{
+    MA_COMBAINLOCATION_PRIORITY_LOW = 0,
+    MA_COMBAINLOCATION_PRIORITY_NORMAL = 1,
+    MA_COMBAINLOCATION_PRIORITY_HIGH = 2
+}
+ma_combainLocation_Priority_t;
+
+typedef enum
+{
+    MA_COMBAINLOCATION_STAGE_QUEUE = 0,
+    MA_COMBAINLOCATION_STAGE_DNS = 1,
+    MA_COMBAINLOCATION_STAGE_CONNECT = 2,
+    MA_COMBAINLOCATION_STAGE_TLS = 3,
+    MA_COMBAINLOCATION_STAGE_FIRST_BYTE = 4,
+    MA_COMBAINLOCATION_STAGE_TRANSFER = 5,
+    MA_COMBAINLOCATION_STAGE_DELIVERY = 6,
+    MA_COMBAINLOCATION_STAGE_PARSE = 7,
+    MA_COMBAINLOCATION_STAGE_CALLBACK = 8,
+    MA_COMBAINLOCATION_STAGE_TOTAL = 9
+}
+ma_combainLocation_Stage_t;
+
+typedef enum
+{
+    MA_COMBAINLOCATION_CIRCUIT_CLOSED = 0,
+    MA_COMBAINLOCATION_CIRCUIT_OPEN = 1,
+    MA_COMBAINLOCATION_CIRCUIT_HALF_OPEN = 2
+}
+ma_combainLocation_CircuitState_t;
+
+typedef void (*ma_combainLocation_LocationResultHandlerFunc_t)(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    ma_combainLocation_Result_t result,
+    void *contextPtr);
+
+typedef void (*ma_combainLocation_LocationFixHandlerFunc_t)(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    ma_combainLocation_Result_t result,
+    double latitude,
+    double longitude,
+    double accuracyInMeters,
+    void *contextPtr);
+
+le_msg_SessionRef_t ma_combainLocation_GetClientSessionRef(void);
+le_msg_ServiceRef_t ma_combainLocation_GetServiceRef(void);
+
+ma_combainLocation_LocReqHandleRef_t ma_combainLocation_CreateLocationRequest(void);
+
+le_result_t ma_combainLocation_AppendWifiAccessPoint(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const uint8_t *bssidPtr,
+    size_t bssidSize,
+    const uint8_t *ssidPtr,
+    size_t ssidSize,
+    int16_t signalStrength);
+
+le_result_t ma_combainLocation_AppendCellTower(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    ma_combainLocation_CellularTech_t cellularTechnology,
+    uint16_t mcc,
+    uint16_t mnc,
+    uint32_t lac,
+    uint32_t cellId,
+    int32_t signalStrength);
+
+le_result_t ma_combainLocation_AppendWifiAccessPoints(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const uint8_t *bssidsPtr,
+    size_t bssidsSize,
+    const uint8_t *ssidsPtr,
+    size_t ssidsSize,
+    const uint8_t *ssidLengthsPtr,
+    size_t ssidLengthsSize,
+    const int16_t *signalStrengthsPtr,
+    size_t signalStrengthsSize);
+
+le_result_t ma_combainLocation_AppendCellTowers(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const uint8_t *cellularTechnologiesPtr,
+    size_t cellularTechnologiesSize,
+    const uint16_t *mccsPtr,
+    size_t mccsSize,
+    const uint16_t *mncsPtr,
+    size_t mncsSize,
+    const uint32_t *lacsPtr,
+    size_t lacsSize,
+    const uint32_t *cellIdsPtr,
+    size_t cellIdsSize,
+    const int32_t *signalStrengthsPtr,
+    size_t signalStrengthsSize);
+
+le_result_t ma_combainLocation_SetSchedulingOptions(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    ma_combainLocation_Priority_t priority,
+    uint32_t deadlineMs);
+
+le_result_t ma_combainLocation_SubmitLocationRequest(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const char *apiKey,
+    ma_combainLocation_LocationResultHandlerFunc_t handlerPtr,
+    void *contextPtr);
+
+le_result_t ma_combainLocation_SubmitScan(
+    const uint8_t *bssidsPtr,
+    size_t bssidsSize,
+    const uint8_t *ssidsPtr,
+    size_t ssidsSize,
+    const uint8_t *ssidLengthsPtr,
+    size_t ssidLengthsSize,
+    const int16_t *signalStrengthsPtr,
+    size_t signalStrengthsSize,
+    const uint8_t *cellularTechnologiesPtr,
+    size_t cellularTechnologiesSize,
+    const uint16_t *mccsPtr,
+    size_t mccsSize,
+    const uint16_t *mncsPtr,
+    size_t mncsSize,
+    const uint32_t *lacsPtr,
+    size_t lacsSize,
+    const uint32_t *cellIdsPtr,
+    size_t cellIdsSize,
+    const int32_t *cellSignalStrengthsPtr,
+    size_t cellSignalStrengthsSize,
+    const char *apiKey,
+    ma_combainLocation_LocReqHandleRef_t *handlePtr,
+    ma_combainLocation_LocationFixHandlerFunc_t handlerPtr,
+    void *contextPtr);
+
+le_result_t ma_combainLocation_GetApSelectionResult(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    uint32_t *apsRemovedPtr,
+    uint32_t *bytesRemovedPtr);
+
+void ma_combainLocation_DestroyLocationRequest(ma_combainLocation_LocReqHandleRef_t handle);
+
+le_result_t ma_combainLocation_GetSuccessResponse(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    double *latitudePtr,
+    double *longitudePtr,
+    double *accuracyInMetersPtr);
+
+le_result_t ma_combainLocation_GetErrorResponse(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    char *firstDomain,
+    size_t firstDomainSize,
+    char *firstReason,
+    size_t firstReasonSize,
+    char *firstMessage,
+    size_t firstMessageSize,
+    uint16_t *codePtr,
+    char *message,
+    size_t messageSize);
+
+le_result_t ma_combainLocation_GetParseFailureResult(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    char *unparsedResponse,
+    size_t unparsedResponseSize);
+
+void ma_combainLocation_GetStats(
+    uint32_t *requestsPtr,
+    uint32_t *serverRequestsPtr,
+    uint32_t *resultCountsPtr,
+    size_t *resultCountsSizePtr,
+    uint64_t *bytesOutPtr,
+    uint64_t *bytesInPtr,
+    uint64_t *uncompressedBytesOutPtr,
+    uint64_t *uncompressedBytesInPtr,
+    uint32_t *apsRemovedPtr,
+    uint64_t *bytesRemovedPtr);
+
+void ma_combainLocation_GetConnectionStats(
+    ma_combainLocation_CircuitState_t *circuitStatePtr,
+    uint32_t *consecutiveFailuresPtr,
+    uint32_t *circuitTripsPtr,
+    uint32_t *retriesPtr,
+    uint32_t *fastFailuresPtr,
+    uint32_t *cancelledPtr,
+    uint32_t *connectionsOpenedPtr,
+    uint32_t *connectionsReusedPtr,
+    uint32_t *http2RequestsPtr);
+
+le_result_t ma_combainLocation_GetLatencyHistogram(
+    ma_combainLocation_Stage_t stage,
+    uint32_t *bucketCountsPtr,
+    size_t *bucketCountsSizePtr,
+    uint32_t *countPtr,
+    uint64_t *totalMicrosecondsPtr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INTERFACES_HOST_H
@@ -0,0 +1,183 @@
+#ifndef LEGATO_HOST_H
+#define LEGATO_HOST_H
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * The parts of the Legato framework API that the combainLocation component uses, implemented on
+ * plain Linux threads by LegatoHost.cpp so that the component's sources can be built and
+ * benchmarked on a PC. Only the behaviour the component relies on is reproduced: each thread runs
+ * its own event loop with deferred functions, reported events and timers.
+ */
+//--------------------------------------------------------------------------------------------------
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+    LE_OK = 0,
+    LE_NOT_FOUND = -1,
+    LE_NOT_POSSIBLE = -2,
+    LE_OUT_OF_RANGE = -3,
+    LE_NO_MEMORY = -4,
+    LE_NOT_PERMITTED = -5,
+    LE_FAULT = -6,
+    LE_COMM_ERROR = -7,
+    LE_TIMEOUT = -8,
+    LE_OVERFLOW = -9,
+    LE_UNDERFLOW = -10,
+    LE_WOULD_BLOCK = -11,
+    LE_DEADLOCK = -12,
+    LE_FORMAT_ERROR = -13,
+    LE_DUPLICATE = -14,
+    LE_BAD_PARAMETER = -15,
+    LE_CLOSED = -16,
+    LE_BUSY = -17,
+    LE_UNSUPPORTED = -18,
+    LE_IO_ERROR = -19,
+    LE_NOT_IMPLEMENTED = -20,
+    LE_UNAVAILABLE = -21,
+    LE_TERMINATED = -22,
+}
+le_result_t;
+
+//--------------------------------------------------------------------------------------------------
+// Logging. Messages below the level in the LE_LOG_LEVEL environment variable (DEBUG, INFO, WARN,
+// ERR, CRIT or EMERG, default WARN) are discarded.
+//--------------------------------------------------------------------------------------------------
+typedef enum
+{
+    LE_LOG_DEBUG,
+    LE_LOG_INFO,
+    LE_LOG_WARN,
+    LE_LOG_ERR,
+    LE_LOG_CRIT,
+    LE_LOG_EMERG,
+}
+le_log_Level_t;
+
+void _le_log_Send(
+    le_log_Level_t level, const char *file, unsigned int line, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+void _le_log_Fatal(void) __attribute__((noreturn));
+
+#define LE_DEBUG(...) _le_log_Send(LE_LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+#define LE_INFO(...) _le_log_Send(LE_LOG_INFO, __FILE__, __LINE__, __VA_ARGS__)
+#define LE_WARN(...) _le_log_Send(LE_LOG_WARN, __FILE__, __LINE__, __VA_ARGS__)
+#define LE_ERROR(...) _le_log_Send(LE_LOG_ERR, __FILE__, __LINE__, __VA_ARGS__)
+#define LE_CRIT(...) _le_log_Send(LE_LOG_CRIT, __FILE__, __LINE__, __VA_ARGS__)
+#define LE_EMERG(...) _le_log_Send(LE_LOG_EMERG, __FILE__, __LINE__, __VA_ARGS__)
+
+#define LE_FATAL(...) \
+    do { _le_log_Send(LE_LOG_EMERG, __FILE__, __LINE__, __VA_ARGS__); _le_log_Fatal(); } while (0)
+#define LE_FATAL_IF(condition, ...) \
+    do { if (condition) { LE_FATAL(__VA_ARGS__); } } while (0)
+#define LE_ERROR_IF(condition, ...) \
+    do { if (condition) { LE_ERROR(__VA_ARGS__); } } while (0)
+#define LE_WARN_IF(condition, ...) \
+    do { if (condition) { LE_WARN(__VA_ARGS__); } } while (0)
+#define LE_ASSERT(condition) LE_FATAL_IF(!(condition), "Assert Failed: '%s'", #condition)
+#define LE_ASSERT_OK(condition) \
+    LE_FATAL_IF((condition) != LE_OK, "Assert Failed: '%s' is not LE_OK", #condition)
+
+//--------------------------------------------------------------------------------------------------
+// Clock
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    time_t sec;
+    long usec;
+}
+le_clk_Time_t;
+
+le_clk_Time_t le_clk_GetRelativeTime(void);
+le_clk_Time_t le_clk_GetAbsoluteTime(void);
+le_clk_Time_t le_clk_Add(le_clk_Time_t timeA, le_clk_Time_t timeB);
+le_clk_Time_t le_clk_Sub(le_clk_Time_t timeA, le_clk_Time_t timeB);
+bool le_clk_GreaterThan(le_clk_Time_t timeA, le_clk_Time_t timeB);
+
+//--------------------------------------------------------------------------------------------------
+// Threads
+//--------------------------------------------------------------------------------------------------
+typedef struct le_thread *le_thread_Ref_t;
+typedef void *(*le_thread_MainFunc_t)(void *context);
+
+le_thread_Ref_t le_thread_Create(const char *name, le_thread_MainFunc_t mainFunc, void *context);
+void le_thread_Start(le_thread_Ref_t thread);
+le_thread_Ref_t le_thread_GetCurrent(void);
+
+//--------------------------------------------------------------------------------------------------
+// Event loop
+//--------------------------------------------------------------------------------------------------
+typedef struct le_event_Id *le_event_Id_t;
+typedef struct le_event_Handler *le_event_HandlerRef_t;
+typedef void (*le_event_HandlerFunc_t)(void *reportPtr);
+typedef void (*le_event_DeferredFunc_t)(void *param1Ptr, void *param2Ptr);
+
+le_event_Id_t le_event_CreateId(const char *name, size_t payloadSize);
+le_event_HandlerRef_t le_event_AddHandler(
+    const char *name, le_event_Id_t eventId, le_event_HandlerFunc_t handlerFunc);
+void le_event_Report(le_event_Id_t eventId, void *payloadPtr, size_t payloadSize);
+void le_event_QueueFunction(le_event_DeferredFunc_t func, void *param1Ptr, void *param2Ptr);
+void le_event_QueueFunctionToThread(
+    le_thread_Ref_t thread, le_event_DeferredFunc_t func, void *param1Ptr, void *param2Ptr);
+void le_event_RunLoop(void) __attribute__((noreturn));
+
+//--------------------------------------------------------------------------------------------------
+// Timers. A timer runs on the thread that started it.
+//--------------------------------------------------------------------------------------------------
+typedef struct le_timer *le_timer_Ref_t;
+typedef void (*le_timer_ExpiryHandler_t)(le_timer_Ref_t timerRef);
+
+le_timer_Ref_t le_timer_Create(const char *name);
+void le_timer_Delete(le_timer_Ref_t timer);
+le_result_t le_timer_SetHandler(le_timer_Ref_t timer, le_timer_ExpiryHandler_t handler);
+le_result_t le_timer_SetMsInterval(le_timer_Ref_t timer, uint32_t interval);
+le_result_t le_timer_SetRepeat(le_timer_Ref_t timer, uint32_t repeatCount);
+le_result_t le_timer_SetContextPtr(le_timer_Ref_t timer, void *contextPtr);
+void *le_timer_GetContextPtr(le_timer_Ref_t timer);
+le_result_t le_timer_Start(le_timer_Ref_t timer);
+le_result_t le_timer_Stop(le_timer_Ref_t timer);
+
+//--------------------------------------------------------------------------------------------------
+// IPC sessions. Clients are simulated in-process, see LegatoHost.h.
+//--------------------------------------------------------------------------------------------------
+typedef struct le_msg_Session *le_msg_SessionRef_t;
+typedef struct le_msg_Service *le_msg_ServiceRef_t;
+typedef struct le_msg_SessionEventHandler *le_msg_SessionEventHandlerRef_t;
+typedef void (*le_msg_SessionEventHandler_t)(le_msg_SessionRef_t sessionRef, void *contextPtr);
+
+le_msg_SessionEventHandlerRef_t le_msg_AddServiceCloseHandler(
+    le_msg_ServiceRef_t serviceRef, le_msg_SessionEventHandler_t handlerFunc, void *contextPtr);
+
+//--------------------------------------------------------------------------------------------------
+// Strings
+//--------------------------------------------------------------------------------------------------
+le_result_t le_utf8_Copy(char *destStr, const char *srcStr, size_t destSize, size_t *numBytesPtr);
+
+//--------------------------------------------------------------------------------------------------
+// Component initialization. The host has a single component, whose init function is called by
+// LeHostInitComponent().
+//--------------------------------------------------------------------------------------------------
+#define COMPONENT_INIT LE_HOST_CI_LINKAGE void _le_host_COMPONENT_INIT(void)
+#ifdef __cplusplus
+#define LE_HOST_CI_LINKAGE extern "C"
+#else
+#define LE_HOST_CI_LINKAGE
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LEGATO_HOST_H
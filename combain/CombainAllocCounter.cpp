@@ -0,0 +1,86 @@
+#include "CombainAllocCounter.h"
+
+#include <new>
+#include <cstdlib>
+
+#ifdef COMBAIN_COUNT_ALLOCATIONS
+
+// Per thread so that the HTTP thread's allocations aren't attributed to requests on the main thread
+static thread_local uint64_t NumAllocations;
+static thread_local uint64_t NumBytesAllocated;
+
+static void *CountedAlloc(size_t size)
+{
+    NumAllocations++;
+    NumBytesAllocated += size;
+    return malloc(size == 0 ? 1 : size);
+}
+
+void *operator new(size_t size)
+{
+    void *p = CountedAlloc(size);
+    if (p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return CountedAlloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return CountedAlloc(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t size) noexcept
+{
+    free(p);
+}
+
+uint64_t CombainAllocCounterGet(void)
+{
+    return NumAllocations;
+}
+
+uint64_t CombainAllocCounterGetBytes(void)
+{
+    return NumBytesAllocated;
+}
+
+#else
+
+uint64_t CombainAllocCounterGet(void)
+{
+    return 0;
+}
+
+uint64_t CombainAllocCounterGetBytes(void)
+{
+    return 0;
+}
+
+#endif // COMBAIN_COUNT_ALLOCATIONS
@@ -0,0 +1,20 @@
+#ifndef COMBAIN_ALLOC_COUNTER_H
+#define COMBAIN_ALLOC_COUNTER_H
+
+#include "legato.h"
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Debug instrumentation for checking that request handling doesn't touch the heap once the pools
+ * have warmed up.
+ *
+ * When the component is built with COMBAIN_COUNT_ALLOCATIONS defined (see Component.cdef), the
+ * global operator new is replaced with one that counts allocations and bytes requested per thread,
+ * and the amounts made on the main thread over the life of each request are logged when its result
+ * is delivered. Otherwise nothing is replaced and the counts are always 0.
+ */
+//--------------------------------------------------------------------------------------------------
+uint64_t CombainAllocCounterGet(void);
+uint64_t CombainAllocCounterGetBytes(void);
+
+#endif // COMBAIN_ALLOC_COUNTER_H
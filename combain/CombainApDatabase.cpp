@@ -0,0 +1,387 @@
+#include "CombainApDatabase.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+
+// Older observations are discounted by this factor each time an AP is observed again so that the
+// estimate follows an AP which has been moved.
+#define OBSERVATION_WEIGHT_DECAY 0.9f
+
+#define METERS_PER_DEGREE_LATITUDE 111320.0
+
+#define DATABASE_FILE_MAGIC 0x44504143 // "CAPD"
+#define DATABASE_FILE_VERSION 2
+
+struct __attribute__((packed)) DatabaseFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+};
+
+struct __attribute__((packed)) DatabaseFileRecord
+{
+    uint8_t bssid[6];
+    uint16_t accuracy;
+    int32_t latitudeE7;
+    int32_t longitudeE7;
+    float weight;
+};
+
+// Version 2 adds when each AP was last observed. Version 1 files are still loaded, as if all of
+// their APs had just been observed.
+struct __attribute__((packed)) DatabaseFileRecordV2
+{
+    DatabaseFileRecord v1;
+    uint32_t lastObserved;
+};
+
+static double SignalWeight(int16_t signalStrength);
+static uint32_t NowSeconds(void);
+
+
+CombainApDatabase::CombainApDatabase(
+    size_t capacity, uint32_t minKnownAps, uint32_t minKnownPercent, uint32_t maxAgeSeconds)
+    : capacity(capacity),
+      minKnownAps(std::max<uint32_t>(minKnownAps, 1)),
+      minKnownPercent(minKnownPercent),
+      maxAgeSeconds(maxAgeSeconds),
+      dirty(false),
+      stats()
+{
+    this->aps.reserve(capacity);
+}
+
+void CombainApDatabase::observe(
+    const std::vector<WifiApScanItem> &aps, std::vector<Observation> *scan)
+{
+    scan->clear();
+    for (auto const& ap : aps)
+    {
+        uint64_t bssid = 0;
+        for (auto b : ap.bssid)
+        {
+            bssid = (bssid << 8) | b;
+        }
+        scan->push_back({bssid, ap.signalStrength});
+    }
+}
+
+bool CombainApDatabase::isEnabled(void) const
+{
+    return this->capacity > 0;
+}
+
+void CombainApDatabase::learn(
+    const std::vector<Observation> &scan, const CombainSuccessResponse &fix)
+{
+    if (!this->isEnabled())
+    {
+        return;
+    }
+
+    const double fixAccuracy = std::max(fix.accuracyInMeters, 1.0);
+    const uint32_t now = NowSeconds();
+    for (auto const& o : scan)
+    {
+        const float w = SignalWeight(o.signalStrength) / fixAccuracy;
+        auto it = this->aps.find(o.bssid);
+        if (it == this->aps.end())
+        {
+            if (this->aps.size() >= this->capacity)
+            {
+                this->evictOldest();
+            }
+            ApEstimate e;
+            e.latitude = fix.latitude;
+            e.longitude = fix.longitude;
+            e.weight = w;
+            e.accuracy = std::min(fixAccuracy, (double)UINT16_MAX);
+            e.lastObserved = now;
+            this->lru.push_front(o.bssid);
+            e.lruPosition = this->lru.begin();
+            this->aps.emplace(o.bssid, e);
+        }
+        else if (this->isExpired(it->second, now))
+        {
+            // Don't blend in a position from before the AP may have been moved
+            ApEstimate &e = it->second;
+            e.latitude = fix.latitude;
+            e.longitude = fix.longitude;
+            e.weight = w;
+            e.accuracy = std::min(fixAccuracy, (double)UINT16_MAX);
+            e.lastObserved = now;
+            this->lru.splice(this->lru.begin(), this->lru, e.lruPosition);
+        }
+        else
+        {
+            ApEstimate &e = it->second;
+            const float oldWeight = e.weight * OBSERVATION_WEIGHT_DECAY;
+            const float total = oldWeight + w;
+            e.latitude += (fix.latitude - e.latitude) * (w / total);
+            e.longitude += (fix.longitude - e.longitude) * (w / total);
+            e.accuracy = std::min(
+                (e.accuracy * oldWeight + fixAccuracy * w) / total, (double)UINT16_MAX);
+            e.weight = total;
+            e.lastObserved = now;
+            this->lru.splice(this->lru.begin(), this->lru, e.lruPosition);
+        }
+    }
+    this->dirty = true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Estimates the position of a scan from the known APs in it.
+ *
+ * @return true if enough of the scan is known to produce an estimate. When isFallback is set, the
+ *         server couldn't be reached, so any estimate from at least minKnownAps APs is preferred to
+ *         no result at all and the minimum known percentage is not applied.
+ */
+//--------------------------------------------------------------------------------------------------
+bool CombainApDatabase::estimate(
+    const std::vector<Observation> &scan,
+    bool isFallback,
+    double *latitude,
+    double *longitude,
+    double *accuracyInMeters)
+{
+    if (!this->isEnabled() || scan.empty())
+    {
+        return false;
+    }
+
+    std::vector<std::pair<const ApEstimate *, double>> &known = this->estimateScratch;
+    known.clear();
+    const uint32_t now = NowSeconds();
+    double totalWeight = 0.0;
+    for (auto const& o : scan)
+    {
+        auto it = this->aps.find(o.bssid);
+        if (it != this->aps.end() && !this->isExpired(it->second, now))
+        {
+            const double w =
+                SignalWeight(o.signalStrength) / std::max<double>(it->second.accuracy, 1.0);
+            known.emplace_back(&it->second, w);
+            totalWeight += w;
+        }
+    }
+
+    if (known.size() < this->minKnownAps ||
+        (!isFallback && known.size() * 100 < this->minKnownPercent * scan.size()) ||
+        totalWeight <= 0.0)
+    {
+        return false;
+    }
+
+    double lat = 0.0;
+    double lng = 0.0;
+    double apAccuracy = 0.0;
+    for (auto const& k : known)
+    {
+        lat += k.first->latitude * k.second;
+        lng += k.first->longitude * k.second;
+        apAccuracy += k.first->accuracy * k.second;
+    }
+    lat /= totalWeight;
+    lng /= totalWeight;
+    apAccuracy /= totalWeight;
+
+    // Widen the accuracy by how far the known APs are spread around the estimate
+    const double metersPerDegreeLongitude = METERS_PER_DEGREE_LATITUDE * cos(lat * M_PI / 180.0);
+    double spread = 0.0;
+    for (auto const& k : known)
+    {
+        const double dy = (k.first->latitude - lat) * METERS_PER_DEGREE_LATITUDE;
+        const double dx = (k.first->longitude - lng) * metersPerDegreeLongitude;
+        spread += (dx * dx + dy * dy) * k.second;
+    }
+    spread = sqrt(spread / totalWeight);
+
+    *latitude = lat;
+    *longitude = lng;
+    *accuracyInMeters = apAccuracy + spread;
+
+    if (isFallback)
+    {
+        this->stats.fallbackFixes++;
+    }
+    else
+    {
+        this->stats.localFixes++;
+    }
+    return true;
+}
+
+le_result_t CombainApDatabase::load(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        return LE_NOT_FOUND;
+    }
+
+    le_result_t res = LE_OK;
+    DatabaseFileHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.magic != DATABASE_FILE_MAGIC ||
+        (header.version != 1 && header.version != DATABASE_FILE_VERSION))
+    {
+        res = LE_FORMAT_ERROR;
+    }
+    else
+    {
+        const uint32_t now = NowSeconds();
+        const size_t recordSize =
+            (header.version == 1) ? sizeof(DatabaseFileRecord) : sizeof(DatabaseFileRecordV2);
+        DatabaseFileRecordV2 r;
+        for (uint32_t i = 0; i < header.count && this->aps.size() < this->capacity; i++)
+        {
+            r.lastObserved = now;
+            if (fread(&r, recordSize, 1, f) != 1)
+            {
+                res = LE_FORMAT_ERROR;
+                break;
+            }
+            uint64_t bssid = 0;
+            for (auto b : r.v1.bssid)
+            {
+                bssid = (bssid << 8) | b;
+            }
+            ApEstimate e;
+            e.latitude = r.v1.latitudeE7 / 1e7;
+            e.longitude = r.v1.longitudeE7 / 1e7;
+            e.weight = r.v1.weight;
+            e.accuracy = r.v1.accuracy;
+            e.lastObserved = r.lastObserved;
+            if (this->isExpired(e, now))
+            {
+                continue;
+            }
+            auto it = this->aps.find(bssid);
+            if (it == this->aps.end())
+            {
+                this->lru.push_back(bssid);
+                e.lruPosition = std::prev(this->lru.end());
+                this->aps.emplace(bssid, e);
+            }
+            else
+            {
+                e.lruPosition = it->second.lruPosition;
+                it->second = e;
+            }
+        }
+
+        // The file isn't in any particular order
+        this->lru.sort([this] (uint64_t a, uint64_t b) {
+            return this->aps.at(a).lastObserved > this->aps.at(b).lastObserved;
+        });
+    }
+
+    fclose(f);
+    return res;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Builds the file contents for the current state of the database, leaving out expired APs, and
+ * marks the database as clean. The contents are written with writeFile(), which may block on the
+ * filesystem and so can be called from another thread.
+ */
+//--------------------------------------------------------------------------------------------------
+void CombainApDatabase::serialize(std::string *image)
+{
+    const uint32_t now = NowSeconds();
+    image->clear();
+    image->reserve(sizeof(DatabaseFileHeader) + this->aps.size() * sizeof(DatabaseFileRecordV2));
+    image->resize(sizeof(DatabaseFileHeader));
+
+    uint32_t count = 0;
+    for (auto const& it : this->aps)
+    {
+        if (this->isExpired(it.second, now))
+        {
+            continue;
+        }
+        DatabaseFileRecordV2 r;
+        for (int i = 5; i >= 0; i--)
+        {
+            r.v1.bssid[i] = (it.first >> (8 * (5 - i))) & 0xFF;
+        }
+        r.v1.accuracy = it.second.accuracy;
+        r.v1.latitudeE7 = lround(it.second.latitude * 1e7);
+        r.v1.longitudeE7 = lround(it.second.longitude * 1e7);
+        r.v1.weight = it.second.weight;
+        r.lastObserved = it.second.lastObserved;
+        image->append(reinterpret_cast<const char *>(&r), sizeof(r));
+        count++;
+    }
+
+    const DatabaseFileHeader header = {DATABASE_FILE_MAGIC, DATABASE_FILE_VERSION, count};
+    memcpy(&(*image)[0], &header, sizeof(header));
+    this->dirty = false;
+}
+
+le_result_t CombainApDatabase::writeFile(const char *path, const std::string &image)
+{
+    const std::string tmpPath = std::string(path) + ".tmp";
+    FILE *f = fopen(tmpPath.c_str(), "wb");
+    if (f == NULL)
+    {
+        return LE_IO_ERROR;
+    }
+
+    bool ok = (fwrite(image.data(), 1, image.size(), f) == image.size());
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmpPath.c_str(), path) != 0)
+    {
+        remove(tmpPath.c_str());
+        return LE_IO_ERROR;
+    }
+    return LE_OK;
+}
+
+bool CombainApDatabase::isDirty(void) const
+{
+    return this->dirty;
+}
+
+CombainApDatabase::Stats CombainApDatabase::getStats(void) const
+{
+    Stats s = this->stats;
+    s.size = this->aps.size();
+    return s;
+}
+
+bool CombainApDatabase::isExpired(const ApEstimate &e, uint32_t now) const
+{
+    // A clock set backwards makes entries look newer, not expired
+    return this->maxAgeSeconds != 0 && now > e.lastObserved &&
+        now - e.lastObserved > this->maxAgeSeconds;
+}
+
+void CombainApDatabase::evictOldest(void)
+{
+    if (!this->lru.empty())
+    {
+        this->aps.erase(this->lru.back());
+        this->lru.pop_back();
+    }
+}
+
+
+//----------------- STATIC
+static double SignalWeight(int16_t signalStrength)
+{
+    // Weight by received amplitude so that nearby APs dominate the estimate
+    return pow(10.0, signalStrength / 20.0);
+}
+
+static uint32_t NowSeconds(void)
+{
+    // Wall clock time, since it is persisted across reboots
+    return le_clk_GetAbsoluteTime().sec;
+}
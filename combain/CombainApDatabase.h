@@ -0,0 +1,85 @@
+#ifndef COMBAIN_AP_DATABASE_H
+#define COMBAIN_AP_DATABASE_H
+
+#include "legato.h"
+#include "interfaces.h"
+#include "CombainRequestBuilder.h"
+#include "CombainResult.h"
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Learns approximate WiFi AP positions from the results of previous lookups so that scans made up
+ * mostly of known APs can be resolved on the device, without contacting the Combain server.
+ *
+ * Each successful result is treated as an observation of every AP in the scan at the resolved
+ * position. An AP's position is the running weighted mean of its observations, where stronger
+ * signals and more accurate fixes carry more weight. A scan is then resolved to the weighted
+ * centroid of its known APs. APs which haven't been observed for maxAgeSeconds are no longer
+ * trusted, since they may have been moved or switched off.
+ */
+//--------------------------------------------------------------------------------------------------
+class CombainApDatabase
+{
+public:
+    struct Observation
+    {
+        uint64_t bssid;
+        int16_t signalStrength;
+    };
+
+    struct Stats
+    {
+        uint32_t size;
+        uint32_t localFixes;
+        uint32_t fallbackFixes;
+    };
+
+    CombainApDatabase(
+        size_t capacity, uint32_t minKnownAps, uint32_t minKnownPercent, uint32_t maxAgeSeconds);
+
+    static void observe(const std::vector<WifiApScanItem> &aps, std::vector<Observation> *scan);
+
+    bool isEnabled(void) const;
+    void learn(const std::vector<Observation> &scan, const CombainSuccessResponse &fix);
+    bool estimate(
+        const std::vector<Observation> &scan, bool isFallback, double *latitude,
+        double *longitude, double *accuracyInMeters);
+    le_result_t load(const char *path);
+    void serialize(std::string *image);
+    static le_result_t writeFile(const char *path, const std::string &image);
+    bool isDirty(void) const;
+    Stats getStats(void) const;
+
+private:
+    struct ApEstimate
+    {
+        double latitude;
+        double longitude;
+        float weight;            ///< Sum of the weights of all observations so far
+        uint16_t accuracy;       ///< Weighted mean of the accuracy of the fixes, in meters
+        uint32_t lastObserved;   ///< Wall clock time in seconds
+        std::list<uint64_t>::iterator lruPosition;
+    };
+
+    bool isExpired(const ApEstimate &e, uint32_t now) const;
+    void evictOldest(void);
+
+    size_t capacity;
+    uint32_t minKnownAps;
+    uint32_t minKnownPercent;
+    uint32_t maxAgeSeconds;
+    std::unordered_map<uint64_t, ApEstimate> aps;
+    // Most recently observed BSSID at the front, so the oldest AP is evicted without a search
+    std::list<uint64_t> lru;
+    // Known APs of the scan being estimated. Kept between calls to avoid reallocating.
+    std::vector<std::pair<const ApEstimate *, double>> estimateScratch;
+    bool dirty;
+    Stats stats;
+};
+
+#endif // COMBAIN_AP_DATABASE_H
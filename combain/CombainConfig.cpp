@@ -0,0 +1,239 @@
+#include "CombainConfig.h"
+
+// The service's working directory isn't writeable, so files are kept here
+#define APPS_WRITEABLE_DIR "/legato/systems/current/appsWriteable/combainLocation"
+
+#define DEFAULT_SERVER_URL "https://cps.combain.com"
+#define DEFAULT_CA_FILE ""
+#define DEFAULT_MAX_REQUESTS 64
+#define DEFAULT_MAX_CONCURRENT_REQUESTS 4
+#define DEFAULT_MAX_RESPONSE_BYTES (64 * 1024)
+#define DEFAULT_TRANSFER_TIMEOUT_MS 30000
+#define DEFAULT_LOW_SPEED_BYTES_PER_SECOND 16
+#define DEFAULT_LOW_SPEED_SECONDS 10
+#define DEFAULT_HTTP2 true
+#define DEFAULT_DNS_CACHE_SECONDS 300
+#define DEFAULT_PREWARM true
+#define DEFAULT_PREWARM_REFRESH_SECONDS 0
+#define DEFAULT_COMPRESS_REQUESTS false
+#define DEFAULT_COMPRESSION_MIN_BYTES 256
+#define DEFAULT_ACCEPT_COMPRESSED_RESPONSES true
+#define DEFAULT_RETRY_MAX_ATTEMPTS 3
+#define DEFAULT_RETRY_BASE_DELAY_MS 500
+#define DEFAULT_RETRY_MAX_DELAY_MS 8000
+#define DEFAULT_CIRCUIT_FAILURE_THRESHOLD 5
+#define DEFAULT_CIRCUIT_OPEN_MS 30000
+#define DEFAULT_AP_SELECTION_DEDUPE true
+#define DEFAULT_AP_SELECTION_DROP_RANDOMIZED_MACS false
+#define DEFAULT_AP_SELECTION_MIN_SIGNAL_DBM 0
+#define DEFAULT_AP_SELECTION_MAX_APS 0
+#define DEFAULT_RESULT_CACHE_CAPACITY 16
+#define DEFAULT_RESULT_CACHE_TTL_SECONDS 300
+#define DEFAULT_AP_DATABASE_CAPACITY 0
+#define DEFAULT_AP_DATABASE_MIN_KNOWN_APS 3
+#define DEFAULT_AP_DATABASE_MIN_KNOWN_PERCENT 75
+#define DEFAULT_AP_DATABASE_MAX_AGE_SECONDS (7 * 24 * 60 * 60)
+#define DEFAULT_AP_DATABASE_PREFER_LOCAL false
+#define DEFAULT_AP_DATABASE_PATH APPS_WRITEABLE_DIR "/apDatabase.bin"
+#define DEFAULT_TRACE_ENABLED false
+#define DEFAULT_TRACE_PATH APPS_WRITEABLE_DIR "/trace.bin"
+#define DEFAULT_TRACE_BUFFER_BYTES (64 * 1024)
+#define DEFAULT_TRACE_MAX_FILE_BYTES (1024 * 1024)
+
+static uint32_t GetUint(const char *path, uint32_t defaultValue, uint32_t min, uint32_t max)
+{
+    const int32_t v = le_cfg_QuickGetInt(path, defaultValue);
+    if (v < (int32_t)min || (uint32_t)v > max)
+    {
+        LE_WARN(
+            "Config value %s=%d is out of range [%u, %u]. Using %u instead.",
+            path,
+            v,
+            min,
+            max,
+            defaultValue);
+        return defaultValue;
+    }
+    return v;
+}
+
+static int32_t GetInt(const char *path, int32_t defaultValue, int32_t min, int32_t max)
+{
+    const int32_t v = le_cfg_QuickGetInt(path, defaultValue);
+    if (v < min || v > max)
+    {
+        LE_WARN(
+            "Config value %s=%d is out of range [%d, %d]. Using %d instead.",
+            path,
+            v,
+            min,
+            max,
+            defaultValue);
+        return defaultValue;
+    }
+    return v;
+}
+
+void CombainConfigLoad(CombainConfig *config)
+{
+    if (le_cfg_QuickGetString(
+            "/ServerUrl",
+            config->serverUrl,
+            sizeof(config->serverUrl),
+            DEFAULT_SERVER_URL) != LE_OK)
+    {
+        LE_WARN("/ServerUrl is too long. Using %s instead.", DEFAULT_SERVER_URL);
+        strcpy(config->serverUrl, DEFAULT_SERVER_URL);
+    }
+    if (le_cfg_QuickGetString(
+            "/CaFile", config->caFile, sizeof(config->caFile), DEFAULT_CA_FILE) != LE_OK)
+    {
+        LE_WARN("/CaFile is too long. Using the system's CA certificates instead.");
+        strcpy(config->caFile, DEFAULT_CA_FILE);
+    }
+    config->maxRequests = GetUint("/MaxRequests", DEFAULT_MAX_REQUESTS, 1, 32767);
+    config->maxConcurrentRequests =
+        GetUint("/MaxConcurrentRequests", DEFAULT_MAX_CONCURRENT_REQUESTS, 1, 64);
+    config->maxResponseBytes =
+        GetUint("/MaxResponseBytes", DEFAULT_MAX_RESPONSE_BYTES, 0, INT32_MAX);
+    config->transferTimeoutMs =
+        GetUint("/TransferTimeoutMs", DEFAULT_TRANSFER_TIMEOUT_MS, 0, 10 * 60 * 1000);
+    config->lowSpeedBytesPerSecond = GetUint(
+        "/LowSpeed/BytesPerSecond", DEFAULT_LOW_SPEED_BYTES_PER_SECOND, 1, INT32_MAX);
+    config->lowSpeedSeconds = GetUint("/LowSpeed/Seconds", DEFAULT_LOW_SPEED_SECONDS, 0, 600);
+    config->http2 = le_cfg_QuickGetBool("/Http2", DEFAULT_HTTP2);
+    config->dnsCacheSeconds =
+        GetUint("/DnsCacheSeconds", DEFAULT_DNS_CACHE_SECONDS, 0, 24 * 60 * 60);
+    config->prewarm = le_cfg_QuickGetBool("/Prewarm/Enable", DEFAULT_PREWARM);
+    config->prewarmRefreshSeconds =
+        GetUint("/Prewarm/RefreshSeconds", DEFAULT_PREWARM_REFRESH_SECONDS, 0, 24 * 60 * 60);
+    config->compressRequests =
+        le_cfg_QuickGetBool("/Compression/Requests", DEFAULT_COMPRESS_REQUESTS);
+    config->compressionMinBytes =
+        GetUint("/Compression/MinBytes", DEFAULT_COMPRESSION_MIN_BYTES, 0, INT32_MAX);
+    config->acceptCompressedResponses =
+        le_cfg_QuickGetBool("/Compression/Responses", DEFAULT_ACCEPT_COMPRESSED_RESPONSES);
+    config->retryMaxAttempts = GetUint("/Retry/MaxAttempts", DEFAULT_RETRY_MAX_ATTEMPTS, 1, 10);
+    config->retryBaseDelayMs =
+        GetUint("/Retry/BaseDelayMs", DEFAULT_RETRY_BASE_DELAY_MS, 0, 60 * 1000);
+    config->retryMaxDelayMs =
+        GetUint("/Retry/MaxDelayMs", DEFAULT_RETRY_MAX_DELAY_MS, 0, 10 * 60 * 1000);
+    config->circuitFailureThreshold = GetUint(
+        "/CircuitBreaker/FailureThreshold", DEFAULT_CIRCUIT_FAILURE_THRESHOLD, 0, 1000);
+    config->circuitOpenMs =
+        GetUint("/CircuitBreaker/OpenMs", DEFAULT_CIRCUIT_OPEN_MS, 1000, 60 * 60 * 1000);
+    config->apSelectionDedupe =
+        le_cfg_QuickGetBool("/ApSelection/Dedupe", DEFAULT_AP_SELECTION_DEDUPE);
+    config->apSelectionDropRandomizedMacs = le_cfg_QuickGetBool(
+        "/ApSelection/DropRandomizedMacs", DEFAULT_AP_SELECTION_DROP_RANDOMIZED_MACS);
+    config->apSelectionMinSignalDbm =
+        GetInt("/ApSelection/MinSignalDbm", DEFAULT_AP_SELECTION_MIN_SIGNAL_DBM, -127, 0);
+    config->apSelectionMaxAps =
+        GetUint("/ApSelection/MaxAps", DEFAULT_AP_SELECTION_MAX_APS, 0, 1000);
+    config->resultCacheCapacity =
+        GetUint("/ResultCache/Capacity", DEFAULT_RESULT_CACHE_CAPACITY, 0, 1024);
+    config->resultCacheTtlSeconds =
+        GetUint("/ResultCache/TtlSeconds", DEFAULT_RESULT_CACHE_TTL_SECONDS, 0, 24 * 60 * 60);
+    config->apDatabaseCapacity =
+        GetUint("/ApDatabase/Capacity", DEFAULT_AP_DATABASE_CAPACITY, 0, 65536);
+    config->apDatabaseMinKnownAps =
+        GetUint("/ApDatabase/MinKnownAps", DEFAULT_AP_DATABASE_MIN_KNOWN_APS, 1, 100);
+    config->apDatabaseMinKnownPercent =
+        GetUint("/ApDatabase/MinKnownPercent", DEFAULT_AP_DATABASE_MIN_KNOWN_PERCENT, 0, 100);
+    config->apDatabaseMaxAgeSeconds = GetUint(
+        "/ApDatabase/MaxAgeSeconds", DEFAULT_AP_DATABASE_MAX_AGE_SECONDS, 0, 365 * 24 * 60 * 60);
+    config->apDatabasePreferLocal =
+        le_cfg_QuickGetBool("/ApDatabase/PreferLocal", DEFAULT_AP_DATABASE_PREFER_LOCAL);
+    if (le_cfg_QuickGetString(
+            "/ApDatabase/Path",
+            config->apDatabasePath,
+            sizeof(config->apDatabasePath),
+            DEFAULT_AP_DATABASE_PATH) != LE_OK)
+    {
+        LE_WARN("/ApDatabase/Path is too long. Using %s instead.", DEFAULT_AP_DATABASE_PATH);
+        strcpy(config->apDatabasePath, DEFAULT_AP_DATABASE_PATH);
+    }
+    config->traceEnabled = le_cfg_QuickGetBool("/Trace/Enable", DEFAULT_TRACE_ENABLED);
+    if (le_cfg_QuickGetString(
+            "/Trace/Path",
+            config->tracePath,
+            sizeof(config->tracePath),
+            DEFAULT_TRACE_PATH) != LE_OK)
+    {
+        LE_WARN("/Trace/Path is too long. Using %s instead.", DEFAULT_TRACE_PATH);
+        strcpy(config->tracePath, DEFAULT_TRACE_PATH);
+    }
+    else if (config->tracePath[0] != '/')
+    {
+        char relativePath[sizeof(config->tracePath)];
+        strcpy(relativePath, config->tracePath);
+        const int len = snprintf(
+            config->tracePath,
+            sizeof(config->tracePath),
+            "%s/%s",
+            APPS_WRITEABLE_DIR,
+            relativePath);
+        if (len >= (int)sizeof(config->tracePath))
+        {
+            LE_WARN("/Trace/Path is too long. Using %s instead.", DEFAULT_TRACE_PATH);
+            strcpy(config->tracePath, DEFAULT_TRACE_PATH);
+        }
+    }
+    config->traceBufferBytes =
+        GetUint("/Trace/BufferBytes", DEFAULT_TRACE_BUFFER_BYTES, 4096, 16 * 1024 * 1024);
+    config->traceMaxFileBytes =
+        GetUint("/Trace/MaxFileBytes", DEFAULT_TRACE_MAX_FILE_BYTES, 4096, INT32_MAX);
+
+    LE_INFO("serverUrl=\"%s\", caFile=\"%s\"", config->serverUrl, config->caFile);
+    LE_INFO(
+        "maxRequests=%u, maxConcurrentRequests=%u, maxResponseBytes=%u",
+        config->maxRequests,
+        config->maxConcurrentRequests,
+        config->maxResponseBytes);
+    LE_INFO(
+        "transferTimeout=%ums, lowSpeed=%u B/s for %us",
+        config->transferTimeoutMs,
+        config->lowSpeedBytesPerSecond,
+        config->lowSpeedSeconds);
+    LE_INFO("http2=%d, dnsCache=%us", config->http2, config->dnsCacheSeconds);
+    LE_INFO("prewarm=%d, refresh=%us", config->prewarm, config->prewarmRefreshSeconds);
+    LE_INFO(
+        "compression requests=%d, minBytes=%u, responses=%d",
+        config->compressRequests,
+        config->compressionMinBytes,
+        config->acceptCompressedResponses);
+    LE_INFO(
+        "retry maxAttempts=%u, baseDelay=%ums, maxDelay=%ums",
+        config->retryMaxAttempts,
+        config->retryBaseDelayMs,
+        config->retryMaxDelayMs);
+    LE_INFO(
+        "circuitBreaker failureThreshold=%u, open=%ums",
+        config->circuitFailureThreshold,
+        config->circuitOpenMs);
+    LE_INFO(
+        "apSelection dedupe=%d, dropRandomizedMacs=%d, minSignal=%ddBm, maxAps=%u",
+        config->apSelectionDedupe,
+        config->apSelectionDropRandomizedMacs,
+        config->apSelectionMinSignalDbm,
+        config->apSelectionMaxAps);
+    LE_INFO(
+        "resultCache capacity=%u, ttl=%us",
+        config->resultCacheCapacity,
+        config->resultCacheTtlSeconds);
+    LE_INFO(
+        "apDatabase capacity=%u, minKnownAps=%u, minKnownPercent=%u, maxAge=%us, preferLocal=%d, "
+        "path=\"%s\"",
+        config->apDatabaseCapacity,
+        config->apDatabaseMinKnownAps,
+        config->apDatabaseMinKnownPercent,
+        config->apDatabaseMaxAgeSeconds,
+        config->apDatabasePreferLocal,
+        config->apDatabasePath);
+    LE_INFO(
+        "trace enabled=%d, path=\"%s\", bufferBytes=%u, maxFileBytes=%u",
+        config->traceEnabled,
+        config->tracePath,
+        config->traceBufferBytes,
+        config->traceMaxFileBytes);
+}
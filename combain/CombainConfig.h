@@ -0,0 +1,56 @@
+#ifndef COMBAIN_CONFIG_H
+#define COMBAIN_CONFIG_H
+
+#include "legato.h"
+#include "interfaces.h"
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Tunables for the service. They are read once from the app's config tree at startup, so changes
+ * made with "config set combainLocation:/..." take effect when the app is restarted.
+ */
+//--------------------------------------------------------------------------------------------------
+struct CombainConfig
+{
+    char serverUrl[256];                ///< Combain positioning endpoint, without the key
+    char caFile[256];                   ///< CA certificates to verify the server with. Empty for
+                                        ///< the system's.
+    uint32_t maxRequests;               ///< Max number of request objects that may exist at once
+    uint32_t maxConcurrentRequests;     ///< Max number of HTTP requests in flight at once
+    uint32_t maxResponseBytes;          ///< Responses larger than this fail. 0 for no limit.
+    uint32_t transferTimeoutMs;         ///< Limit on a whole HTTP request. 0 for no limit.
+    uint32_t lowSpeedBytesPerSecond;    ///< Transfers slower than this for too long are aborted
+    uint32_t lowSpeedSeconds;           ///< How long a transfer may be slow for. 0 disables.
+    bool http2;                         ///< Multiplex requests over one HTTP/2 connection
+    uint32_t dnsCacheSeconds;           ///< How long a resolved server address is reused for
+    bool prewarm;                       ///< Connect to the server before the first request
+    uint32_t prewarmRefreshSeconds;     ///< Reconnect after this long idle. 0 disables.
+    bool compressRequests;              ///< Send request bodies gzip compressed
+    uint32_t compressionMinBytes;       ///< Smaller request bodies are sent uncompressed
+    bool acceptCompressedResponses;     ///< Let the server compress responses
+    uint32_t retryMaxAttempts;          ///< Times a request is sent before a failure is reported
+    uint32_t retryBaseDelayMs;          ///< Backoff before the first retry. Doubles each retry.
+    uint32_t retryMaxDelayMs;           ///< Cap on the backoff between retries
+    uint32_t circuitFailureThreshold;   ///< Failures in a row which open the circuit. 0 disables.
+    uint32_t circuitOpenMs;             ///< How long the circuit stays open before a probe
+    bool apSelectionDedupe;             ///< Send only the strongest reading of each BSSID
+    bool apSelectionDropRandomizedMacs; ///< Don't send locally administered BSSIDs
+    int32_t apSelectionMinSignalDbm;    ///< Don't send APs weaker than this. 0 sends all.
+    uint32_t apSelectionMaxAps;         ///< Send only this many of the strongest APs. 0 for all.
+    uint32_t resultCacheCapacity;       ///< Number of scans to cache results for. 0 disables.
+    uint32_t resultCacheTtlSeconds;     ///< How long a cached result may be used for
+    uint32_t apDatabaseCapacity;        ///< Number of APs to learn positions for. 0 disables.
+    uint32_t apDatabaseMinKnownAps;     ///< Min known APs in a scan to resolve it locally
+    uint32_t apDatabaseMinKnownPercent; ///< Min percentage of known APs to resolve locally
+    uint32_t apDatabaseMaxAgeSeconds;   ///< Forget APs not observed for this long. 0 never forgets.
+    bool apDatabasePreferLocal;         ///< Resolve locally when possible, not only as a fallback
+    char apDatabasePath[256];           ///< File to persist the AP database in. Empty disables.
+    bool traceEnabled;                  ///< Record requests and responses to a trace file
+    char tracePath[256];                ///< Trace file
+    uint32_t traceBufferBytes;          ///< Size of the in-memory ring that records are queued in
+    uint32_t traceMaxFileBytes;         ///< Size at which the trace file is rotated
+};
+
+void CombainConfigLoad(CombainConfig *config);
+
+#endif // COMBAIN_CONFIG_H
@@ -0,0 +1,57 @@
+#include "CombainGzip.h"
+
+// Request bodies are a few kilobytes at most, so a 4 KiB window finds nearly all of the repetition
+// between APs while keeping the deflate state to around 32 KiB instead of the default 256 KiB.
+#define GZIP_WINDOW_BITS 12
+#define GZIP_MEM_LEVEL 5
+// Added to the window bits to make zlib write a gzip header and trailer rather than a zlib one
+#define GZIP_WRAPPER 16
+
+
+CombainGzip::CombainGzip(int level)
+{
+    this->stream.zalloc = Z_NULL;
+    this->stream.zfree = Z_NULL;
+    this->stream.opaque = Z_NULL;
+    const int res = deflateInit2(
+        &this->stream,
+        level,
+        Z_DEFLATED,
+        GZIP_WINDOW_BITS + GZIP_WRAPPER,
+        GZIP_MEM_LEVEL,
+        Z_DEFAULT_STRATEGY);
+    LE_ASSERT(res == Z_OK);
+}
+
+CombainGzip::~CombainGzip(void)
+{
+    deflateEnd(&this->stream);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compresses in into out, replacing the contents of out.
+ *
+ * @return false if in couldn't be compressed, in which case out is undefined
+ */
+//--------------------------------------------------------------------------------------------------
+bool CombainGzip::compress(const std::string &in, std::string *out)
+{
+    if (deflateReset(&this->stream) != Z_OK)
+    {
+        return false;
+    }
+
+    // deflateBound() accounts for the gzip wrapper, so a single call to deflate() always finishes
+    out->resize(deflateBound(&this->stream, in.size()));
+    this->stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    this->stream.avail_in = in.size();
+    this->stream.next_out = reinterpret_cast<Bytef *>(&(*out)[0]);
+    this->stream.avail_out = out->size();
+    if (deflate(&this->stream, Z_FINISH) != Z_STREAM_END)
+    {
+        return false;
+    }
+    out->resize(this->stream.total_out);
+    return true;
+}
@@ -0,0 +1,31 @@
+#ifndef COMBAIN_GZIP_H
+#define COMBAIN_GZIP_H
+
+#include "legato.h"
+
+#include <string>
+#include <zlib.h>
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compresses request bodies into the gzip format for sending with "Content-Encoding: gzip". The
+ * deflate state is kept between calls, so compressing a body doesn't allocate once the output
+ * buffer has grown to fit. Not thread safe.
+ */
+//--------------------------------------------------------------------------------------------------
+class CombainGzip
+{
+public:
+    explicit CombainGzip(int level);
+    ~CombainGzip(void);
+
+    CombainGzip(const CombainGzip&) = delete;
+    CombainGzip& operator=(const CombainGzip&) = delete;
+
+    bool compress(const std::string &in, std::string *out);
+
+private:
+    z_stream stream;
+};
+
+#endif // COMBAIN_GZIP_H
@@ -1,97 +1,1158 @@
 #include <curl/curl.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
 #include "CombainHttp.h"
+#include "CombainGzip.h"
+#include "CombainStats.h"
 #include "legato.h"
 #include "interfaces.h"
 
 #define CURL_CONNECT_TIMEOUT_SECONDS 10
 
-static ThreadSafeQueue<std::tuple<ma_combainLocation_LocReqHandleRef_t, std::string, std::string>> *RequestJson;
-static ThreadSafeQueue<std::tuple<ma_combainLocation_LocReqHandleRef_t, std::string>> *ResponseJson;
+// Idle time before TCP keep-alive probes are sent on the warm connection. Cellular carriers tend to
+// drop idle NAT mappings after a few minutes, so probe well before that happens.
+#define TCP_KEEPALIVE_IDLE_SECONDS 60
+#define TCP_KEEPALIVE_INTERVAL_SECONDS 30
+
+// Upper bound on how long the HTTP thread sleeps in curl_multi_wait() when libcurl has nothing for
+// it to do. New requests wake the thread immediately through WakeupFd.
+#define MULTI_WAIT_TIMEOUT_MS 1000
+
+// Backoff between attempts to warm up a connection while the server can't be reached, e.g. before
+// the data connection comes up after boot
+#define WARMUP_MIN_RETRY_US (5 * 1000000ULL)
+#define WARMUP_MAX_RETRY_US (300 * 1000000ULL)
+
+static SpscChannel<CombainHttpRequest> *RequestJson;
+static SpscChannel<CombainHttpResponse> *ResponseJson;
+static SpscChannel<ma_combainLocation_LocReqHandleRef_t> *CancelledRequests;
 static le_event_Id_t ResponseAvailableEvent;
+static uint32_t MaxConcurrentRequests;
+static bool Http2;
+static long DnsCacheSeconds;
+static bool Prewarm;
+static uint64_t PrewarmRefreshUs;
+static size_t MaxResponseBytes;
+static long TransferTimeoutMs;
+static long LowSpeedBytesPerSecond;
+static long LowSpeedSeconds;
+// Cleared if the server rejects a compressed request
+static bool CompressRequests;
+static size_t CompressionMinBytes;
+static bool AcceptCompressedResponses;
+static uint32_t RetryMaxAttempts;
+static uint64_t RetryBaseDelayUs;
+static uint64_t RetryMaxDelayUs;
+static uint32_t CircuitFailureThreshold;
+static uint64_t CircuitOpenUs;
+static std::string ServerUrl;
+// Empty to verify the server against the system's CA certificates
+static std::string CaFile;
+// The server URL up to and including "key=", so that the API key can be appended
+static std::string UrlPrefix;
+
+// Most responses fit in this without having to grow the buffer
+#define INITIAL_RESPONSE_BUFFER_BYTES 512
+
+struct ScheduledRequest
+{
+    CombainHttpRequest request;
+    uint64_t sequence;  ///< Order of arrival, so that equally urgent requests are sent in order
+    uint32_t attempts;  ///< Times the request has been sent already
+    uint64_t retryAtUs; ///< When a request which is backing off may be sent again
+};
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * State for one request. Transfers and their easy handles are recycled once a request completes
+ * rather than being freed.
+ */
+//--------------------------------------------------------------------------------------------------
+struct Transfer
+{
+    CURL *curl;
+    ScheduledRequest scheduled; ///< Kept so that the request can be retried. Posts its body.
+    bool isProbe;               ///< Sent to test whether the server has recovered
+    bool isWarmup;              ///< Only opens a connection. There is no request to respond to.
+    bool isCompressed;          ///< compressedBody was sent instead of the request body
+    std::string compressedBody;
+    std::string responseBody;   ///< Moved to the main thread when the transfer completes
+};
+
+// The headers are identical for every request, so build them once rather than per transfer
+static struct curl_slist *HttpHeaders;
+static struct curl_slist *CompressedHttpHeaders;
+
+// Compresses request bodies. NULL if request compression is disabled.
+static std::unique_ptr<CombainGzip> Gzip;
+
+// Shares the DNS cache and TLS session IDs between easy handles so that every transfer can resume
+// the previous TLS session instead of doing a full handshake.
+static CURLSH *CurlShare;
+
+// Owns the connection cache, so connections stay open after the transfer which created them is
+// finished and are picked up by the next transfer to the same host.
+static CURLM *CurlMulti;
 
-static struct ReceiveBuffer
+// Written by the main thread to wake the HTTP thread when a request has been queued
+static int WakeupFd = -1;
+
+static std::vector<std::unique_ptr<Transfer>> IdleTransfers;
+// Transfers on the multi handle, which owns them until they complete or are cancelled
+static std::vector<Transfer *> ActiveTransfers;
+
+// Sends a HEAD request to the server so that DNS, TCP and TLS are done before a client asks for a
+// location, and the connection is in the connection cache for the request to use. NULL while it is
+// on the multi handle.
+static std::unique_ptr<Transfer> WarmupTransfer;
+// When a warm-up is due. 0 if none is.
+static uint64_t NextWarmupUs;
+static uint64_t WarmupRetryUs = WARMUP_MIN_RETRY_US;
+
+// Requests taken from RequestJson which haven't been started yet, kept as a heap with the next
+// request to send at the front. See SendsAfter().
+static std::vector<ScheduledRequest> Scheduled;
+static uint64_t NextSequence;
+
+// Requests waiting to be retried after a transient failure, in no particular order
+static std::vector<ScheduledRequest> BackingOff;
+
+// Jitter for retry backoff, so that requests which failed together aren't retried together
+static std::minstd_rand BackoffRandom;
+
+// HTTP thread only. Stats holds a copy of the state for other threads.
+static struct
 {
-    size_t used;
-    uint8_t data[1024];
-} HttpReceiveBuffer;
+    ma_combainLocation_CircuitState_t state;
+    uint32_t consecutiveFailures;
+    uint64_t openUntilUs;
+    bool probeInFlight;
+} Circuit;
+
+// Responses which didn't fit in ResponseJson because the main thread has fallen behind. No new
+// transfers are started until these have been handed over.
+static std::deque<CombainHttpResponse> PendingResponses;
+
+// Set when responses have been pushed to ResponseJson since ResponseAvailableEvent was last
+// reported. HTTP thread only.
+static bool ResponsesPushed;
+
+// Set while a ResponseAvailableEvent is reported but not yet handled, so that a burst of responses
+// wakes the main thread once rather than once per response
+static std::atomic<bool> ResponseEventPending;
+
+static struct
+{
+    std::atomic<uint32_t> requests;
+    std::atomic<uint32_t> connectionsOpened;
+    std::atomic<uint32_t> connectionsReused;
+    std::atomic<uint32_t> http2Requests;
+    std::atomic<uint32_t> responseEvents;
+    std::atomic<uint32_t> circuitState;
+    std::atomic<uint32_t> consecutiveFailures;
+    std::atomic<uint32_t> circuitTrips;
+    std::atomic<uint32_t> retries;
+    std::atomic<uint32_t> fastFailures;
+    std::atomic<uint32_t> cancelled;
+} Stats;
 
 void CombainHttpInit(
-    ThreadSafeQueue<std::tuple<ma_combainLocation_LocReqHandleRef_t, std::string, std::string>> *requestJson,
-    ThreadSafeQueue<std::tuple<ma_combainLocation_LocReqHandleRef_t, std::string>> *responseJson,
-    le_event_Id_t responseAvailableEvent)
+    SpscChannel<CombainHttpRequest> *requestJson,
+    SpscChannel<CombainHttpResponse> *responseJson,
+    SpscChannel<ma_combainLocation_LocReqHandleRef_t> *cancelledRequests,
+    le_event_Id_t responseAvailableEvent,
+    const CombainConfig &config)
 {
     RequestJson = requestJson;
     ResponseJson = responseJson;
+    CancelledRequests = cancelledRequests;
     ResponseAvailableEvent = responseAvailableEvent;
+    MaxConcurrentRequests = config.maxConcurrentRequests;
+    Http2 = config.http2;
+    DnsCacheSeconds = config.dnsCacheSeconds;
+    Prewarm = config.prewarm;
+    PrewarmRefreshUs = config.prewarmRefreshSeconds * 1000000ULL;
+    MaxResponseBytes = config.maxResponseBytes;
+    TransferTimeoutMs = config.transferTimeoutMs;
+    LowSpeedBytesPerSecond = config.lowSpeedBytesPerSecond;
+    LowSpeedSeconds = config.lowSpeedSeconds;
+    CompressRequests = config.compressRequests;
+    CompressionMinBytes = config.compressionMinBytes;
+    AcceptCompressedResponses = config.acceptCompressedResponses;
+    RetryMaxAttempts = config.retryMaxAttempts;
+    RetryBaseDelayUs = config.retryBaseDelayMs * 1000ULL;
+    RetryMaxDelayUs = config.retryMaxDelayMs * 1000ULL;
+    CircuitFailureThreshold = config.circuitFailureThreshold;
+    CircuitOpenUs = config.circuitOpenMs * 1000ULL;
+    BackoffRandom.seed(static_cast<std::minstd_rand::result_type>(CombainStatsNowUs()));
+    ServerUrl = config.serverUrl;
+    CaFile = config.caFile;
+    UrlPrefix = ServerUrl + "?key=";
+    NextWarmupUs = Prewarm ? CombainStatsNowUs() : 0;
     CURLcode res = curl_global_init(CURL_GLOBAL_ALL);
     LE_ASSERT(res == 0);
+
+    HttpHeaders = curl_slist_append(NULL, "Content-Type:application/json");
+    LE_ASSERT(HttpHeaders != NULL);
+    CompressedHttpHeaders = curl_slist_append(NULL, "Content-Type:application/json");
+    LE_ASSERT(CompressedHttpHeaders != NULL);
+    LE_ASSERT(curl_slist_append(CompressedHttpHeaders, "Content-Encoding:gzip") != NULL);
+    if (CompressRequests)
+    {
+        Gzip.reset(new CombainGzip(Z_DEFAULT_COMPRESSION));
+    }
+
+    CurlShare = curl_share_init();
+    LE_ASSERT(CurlShare != NULL);
+    LE_ASSERT(curl_share_setopt(CurlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) == CURLSHE_OK);
+    LE_ASSERT(
+        curl_share_setopt(CurlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) == CURLSHE_OK);
+
+    CurlMulti = curl_multi_init();
+    LE_ASSERT(CurlMulti != NULL);
+    LE_ASSERT(
+        curl_multi_setopt(CurlMulti, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)MaxConcurrentRequests) ==
+        CURLM_OK);
+    if (Http2)
+    {
+        // Concurrent requests become streams on one connection, so a burst of lookups costs one
+        // TCP and TLS handshake rather than one per request
+        LE_ASSERT(
+            curl_multi_setopt(CurlMulti, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX) ==
+            CURLM_OK);
+    }
+
+    WakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    LE_ASSERT(WakeupFd >= 0);
 }
 
 void CombainHttpDeinit(void)
 {
+    for (auto &t : IdleTransfers)
+    {
+        curl_easy_cleanup(t->curl);
+    }
+    IdleTransfers.clear();
+    if (WarmupTransfer)
+    {
+        curl_easy_cleanup(WarmupTransfer->curl);
+        WarmupTransfer.reset();
+    }
+    curl_multi_cleanup(CurlMulti);
+    CurlMulti = NULL;
+    curl_share_cleanup(CurlShare);
+    CurlShare = NULL;
+    curl_slist_free_all(HttpHeaders);
+    HttpHeaders = NULL;
+    curl_slist_free_all(CompressedHttpHeaders);
+    CompressedHttpHeaders = NULL;
+    Gzip.reset();
+    close(WakeupFd);
+    WakeupFd = -1;
     curl_global_cleanup();
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Wakes the HTTP thread. Called when a request has been queued, and when the main thread has
+ * emptied a full response channel so that responses held back by the HTTP thread can be sent.
+ */
+//--------------------------------------------------------------------------------------------------
+void CombainHttpWakeup(void)
+{
+    const uint64_t one = 1;
+    // A failed write means that the counter is already non-zero, so the thread will wake anyway
+    if (write(WakeupFd, &one, sizeof(one)) != sizeof(one))
+    {
+        LE_DEBUG("HTTP thread wakeup already pending");
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Called by the main thread when it handles ResponseAvailableEvent, before draining the response
+ * channel. Responses pushed after this will cause the event to be reported again.
+ */
+//--------------------------------------------------------------------------------------------------
+void CombainHttpAckResponseEvent(void)
+{
+    ResponseEventPending.store(false);
+}
+
+CombainHttpStats CombainHttpGetStats(void)
+{
+    CombainHttpStats s;
+    s.requests = Stats.requests.load();
+    s.connectionsOpened = Stats.connectionsOpened.load();
+    s.connectionsReused = Stats.connectionsReused.load();
+    s.http2Requests = Stats.http2Requests.load();
+    s.responseEvents = Stats.responseEvents.load();
+    s.circuitState = static_cast<ma_combainLocation_CircuitState_t>(Stats.circuitState.load());
+    s.consecutiveFailures = Stats.consecutiveFailures.load();
+    s.circuitTrips = Stats.circuitTrips.load();
+    s.retries = Stats.retries.load();
+    s.fastFailures = Stats.fastFailures.load();
+    s.cancelled = Stats.cancelled.load();
+    return s;
+}
+
 
 static size_t WriteMemCallback(void *contents, size_t size, size_t nmemb, void *userp)
 {
-    auto b = reinterpret_cast<ReceiveBuffer *>(userp);
+    auto b = reinterpret_cast<std::string *>(userp);
     const size_t numBytes = nmemb * size;
 
-    const size_t available = sizeof(b->data) - (b->used + 1);
-    const size_t numToCopy = std::min(available, numBytes);
-    memcpy(&b->data[b->used], contents, numToCopy);
-    b->used += numToCopy;
-    b->data[b->used] = 0;
-    return numToCopy;
+    if (MaxResponseBytes != 0 && b->size() + numBytes > MaxResponseBytes)
+    {
+        LE_ERROR("Response is larger than the limit of %zu bytes", MaxResponseBytes);
+        // Returning less than was passed makes libcurl abort the transfer with CURLE_WRITE_ERROR
+        return 0;
+    }
+
+    b->append(reinterpret_cast<const char *>(contents), numBytes);
+    return numBytes;
 }
 
-void *CombainHttpThreadFunc(void *context)
+//--------------------------------------------------------------------------------------------------
+/**
+ * Creates a transfer and sets all of the options on its easy handle which don't change between
+ * requests.
+ */
+//--------------------------------------------------------------------------------------------------
+static std::unique_ptr<Transfer> CreateTransfer(void)
 {
-    do {
-        auto t = RequestJson->dequeue();
-        ma_combainLocation_LocReqHandleRef_t handle = std::get<0>(t);
-        std::string &combainApiKey = std::get<1>(t);
-        std::string &requestBody = std::get<2>(t);
+    std::unique_ptr<Transfer> t(new Transfer());
+    CURL* curl = curl_easy_init();
+    LE_ASSERT(curl);
+    t->curl = curl;
+
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_PRIVATE, t.get()) == CURLE_OK);
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_SHARE, CurlShare) == CURLE_OK);
+    // The server's address rarely changes, so keep it for longer than libcurl's default of a minute
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, DnsCacheSeconds) == CURLE_OK);
+    if (!CaFile.empty())
+    {
+        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_CAINFO, CaFile.c_str()) == CURLE_OK);
+    }
+
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemCallback) == CURLE_OK);
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&t->responseBody) == CURLE_OK);
+    if (Http2)
+    {
+        // HTTP/2 is negotiated with ALPN during the TLS handshake. Servers which don't offer it,
+        // and plain http:// URLs, get HTTP/1.1 with keep-alive as before.
+        LE_ASSERT(
+            curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS) ==
+            CURLE_OK);
+        // While a connection is being set up, wait to see whether it can be multiplexed rather
+        // than opening another connection for each request in a burst
+        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L) == CURLE_OK);
+    }
+    if (AcceptCompressedResponses)
+    {
+        // An empty string offers every encoding that libcurl was built to decode. Responses are
+        // decoded before they reach WriteMemCallback.
+        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "") == CURLE_OK);
+    }
+
+    // Set the timeout for connection phase
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CURL_CONNECT_TIMEOUT_SECONDS) == CURLE_OK);
+    // Stop a stalled transfer from holding a connection slot indefinitely once connected
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, TransferTimeoutMs) == CURLE_OK);
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, LowSpeedBytesPerSecond) == CURLE_OK);
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, LowSpeedSeconds) == CURLE_OK);
+
+    // Keep the connection alive between lookups
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L) == CURLE_OK);
+    LE_ASSERT(curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, TCP_KEEPALIVE_IDLE_SECONDS) == CURLE_OK);
+    LE_ASSERT(
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, TCP_KEEPALIVE_INTERVAL_SECONDS) == CURLE_OK);
+
+    return t;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the request URL for an API key. The URLs are cached because there is normally only one key
+ * in use on a device.
+ */
+//--------------------------------------------------------------------------------------------------
+static const std::string &GetUrlForApiKey(const std::string &combainApiKey)
+{
+    static std::unordered_map<std::string, std::string> urls;
+
+    auto it = urls.find(combainApiKey);
+    if (it == urls.end())
+    {
+        it = urls.emplace(combainApiKey, UrlPrefix + combainApiKey).first;
+    }
+    return it->second;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Hands a response to the main thread, or holds on to it if ResponseJson is full. The main thread
+ * isn't told until ReportResponses() is called.
+ */
+//--------------------------------------------------------------------------------------------------
+static void SendResponse(CombainHttpResponse &&response)
+{
+    if (!PendingResponses.empty() || !ResponseJson->tryPush(std::move(response)))
+    {
+        PendingResponses.push_back(std::move(response));
+        return;
+    }
+    ResponsesPushed = true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Retries handing over responses which didn't fit in ResponseJson earlier.
+ */
+//--------------------------------------------------------------------------------------------------
+static void FlushPendingResponses(void)
+{
+    while (!PendingResponses.empty() && ResponseJson->tryPush(std::move(PendingResponses.front())))
+    {
+        PendingResponses.pop_front();
+        ResponsesPushed = true;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Tells the main thread about the responses pushed since the last call, unless it has already been
+ * told and hasn't got to them yet. In that case it will find the new responses in the same pass.
+ */
+//--------------------------------------------------------------------------------------------------
+static void ReportResponses(void)
+{
+    if (!ResponsesPushed)
+    {
+        return;
+    }
+    ResponsesPushed = false;
+    if (!ResponseEventPending.exchange(true))
+    {
+        Stats.responseEvents++;
+        le_event_Report(ResponseAvailableEvent, NULL, 0);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Orders the Scheduled heap. Requests are sent highest priority first, then earliest deadline, with
+ * requests that have no deadline last, then in the order they arrived.
+ *
+ * @return true if a should be sent after b
+ */
+//--------------------------------------------------------------------------------------------------
+static bool SendsAfter(const ScheduledRequest &a, const ScheduledRequest &b)
+{
+    if (a.request.priority != b.request.priority)
+    {
+        return a.request.priority < b.request.priority;
+    }
+    const uint64_t aDeadline = a.request.deadlineUs != 0 ? a.request.deadlineUs : UINT64_MAX;
+    const uint64_t bDeadline = b.request.deadlineUs != 0 ? b.request.deadlineUs : UINT64_MAX;
+    if (aDeadline != bDeadline)
+    {
+        return aDeadline > bDeadline;
+    }
+    return a.sequence > b.sequence;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Moves everything in the request queue onto the Scheduled heap, so that requests can be sent in
+ * order of urgency rather than in the order they were submitted.
+ */
+//--------------------------------------------------------------------------------------------------
+static void ScheduleQueuedRequests(void)
+{
+    ScheduledRequest s;
+    while (RequestJson->tryPop(s.request))
+    {
+        s.sequence = NextSequence++;
+        s.attempts = 0;
+        s.retryAtUs = 0;
+        Scheduled.push_back(std::move(s));
+        std::push_heap(Scheduled.begin(), Scheduled.end(), SendsAfter);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Drops the requests in a list whose deadline has passed, without doing any network I/O for them,
+ * and tells the main thread that they expired.
+ *
+ * @return true if any requests were dropped
+ */
+//--------------------------------------------------------------------------------------------------
+static bool ExpireRequests(std::vector<ScheduledRequest> *requests, uint64_t nowUs)
+{
+    bool expired = false;
+    for (size_t i = 0; i < requests->size();)
+    {
+        const CombainHttpRequest &r = (*requests)[i].request;
+        if (r.deadlineUs == 0 || r.deadlineUs > nowUs)
+        {
+            i++;
+            continue;
+        }
+
+        LE_DEBUG(
+            "Request missed its deadline by %" PRIu64 " us while queued", nowUs - r.deadlineUs);
+        SendResponse(
+            CombainHttpResponse{
+                r.handle, CombainHttpResponse::DEADLINE_EXPIRED, std::string(), nowUs});
+        (*requests)[i] = std::move(requests->back());
+        requests->pop_back();
+        expired = true;
+    }
+    return expired;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Drops the scheduled and backing off requests whose deadline has passed. A request which is
+ * waiting to be retried counts as queued, because it hasn't been sent successfully yet.
+ */
+//--------------------------------------------------------------------------------------------------
+static void ExpireScheduledRequests(uint64_t nowUs)
+{
+    if (ExpireRequests(&Scheduled, nowUs))
+    {
+        std::make_heap(Scheduled.begin(), Scheduled.end(), SendsAfter);
+    }
+    ExpireRequests(&BackingOff, nowUs);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Moves the requests which have finished backing off back onto the Scheduled heap.
+ */
+//--------------------------------------------------------------------------------------------------
+static void ScheduleDueRetries(uint64_t nowUs)
+{
+    for (size_t i = 0; i < BackingOff.size();)
+    {
+        if (BackingOff[i].retryAtUs > nowUs)
+        {
+            i++;
+            continue;
+        }
+        Scheduled.push_back(std::move(BackingOff[i]));
+        std::push_heap(Scheduled.begin(), Scheduled.end(), SendsAfter);
+        BackingOff[i] = std::move(BackingOff.back());
+        BackingOff.pop_back();
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets how long to wait before retrying a request which has been sent the given number of times.
+ * The backoff doubles with every attempt, and a random half of it is added or left out so that
+ * requests which failed together spread out.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint64_t GetRetryBackoffUs(uint32_t attempts)
+{
+    uint64_t backoffUs = RetryBaseDelayUs;
+    for (uint32_t i = 1; i < attempts && backoffUs < RetryMaxDelayUs; i++)
+    {
+        backoffUs *= 2;
+    }
+    backoffUs = std::min(backoffUs, RetryMaxDelayUs);
+
+    const uint64_t halfUs = backoffUs / 2;
+    return halfUs + BackoffRandom() % (backoffUs - halfUs + 1);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Decides whether a failed transfer is worth retrying: the server couldn't be reached, the
+ * connection broke, or the server said that it was overloaded or had an internal error.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool IsTransientFailure(CURLcode res, long httpStatus)
+{
+    switch (res)
+    {
+    case CURLE_OK:
+        return httpStatus == 429 || httpStatus >= 500;
+
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static void SetCircuitState(ma_combainLocation_CircuitState_t state)
+{
+    Circuit.state = state;
+    Stats.circuitState = state;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Records that a transfer reached the server, which closes the circuit.
+ */
+//--------------------------------------------------------------------------------------------------
+static void RecordCircuitSuccess(void)
+{
+    if (Circuit.state != MA_COMBAINLOCATION_CIRCUIT_CLOSED)
+    {
+        LE_INFO("Combain server is reachable again. Closing the circuit.");
+        SetCircuitState(MA_COMBAINLOCATION_CIRCUIT_CLOSED);
+    }
+    Circuit.consecutiveFailures = 0;
+    Stats.consecutiveFailures = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Records a transient failure. The circuit opens when a probe fails, or when the failure threshold
+ * is reached.
+ */
+//--------------------------------------------------------------------------------------------------
+static void RecordCircuitFailure(uint64_t nowUs)
+{
+    Circuit.consecutiveFailures++;
+    Stats.consecutiveFailures = Circuit.consecutiveFailures;
 
-        char combainUrl[128] = "https://cps.combain.com?key=";
-        strncat(combainUrl, combainApiKey.c_str(), sizeof(combainUrl) - (1 + strlen(combainUrl)));
+    const bool open = Circuit.state == MA_COMBAINLOCATION_CIRCUIT_HALF_OPEN ||
+        (Circuit.state == MA_COMBAINLOCATION_CIRCUIT_CLOSED && CircuitFailureThreshold != 0 &&
+         Circuit.consecutiveFailures >= CircuitFailureThreshold);
+    if (open)
+    {
+        LE_WARN(
+            "Combain server failed %u times in a row. Failing requests for %" PRIu64 " ms.",
+            Circuit.consecutiveFailures,
+            CircuitOpenUs / 1000);
+        SetCircuitState(MA_COMBAINLOCATION_CIRCUIT_OPEN);
+        Circuit.openUntilUs = nowUs + CircuitOpenUs;
+        Stats.circuitTrips++;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Fails every scheduled request while the circuit is open, and lets a probe through once the open
+ * period has passed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void ApplyCircuitBreaker(uint64_t nowUs)
+{
+    if (Circuit.state != MA_COMBAINLOCATION_CIRCUIT_OPEN)
+    {
+        return;
+    }
+    if (nowUs >= Circuit.openUntilUs)
+    {
+        LE_INFO("Sending a probe request to the Combain server");
+        SetCircuitState(MA_COMBAINLOCATION_CIRCUIT_HALF_OPEN);
+        return;
+    }
+
+    for (auto &s : Scheduled)
+    {
+        Stats.fastFailures++;
+        SendResponse(
+            CombainHttpResponse{
+                s.request.handle,
+                CombainHttpResponse::COMMUNICATION_FAILURE,
+                std::string(),
+                nowUs});
+    }
+    Scheduled.clear();
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets how long the HTTP thread may sleep before it has something to do: the earliest deadline of
+ * a queued request passes or a request finishes backing off.
+ */
+//--------------------------------------------------------------------------------------------------
+static int GetWaitTimeoutMs(uint64_t nowUs)
+{
+    uint64_t wakeUs = nowUs + MULTI_WAIT_TIMEOUT_MS * 1000ULL;
+    for (const auto &s : Scheduled)
+    {
+        if (s.request.deadlineUs != 0)
+        {
+            wakeUs = std::min(wakeUs, s.request.deadlineUs);
+        }
+    }
+    for (const auto &s : BackingOff)
+    {
+        wakeUs = std::min(wakeUs, s.retryAtUs);
+        if (s.request.deadlineUs != 0)
+        {
+            wakeUs = std::min(wakeUs, s.request.deadlineUs);
+        }
+    }
+    // A warm-up which is overdue is waiting for the thread to be idle, so doesn't need a wakeup
+    if (NextWarmupUs > nowUs)
+    {
+        wakeUs = std::min(wakeUs, NextWarmupUs);
+    }
+
+    // Round up so that the thread doesn't wake just before it is needed
+    return wakeUs > nowUs ? static_cast<int>((wakeUs - nowUs + 999) / 1000) : 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Moves the most urgent scheduled requests onto the multi handle until the concurrency limit is
+ * reached. While the circuit is half open, only the probe is sent.
+ */
+//--------------------------------------------------------------------------------------------------
+static void StartQueuedTransfers(void)
+{
+    while (ActiveTransfers.size() < MaxConcurrentRequests && !Scheduled.empty())
+    {
+        const bool isProbe = Circuit.state == MA_COMBAINLOCATION_CIRCUIT_HALF_OPEN;
+        if (isProbe && Circuit.probeInFlight)
+        {
+            break;
+        }
+
+        std::unique_ptr<Transfer> t;
+        if (IdleTransfers.empty())
+        {
+            t = CreateTransfer();
+        }
+        else
+        {
+            t = std::move(IdleTransfers.back());
+            IdleTransfers.pop_back();
+        }
+
+        std::pop_heap(Scheduled.begin(), Scheduled.end(), SendsAfter);
+        t->scheduled = std::move(Scheduled.back());
+        Scheduled.pop_back();
+        t->isProbe = isProbe;
+        Circuit.probeInFlight = isProbe;
+
+        const CombainHttpRequest &r = t->scheduled.request;
+        if (t->scheduled.attempts == 0)
+        {
+            CombainStatsRecordLatency(
+                MA_COMBAINLOCATION_STAGE_QUEUE, CombainStatsNowUs() - r.submitTimeUs);
+        }
+        t->scheduled.attempts++;
+        const std::string &combainUrl = GetUrlForApiKey(r.apiKey);
+        // The previous response buffer was handed to the main thread, so start a new one
+        t->responseBody.clear();
+        t->responseBody.reserve(INITIAL_RESPONSE_BUFFER_BYTES);
+
+        // Compression only pays off once a body is big enough for the gzip header and trailer to
+        // be outweighed by the repetition between APs
+        t->isCompressed = CompressRequests && r.body.size() >= CompressionMinBytes &&
+            Gzip->compress(r.body, &t->compressedBody) && t->compressedBody.size() < r.body.size();
+        const std::string &body = t->isCompressed ? t->compressedBody : r.body;
+        CombainStatsCountServerRequest(body.size(), r.body.size());
+
+        LE_ASSERT(curl_easy_setopt(t->curl, CURLOPT_URL, combainUrl.c_str()) == CURLE_OK);
+        LE_ASSERT(
+            curl_easy_setopt(
+                t->curl,
+                CURLOPT_HTTPHEADER,
+                t->isCompressed ? CompressedHttpHeaders : HttpHeaders) == CURLE_OK);
+        // The body outlives the transfer, so libcurl doesn't need to take its own copy
+        LE_ASSERT(curl_easy_setopt(t->curl, CURLOPT_POSTFIELDSIZE, (long)body.size()) == CURLE_OK);
+        LE_ASSERT(curl_easy_setopt(t->curl, CURLOPT_POSTFIELDS, body.c_str()) == CURLE_OK);
+
+        LE_ASSERT(curl_multi_add_handle(CurlMulti, t->curl) == CURLM_OK);
+        // Ownership is held by the multi handle until the transfer completes
+        ActiveTransfers.push_back(t.release());
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Takes a transfer off the multi handle, and back into ownership of the caller.
+ */
+//--------------------------------------------------------------------------------------------------
+static std::unique_ptr<Transfer> RemoveActiveTransfer(Transfer *t)
+{
+    LE_ASSERT(curl_multi_remove_handle(CurlMulti, t->curl) == CURLM_OK);
+    auto it = std::find(ActiveTransfers.begin(), ActiveTransfers.end(), t);
+    LE_ASSERT(it != ActiveTransfers.end());
+    *it = ActiveTransfers.back();
+    ActiveTransfers.pop_back();
+    if (t->isProbe)
+    {
+        Circuit.probeInFlight = false;
+    }
+    return std::unique_ptr<Transfer>(t);
+}
+
+static void RecycleTransfer(std::unique_ptr<Transfer> t)
+{
+    t->scheduled.request.body.clear();
+    IdleTransfers.push_back(std::move(t));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Removes a request from whichever queue it is in, or aborts its transfer if it has been started,
+ * without sending a response. Does nothing if the request has already completed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void CancelRequest(ma_combainLocation_LocReqHandleRef_t handle)
+{
+    auto isCancelled = [handle](const ScheduledRequest &s) { return s.request.handle == handle; };
+
+    auto scheduledIt = std::find_if(Scheduled.begin(), Scheduled.end(), isCancelled);
+    if (scheduledIt != Scheduled.end())
+    {
+        Scheduled.erase(scheduledIt);
+        std::make_heap(Scheduled.begin(), Scheduled.end(), SendsAfter);
+        Stats.cancelled++;
+        return;
+    }
+
+    auto backingOffIt = std::find_if(BackingOff.begin(), BackingOff.end(), isCancelled);
+    if (backingOffIt != BackingOff.end())
+    {
+        BackingOff.erase(backingOffIt);
+        Stats.cancelled++;
+        return;
+    }
+
+    auto activeIt = std::find_if(
+        ActiveTransfers.begin(),
+        ActiveTransfers.end(),
+        [handle](const Transfer *t) { return t->scheduled.request.handle == handle; });
+    if (activeIt != ActiveTransfers.end())
+    {
+        LE_DEBUG("Aborting an in-flight request which is no longer wanted");
+        RecycleTransfer(RemoveActiveTransfer(*activeIt));
+        Stats.cancelled++;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Decides when the next warm-up is due after a transfer to the server has completed. A connection
+ * is open after a success, so the next warm-up is only needed before it would idle out, and only if
+ * refreshing is enabled. After a failure the warm-up is tried again with backoff, so that a
+ * connection is made soon after the data connection comes up.
+ */
+//--------------------------------------------------------------------------------------------------
+static void RescheduleWarmup(uint64_t nowUs, bool connected)
+{
+    if (!Prewarm)
+    {
+        return;
+    }
+
+    if (connected)
+    {
+        WarmupRetryUs = WARMUP_MIN_RETRY_US;
+        NextWarmupUs = PrewarmRefreshUs != 0 ? nowUs + PrewarmRefreshUs : 0;
+    }
+    else
+    {
+        NextWarmupUs = nowUs + WarmupRetryUs;
+        WarmupRetryUs = std::min<uint64_t>(WarmupRetryUs * 2, WARMUP_MAX_RETRY_US);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts a warm-up if one is due and the thread is otherwise idle. Requests which are in flight or
+ * about to be sent make their own connection, and reschedule the warm-up when they complete.
+ */
+//--------------------------------------------------------------------------------------------------
+static void StartWarmup(uint64_t nowUs)
+{
+    if (NextWarmupUs == 0 || nowUs < NextWarmupUs || !ActiveTransfers.empty() ||
+        !Scheduled.empty() || Circuit.state != MA_COMBAINLOCATION_CIRCUIT_CLOSED)
+    {
+        return;
+    }
+
+    if (!WarmupTransfer)
+    {
+        WarmupTransfer = CreateTransfer();
+        WarmupTransfer->isWarmup = true;
+        // The server needs no API key to answer a HEAD request, and whatever status it answers
+        // with, the connection stays open for the next request
+        CURL *curl = WarmupTransfer->curl;
+        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_URL, ServerUrl.c_str()) == CURLE_OK);
+        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_NOBODY, 1L) == CURLE_OK);
+    }
+
+    LE_DEBUG("Warming up a connection to %s", ServerUrl.c_str());
+    NextWarmupUs = 0;
+    LE_ASSERT(curl_multi_add_handle(CurlMulti, WarmupTransfer->curl) == CURLM_OK);
+    ActiveTransfers.push_back(WarmupTransfer.release());
+}
+
+static void CompleteWarmup(std::unique_ptr<Transfer> t, CURLcode res, uint64_t nowUs)
+{
+    if (res == CURLE_OK)
+    {
+        long numConnects = 0;
+        curl_easy_getinfo(t->curl, CURLINFO_NUM_CONNECTS, &numConnects);
+        // Counted with the requests' connections, so that requests which reuse a warmed-up
+        // connection are set against the handshake that it took
+        Stats.connectionsOpened += numConnects;
+        LE_DEBUG("Connection warm-up complete (%ld new connections)", numConnects);
+    }
+    else
+    {
+        LE_DEBUG("Connection warm-up failed (%d): %s", res, curl_easy_strerror(res));
+    }
+    RescheduleWarmup(nowUs, res == CURLE_OK);
+    t->responseBody.clear();
+    WarmupTransfer = std::move(t);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Records how long each network stage of a completed transfer took. libcurl reports the time from
+ * the start of the transfer to the end of each stage, and stages which didn't happen, such as the
+ * handshake on a reused connection, end at the same time as the stage before them.
+ */
+//--------------------------------------------------------------------------------------------------
+static void RecordTransferTimes(CURL *curl)
+{
+    curl_off_t nameLookup = 0;
+    curl_off_t connect = 0;
+    curl_off_t appConnect = 0;
+    curl_off_t startTransfer = 0;
+    curl_off_t total = 0;
+    if (curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &nameLookup) != CURLE_OK ||
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect) != CURLE_OK ||
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appConnect) != CURLE_OK ||
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &startTransfer) != CURLE_OK ||
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total) != CURLE_OK)
+    {
+        return;
+    }
 
-        CURL* curl = curl_easy_init();
-        LE_ASSERT(curl);
+    // Each stage ends no earlier than the one before it
+    connect = std::max(connect, nameLookup);
+    appConnect = std::max(appConnect, connect);
+    startTransfer = std::max(startTransfer, appConnect);
+    total = std::max(total, startTransfer);
 
-        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_URL, combainUrl) == CURLE_OK);
+    CombainStatsRecordLatency(MA_COMBAINLOCATION_STAGE_DNS, nameLookup);
+    CombainStatsRecordLatency(MA_COMBAINLOCATION_STAGE_CONNECT, connect - nameLookup);
+    CombainStatsRecordLatency(MA_COMBAINLOCATION_STAGE_TLS, appConnect - connect);
+    CombainStatsRecordLatency(MA_COMBAINLOCATION_STAGE_FIRST_BYTE, startTransfer - appConnect);
+    CombainStatsRecordLatency(MA_COMBAINLOCATION_STAGE_TRANSFER, total - startTransfer);
+}
 
-        struct curl_slist *httpHeaders = NULL;
-        httpHeaders = curl_slist_append(httpHeaders, "Content-Type:application/json");
-        LE_ASSERT(httpHeaders != NULL);
-        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, httpHeaders) == CURLE_OK);
+//--------------------------------------------------------------------------------------------------
+/**
+ * Passes the results of all finished transfers to the main thread and recycles the transfers.
+ * Transfers which failed transiently are put back to be retried instead, unless they have run out
+ * of attempts or the failure opened the circuit.
+ *
+ * @return the number of transfers which completed
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t CompleteFinishedTransfers(void)
+{
+    size_t numCompleted = 0;
+    struct CURLMsg *msg;
+    int msgsInQueue;
+    while ((msg = curl_multi_info_read(CurlMulti, &msgsInQueue)) != NULL)
+    {
+        if (msg->msg != CURLMSG_DONE)
+        {
+            continue;
+        }
 
-        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, requestBody.c_str()) == CURLE_OK);
+        CURL *curl = msg->easy_handle;
+        const CURLcode res = msg->data.result;
+        Transfer *rawTransfer = NULL;
+        LE_ASSERT(curl_easy_getinfo(curl, CURLINFO_PRIVATE, &rawTransfer) == CURLE_OK);
+        std::unique_ptr<Transfer> t = RemoveActiveTransfer(rawTransfer);
+        numCompleted++;
 
-        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemCallback) == CURLE_OK);
-        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&HttpReceiveBuffer) == CURLE_OK);
+        const uint64_t nowUs = CombainStatsNowUs();
+        if (t->isWarmup)
+        {
+            CompleteWarmup(std::move(t), res, nowUs);
+            continue;
+        }
+        RescheduleWarmup(nowUs, res == CURLE_OK);
 
-        // Set the timeout for connection phase
-        LE_ASSERT(curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CURL_CONNECT_TIMEOUT_SECONDS) == CURLE_OK);
+        long httpStatus = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpStatus);
+        if (res == CURLE_OK && httpStatus == 415 && t->isCompressed)
+        {
+            // The server reached is fine, it just doesn't take compressed bodies. Send this
+            // request again uncompressed, without counting the attempt.
+            LE_WARN("Server rejected a compressed request. Sending requests uncompressed.");
+            CompressRequests = false;
+            RecordCircuitSuccess();
+            t->scheduled.attempts--;
+            Scheduled.push_back(std::move(t->scheduled));
+            std::push_heap(Scheduled.begin(), Scheduled.end(), SendsAfter);
+            RecycleTransfer(std::move(t));
+            continue;
+        }
+        const bool isTransientFailure = IsTransientFailure(res, httpStatus);
+        if (isTransientFailure)
+        {
+            RecordCircuitFailure(nowUs);
+        }
+        else if (res == CURLE_OK)
+        {
+            RecordCircuitSuccess();
+        }
 
-        const CURLcode res = curl_easy_perform(curl);
+        Stats.requests++;
         if (res != CURLE_OK)
         {
             LE_ERROR("libcurl returned error (%d): %s", res, curl_easy_strerror(res));
-            // TODO: better way to encode CURL errors?
-            ResponseJson->enqueue(std::make_tuple(handle, ""));
         }
         else
         {
-            std::string json((char*)HttpReceiveBuffer.data, HttpReceiveBuffer.used);
-            ResponseJson->enqueue(std::make_tuple(handle, json));
+            long numConnects = 0;
+            curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &numConnects);
+            if (numConnects == 0)
+            {
+                Stats.connectionsReused++;
+            }
+            else
+            {
+                Stats.connectionsOpened += numConnects;
+            }
+            long httpVersion = 0;
+            curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &httpVersion);
+            if (httpVersion == CURL_HTTP_VERSION_2_0)
+            {
+                Stats.http2Requests++;
+            }
+            LE_DEBUG(
+                "Request complete. %u of %u requests reused an open connection",
+                Stats.connectionsReused.load(),
+                Stats.requests.load());
+            RecordTransferTimes(curl);
+            curl_off_t wireBytes = 0;
+            curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wireBytes);
+            CombainStatsCountResponse(wireBytes, t->responseBody.size());
         }
-        le_event_Report(ResponseAvailableEvent, NULL, 0);
 
-        curl_easy_cleanup(curl);
+        if (isTransientFailure && t->scheduled.attempts < RetryMaxAttempts &&
+            Circuit.state != MA_COMBAINLOCATION_CIRCUIT_OPEN)
+        {
+            t->scheduled.retryAtUs = nowUs + GetRetryBackoffUs(t->scheduled.attempts);
+            LE_INFO(
+                "Retrying request in %" PRIu64 " ms (attempt %u of %u, HTTP status %ld)",
+                (t->scheduled.retryAtUs - nowUs) / 1000,
+                t->scheduled.attempts + 1,
+                RetryMaxAttempts,
+                httpStatus);
+            Stats.retries++;
+            BackingOff.push_back(std::move(t->scheduled));
+        }
+        else if (res != CURLE_OK)
+        {
+            // The libcurl error has been logged. Retries are exhausted, so all that is left to tell
+            // the client is that the server couldn't be reached.
+            SendResponse(
+                CombainHttpResponse{
+                    t->scheduled.request.handle,
+                    CombainHttpResponse::COMMUNICATION_FAILURE,
+                    std::string(),
+                    nowUs});
+        }
+        else
+        {
+            SendResponse(
+                CombainHttpResponse{
+                    t->scheduled.request.handle,
+                    CombainHttpResponse::OK,
+                    std::move(t->responseBody),
+                    nowUs});
+        }
+
+        RecycleTransfer(std::move(t));
+    }
+
+    return numCompleted;
+}
+
+void *CombainHttpThreadFunc(void *context)
+{
+    struct curl_waitfd wakeup;
+    wakeup.fd = WakeupFd;
+    wakeup.events = CURL_WAIT_POLLIN;
+    std::vector<ma_combainLocation_LocReqHandleRef_t> cancelled;
+
+    do {
+        FlushPendingResponses();
+        // Cancellations are taken before new requests. The main thread queues a request before it
+        // can cancel it, so every request cancelled here has already been scheduled.
+        ma_combainLocation_LocReqHandleRef_t handle;
+        while (CancelledRequests->tryPop(handle))
+        {
+            cancelled.push_back(handle);
+        }
+        ScheduleQueuedRequests();
+        for (auto h : cancelled)
+        {
+            CancelRequest(h);
+        }
+        cancelled.clear();
+        const uint64_t nowUs = CombainStatsNowUs();
+        ScheduleDueRetries(nowUs);
+        ExpireScheduledRequests(nowUs);
+        ApplyCircuitBreaker(nowUs);
+        if (PendingResponses.empty())
+        {
+            StartQueuedTransfers();
+        }
+        StartWarmup(nowUs);
+
+        int stillRunning;
+        const CURLMcode performRes = curl_multi_perform(CurlMulti, &stillRunning);
+        LE_ASSERT(performRes == CURLM_OK);
 
-        curl_slist_free_all(httpHeaders);
+        const size_t numCompleted = CompleteFinishedTransfers();
+        ReportResponses();
+        if (numCompleted > 0)
+        {
+            // Completions may have freed capacity for requests which are still queued
+            continue;
+        }
 
+        wakeup.revents = 0;
+        const CURLMcode waitRes =
+            curl_multi_wait(CurlMulti, &wakeup, 1, GetWaitTimeoutMs(CombainStatsNowUs()), NULL);
+        LE_ASSERT(waitRes == CURLM_OK);
+        if (wakeup.revents != 0)
+        {
+            uint64_t count;
+            if (read(WakeupFd, &count, sizeof(count)) != sizeof(count))
+            {
+                LE_DEBUG("Spurious HTTP thread wakeup");
+            }
+        }
     } while (true);
 }
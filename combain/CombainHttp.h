@@ -3,13 +3,61 @@
 
 #include "legato.h"
 #include "interfaces.h"
-#include "ThreadSafeQueue.h"
+#include <string>
+#include "SpscChannel.h"
+#include "CombainConfig.h"
+
+// Times are from CombainStatsNowUs()
+struct CombainHttpRequest
+{
+    ma_combainLocation_LocReqHandleRef_t handle;
+    std::string apiKey;
+    std::string body;
+    uint64_t submitTimeUs;
+    ma_combainLocation_Priority_t priority;
+    uint64_t deadlineUs;  ///< Dropped if it hasn't been sent by this time. 0 for none.
+};
+
+struct CombainHttpResponse
+{
+    enum Status
+    {
+        OK,
+        COMMUNICATION_FAILURE,  ///< The server couldn't be reached
+        DEADLINE_EXPIRED,       ///< The deadline passed before the request was sent
+    };
+
+    ma_combainLocation_LocReqHandleRef_t handle;
+    Status status;
+    std::string body;  ///< Only set if status is OK
+    uint64_t completeTimeUs;
+};
+
+struct CombainHttpStats
+{
+    uint32_t requests;
+    uint32_t connectionsOpened;  ///< New TCP connections and TLS handshakes, warm-ups included
+    uint32_t connectionsReused;  ///< Transfers which were sent over an already warm connection
+    uint32_t http2Requests;      ///< Transfers which were sent as an HTTP/2 stream
+    uint32_t responseEvents;     ///< Times responseAvailableEvent was reported
+    ma_combainLocation_CircuitState_t circuitState;
+    uint32_t consecutiveFailures; ///< Failed transfers since the last successful one
+    uint32_t circuitTrips;       ///< Times the circuit has opened
+    uint32_t retries;            ///< Transfers started again after a transient failure
+    uint32_t fastFailures;       ///< Requests failed without being sent while the circuit was open
+    uint32_t cancelled;          ///< Requests dropped because they were destroyed
+};
 
 void CombainHttpInit(
-    ThreadSafeQueue<std::tuple<ma_combainLocation_LocReqHandleRef_t, std::string, std::string>> *requestJson,
-    ThreadSafeQueue<std::tuple<ma_combainLocation_LocReqHandleRef_t, std::string>> *responseJson,
-    le_event_Id_t responseAvailableEvent);
+    SpscChannel<CombainHttpRequest> *requestJson,
+    SpscChannel<CombainHttpResponse> *responseJson,
+    SpscChannel<ma_combainLocation_LocReqHandleRef_t> *cancelledRequests,
+    le_event_Id_t responseAvailableEvent,
+    const CombainConfig &config);
 void CombainHttpDeinit(void);
+void CombainHttpWakeup(void);
+void CombainHttpAckResponseEvent(void);
 void *CombainHttpThreadFunc(void *context);
+CombainHttpStats CombainHttpGetStats(void);
 
 #endif // COMBAIN_HTTP_H
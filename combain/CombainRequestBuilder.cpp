@@ -1,11 +1,49 @@
 #include "CombainRequestBuilder.h"
-#include <jansson.h>
-#include <sstream>
-#include <iomanip>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
+#include <cstring>
 
-static std::string macAddrToString(const uint8_t *mac);
-static std::string ssidToString(const uint8_t *ssid, size_t ssidLen);
-static std::string cellularTechnologyToString(ma_combainLocation_CellularTech_t cellTech);
+// Width of the signal strength buckets used in scan fingerprints. Readings from a stationary device
+// typically wander by a few dB between scans, so small changes shouldn't produce a new fingerprint.
+#define FINGERPRINT_SIGNAL_BUCKET_DB 10
+// Readings are clamped to this before bucketing. Nothing weaker can be received, and clamping keeps
+// the bucket within the byte that it has in the key, so that unrelated readings can't collide.
+#define FINGERPRINT_MIN_SIGNAL_DBM (-127)
+
+// "nn:nn:nn:nn:nn:nn" without a terminator
+#define MAC_ADDR_STRING_BYTES ((6 * 2) + (6 - 1))
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stands in for the std::string that the request body is written to, and counts the bytes instead
+ * of storing them. The body is measured by writing it to one of these, so the measurement can't
+ * disagree with what is written.
+ */
+//--------------------------------------------------------------------------------------------------
+struct JsonLengthCounter
+{
+    JsonLengthCounter &operator+=(char) { this->length++; return *this; }
+    JsonLengthCounter &operator+=(const char *s) { this->length += strlen(s); return *this; }
+    void append(const char *, size_t n) { this->length += n; }
+
+    size_t length = 0;
+};
+
+template <typename Out>
+static void appendRequestBody(
+    Out &out,
+    const std::vector<WifiApScanItem> &wifiAps,
+    const std::vector<CellTowerScanItem> &cellTowers);
+template <typename Out>
+static void appendWifiAp(Out &out, const WifiApScanItem &ap);
+template <typename Out>
+static void appendMacAddr(Out &out, const uint8_t *mac);
+template <typename Out>
+static void appendInteger(Out &out, int64_t value);
+template <typename Out>
+static void appendJsonString(Out &out, const uint8_t *ssid, size_t ssidLen);
+static const char *cellularTechnologyToString(ma_combainLocation_CellularTech_t cellTech);
 
 WifiApScanItem::WifiApScanItem(
     const uint8_t *bssid,
@@ -34,6 +72,18 @@ WifiApScanItem::WifiApScanItem(
     this->signalStrength = signalStrength;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Empties the builder so that it can be reused for another request. The storage for the APs and
+ * towers is kept, so a reused builder doesn't allocate unless a scan is larger than any before it.
+ */
+//--------------------------------------------------------------------------------------------------
+void CombainRequestBuilder::clear(void)
+{
+    this->wifiAps.clear();
+    this->cellTowers.clear();
+}
+
 void CombainRequestBuilder::appendWifiAccessPoint(const WifiApScanItem& ap)
 {
     this->wifiAps.push_back(ap);
@@ -44,69 +94,372 @@ void CombainRequestBuilder::appendCellTower(const CellTowerScanItem& tower)
     this->cellTowers.push_back(tower);
 }
 
+void CombainRequestBuilder::appendWifiAccessPoints(const std::vector<WifiApScanItem>& aps)
+{
+    this->wifiAps.insert(this->wifiAps.end(), aps.begin(), aps.end());
+}
+
+void CombainRequestBuilder::appendCellTowers(const std::vector<CellTowerScanItem>& towers)
+{
+    this->cellTowers.insert(this->cellTowers.end(), towers.begin(), towers.end());
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Removes the APs which the policy says not to send. The APs which are kept are ordered strongest
+ * first, with ties broken by BSSID, so scans of the same APs produce the same request body
+ * whatever order they were reported in.
+ */
+//--------------------------------------------------------------------------------------------------
+CombainApSelectionStats CombainRequestBuilder::selectWifiAccessPoints(
+    const CombainApSelectionPolicy &policy)
+{
+    std::vector<WifiApScanItem> &aps = this->wifiAps;
+    std::sort(
+        aps.begin(),
+        aps.end(),
+        [](const WifiApScanItem &a, const WifiApScanItem &b) {
+            if (a.signalStrength != b.signalStrength)
+            {
+                return a.signalStrength > b.signalStrength;
+            }
+            return std::lexicographical_compare(
+                &a.bssid[0], &a.bssid[6], &b.bssid[0], &b.bssid[6]);
+        });
+
+    CombainApSelectionStats stats = {0, 0};
+    size_t numKept = 0;
+    for (size_t i = 0; i < aps.size(); i++)
+    {
+        const WifiApScanItem &ap = aps[i];
+        bool keep = true;
+        if (policy.dropRandomizedMacs && (ap.bssid[0] & 0x02) != 0)
+        {
+            keep = false;
+        }
+        else if (policy.minSignalStrength != 0 && ap.signalStrength < policy.minSignalStrength)
+        {
+            keep = false;
+        }
+        else if (policy.dedupe)
+        {
+            // The kept APs are stronger, so a duplicate of one of them is a weaker reading
+            for (size_t j = 0; j < numKept && keep; j++)
+            {
+                keep = !std::equal(&ap.bssid[0], &ap.bssid[6], &aps[j].bssid[0]);
+            }
+        }
+        if (keep && policy.maxAps != 0 && numKept >= policy.maxAps)
+        {
+            keep = false;
+        }
+
+        if (keep)
+        {
+            aps[numKept++] = ap;
+            continue;
+        }
+        JsonLengthCounter removedApJson;
+        appendWifiAp(removedApJson, ap);
+        stats.apsRemoved++;
+        // Every AP but the first is preceded by a comma
+        stats.bytesRemoved += removedApJson.length + 1;
+    }
+    aps.erase(aps.begin() + numKept, aps.end());
+
+    return stats;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Serializes the request into one buffer with a single allocation. The body is measured in a first
+ * pass which writes nothing, so the buffer is exactly the size of the body and no larger; it is
+ * kept for as long as the request is queued or retried. The output is the same compact JSON that
+ * jansson's json_dumps(JSON_COMPACT) produced.
+ */
+//--------------------------------------------------------------------------------------------------
 std::string CombainRequestBuilder::generateRequestBody(void) const
 {
-    json_t *body = json_object();
-    if (!this->wifiAps.empty())
+    JsonLengthCounter counter;
+    appendRequestBody(counter, this->wifiAps, this->cellTowers);
+
+    std::string body;
+    body.reserve(counter.length);
+    appendRequestBody(body, this->wifiAps, this->cellTowers);
+
+    return body;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Generates a key which is identical for scans that would resolve to the same location. The APs are
+ * sorted by BSSID and their signal strengths are bucketed, so the order that they were reported in
+ * and small signal fluctuations don't matter.
+ */
+//--------------------------------------------------------------------------------------------------
+void CombainRequestBuilder::generateFingerprint(std::string *fingerprint)
+{
+    // Each AP is keyed by its BSSID followed by its signal bucket, so the keys sort by BSSID
+    std::vector<uint64_t> &keys = this->fingerprintKeys;
+    keys.clear();
+    for (auto const& ap : this->wifiAps)
     {
-        json_t *wifiApsArray = json_array();
-        for (auto const& ap : this->wifiAps)
+        uint64_t key = 0;
+        for (auto b : ap.bssid)
         {
-            json_t *jsonAp = json_object();
-            json_object_set_new(jsonAp, "macAddress", json_string(macAddrToString(ap.bssid).c_str()));
-            json_object_set_new(jsonAp, "ssid", json_string(ssidToString(ap.ssid, ap.ssidLen).c_str()));
-            json_object_set_new(jsonAp, "signalStrength", json_integer(ap.signalStrength));
-            json_array_append_new(wifiApsArray, jsonAp);
+            key = (key << 8) | b;
         }
-        json_object_set_new(body, "wifiAccessPoints", wifiApsArray);
+        const int16_t signalStrength =
+            std::max<int16_t>(ap.signalStrength, FINGERPRINT_MIN_SIGNAL_DBM);
+        const int8_t bucket = signalStrength / FINGERPRINT_SIGNAL_BUCKET_DB;
+        keys.push_back((key << 8) | static_cast<uint8_t>(bucket));
     }
+    std::sort(keys.begin(), keys.end());
 
-    if (!this->cellTowers.empty())
+    fingerprint->clear();
+    for (auto key : keys)
     {
-        json_t *cellTowersArray = json_array();
-        for (auto const& tower: this->cellTowers)
+        for (int shift = 48; shift >= 0; shift -= 8)
         {
-            json_t *jsonTower = json_object();
-            json_object_set_new(jsonTower, "radioType", json_string(cellularTechnologyToString(tower.cellularTechnology).c_str()));
-            json_object_set_new(jsonTower, "mobileCountryCode", json_integer(tower.mcc));
-            json_object_set_new(jsonTower, "mobileNetworkCode", json_integer(tower.mnc));
-            json_object_set_new(jsonTower, "locationAccessCode", json_integer(tower.lac));
-            json_object_set_new(jsonTower, "cellId", json_integer(tower.cellId));
+            fingerprint->push_back(static_cast<char>(key >> shift));
         }
-        json_object_set_new(body, "cellTowers", cellTowersArray);
     }
 
-    char* s = json_dumps(body, JSON_COMPACT);
-    LE_ASSERT(s != NULL);
-    std::string res(s);
-    free(s);
-    json_decref(body);
-    return res;
+    for (auto const& tower : this->cellTowers)
+    {
+        fingerprint->push_back('|');
+        appendInteger(*fingerprint, tower.cellularTechnology);
+        fingerprint->push_back(',');
+        appendInteger(*fingerprint, tower.mcc);
+        fingerprint->push_back(',');
+        appendInteger(*fingerprint, tower.mnc);
+        fingerprint->push_back(',');
+        appendInteger(*fingerprint, tower.lac);
+        fingerprint->push_back(',');
+        appendInteger(*fingerprint, tower.cellId);
+        // Bucketed as for the APs. The key is text here, so it needs no clamping.
+        fingerprint->push_back(',');
+        appendInteger(*fingerprint, tower.signalStrength / FINGERPRINT_SIGNAL_BUCKET_DB);
+    }
+}
+
+const std::vector<WifiApScanItem>& CombainRequestBuilder::getWifiAccessPoints(void) const
+{
+    return this->wifiAps;
 }
 
 
 //----------------- STATIC
-static std::string macAddrToString(const uint8_t *mac)
+template <typename Out>
+static void appendRequestBody(
+    Out &out,
+    const std::vector<WifiApScanItem> &wifiAps,
+    const std::vector<CellTowerScanItem> &cellTowers)
+{
+    out += '{';
+    if (!wifiAps.empty())
+    {
+        out += "\"wifiAccessPoints\":[";
+        bool first = true;
+        for (auto const& ap : wifiAps)
+        {
+            if (!first)
+            {
+                out += ',';
+            }
+            first = false;
+            appendWifiAp(out, ap);
+        }
+        out += ']';
+    }
+
+    if (!cellTowers.empty())
+    {
+        if (!wifiAps.empty())
+        {
+            out += ',';
+        }
+        out += "\"cellTowers\":[";
+        bool first = true;
+        for (auto const& tower: cellTowers)
+        {
+            if (!first)
+            {
+                out += ',';
+            }
+            first = false;
+            out += "{\"radioType\":\"";
+            out += cellularTechnologyToString(tower.cellularTechnology);
+            out += "\",\"mobileCountryCode\":";
+            appendInteger(out, tower.mcc);
+            out += ",\"mobileNetworkCode\":";
+            appendInteger(out, tower.mnc);
+            out += ",\"locationAreaCode\":";
+            appendInteger(out, tower.lac);
+            out += ",\"cellId\":";
+            appendInteger(out, tower.cellId);
+            out += ",\"signalStrength\":";
+            appendInteger(out, tower.signalStrength);
+            out += '}';
+        }
+        out += ']';
+    }
+    out += '}';
+}
+
+template <typename Out>
+static void appendWifiAp(Out &out, const WifiApScanItem &ap)
 {
-    std::ostringstream s;
+    out += "{\"macAddress\":\"";
+    appendMacAddr(out, ap.bssid);
+    out += "\",\"ssid\":";
+    appendJsonString(out, ap.ssid, ap.ssidLen);
+    out += ",\"signalStrength\":";
+    appendInteger(out, ap.signalStrength);
+    out += '}';
+}
+
+template <typename Out>
+static void appendMacAddr(Out &out, const uint8_t *mac)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    char s[MAC_ADDR_STRING_BYTES];
     for (auto i = 0; i < 6; i++)
     {
-        s << std::setw(2) << std::setfill('0') << std::hex << static_cast<unsigned int>(mac[i]);
+        s[i * 3] = hexDigits[mac[i] >> 4];
+        s[i * 3 + 1] = hexDigits[mac[i] & 0x0F];
         if (i != 5)
         {
-            s << ':';
+            s[i * 3 + 2] = ':';
+        }
+    }
+    out.append(s, sizeof(s));
+}
+
+template <typename Out>
+static void appendInteger(Out &out, int64_t value)
+{
+    char s[20];
+    size_t i = sizeof(s);
+    uint64_t magnitude = (value < 0) ? -static_cast<uint64_t>(value) : value;
+    do
+    {
+        s[--i] = '0' + (magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0)
+    {
+        s[--i] = '-';
+    }
+    out.append(&s[i], sizeof(s) - i);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the length of the valid UTF-8 sequence at the start of s.
+ *
+ * @return the length of the sequence in bytes, or 0 if it is not valid UTF-8
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t utf8SequenceLength(const uint8_t *s, size_t len)
+{
+    const uint8_t b = s[0];
+    size_t n;
+    uint8_t min = 0x80;
+    uint8_t max = 0xBF;
+    if (b < 0x80)
+    {
+        return 1;
+    }
+    else if (b >= 0xC2 && b <= 0xDF)
+    {
+        n = 2;
+    }
+    else if (b >= 0xE0 && b <= 0xEF)
+    {
+        n = 3;
+        // Reject overlong encodings and UTF-16 surrogates
+        min = (b == 0xE0) ? 0xA0 : 0x80;
+        max = (b == 0xED) ? 0x9F : 0xBF;
+    }
+    else if (b >= 0xF0 && b <= 0xF4)
+    {
+        n = 4;
+        // Reject overlong encodings and code points above U+10FFFF
+        min = (b == 0xF0) ? 0x90 : 0x80;
+        max = (b == 0xF4) ? 0x8F : 0xBF;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (len < n || s[1] < min || s[1] > max)
+    {
+        return 0;
+    }
+    for (size_t i = 2; i < n; i++)
+    {
+        if (s[i] < 0x80 || s[i] > 0xBF)
+        {
+            return 0;
         }
     }
-    return s.str();
+    return n;
 }
 
-static std::string ssidToString(const uint8_t *ssid, size_t ssidLen)
+//--------------------------------------------------------------------------------------------------
+/**
+ * Appends a quoted JSON string. The escaping matches jansson. An SSID is arbitrary bytes rather
+ * than necessarily UTF-8, so bytes which aren't part of a valid UTF-8 sequence are written as the
+ * Latin-1 character with the same value.
+ */
+//--------------------------------------------------------------------------------------------------
+template <typename Out>
+static void appendJsonString(Out &out, const uint8_t *s, size_t len)
 {
-    std::string s(reinterpret_cast<const char *>(ssid), ssidLen);
-    return s;
+    static const char hexDigits[] = "0123456789abcdef";
+    out += '"';
+    size_t i = 0;
+    while (i < len)
+    {
+        const uint8_t c = s[i];
+        const size_t n = utf8SequenceLength(&s[i], len - i);
+        if (n > 1)
+        {
+            out.append(reinterpret_cast<const char *>(&s[i]), n);
+            i += n;
+            continue;
+        }
+
+        switch (c)
+        {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20 || n == 0)
+            {
+                const char escape[] = {
+                    '\\', 'u', '0', '0', hexDigits[c >> 4], hexDigits[c & 0x0F]};
+                out.append(escape, sizeof(escape));
+            }
+            else
+            {
+                out += static_cast<char>(c);
+            }
+            break;
+        }
+        i++;
+    }
+    out += '"';
 }
 
-static std::string cellularTechnologyToString(ma_combainLocation_CellularTech_t cellTech)
+static const char *cellularTechnologyToString(ma_combainLocation_CellularTech_t cellTech)
 {
     switch (cellTech)
     {
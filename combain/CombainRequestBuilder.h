@@ -4,7 +4,7 @@
 #include "legato.h"
 #include "interfaces.h"
 #include <string>
-#include <list>
+#include <vector>
 
 struct WifiApScanItem
 {
@@ -30,18 +30,42 @@ struct CellTowerScanItem
     int32_t signalStrength;
 };
 
+// Which of the scanned APs are sent to the server. APs which don't help to locate the device only
+// make the request bigger.
+struct CombainApSelectionPolicy
+{
+    bool dedupe;                ///< Keep only the strongest reading of each BSSID
+    bool dropRandomizedMacs;    ///< Drop locally administered BSSIDs, e.g. phone hotspots
+    int16_t minSignalStrength;  ///< Drop APs weaker than this many dBm. 0 keeps them all.
+    uint32_t maxAps;            ///< Keep only this many of the strongest APs. 0 keeps them all.
+};
+
+struct CombainApSelectionStats
+{
+    uint32_t apsRemoved;
+    uint32_t bytesRemoved;      ///< Request body bytes that the removed APs would have taken up
+};
+
 
 class CombainRequestBuilder
 {
 public:
+    void clear(void);
     void appendWifiAccessPoint(const WifiApScanItem& ap);
     void appendCellTower(const CellTowerScanItem& tower);
+    void appendWifiAccessPoints(const std::vector<WifiApScanItem>& aps);
+    void appendCellTowers(const std::vector<CellTowerScanItem>& towers);
+    CombainApSelectionStats selectWifiAccessPoints(const CombainApSelectionPolicy &policy);
     std::string generateRequestBody(void) const;
+    void generateFingerprint(std::string *fingerprint);
+    const std::vector<WifiApScanItem>& getWifiAccessPoints(void) const;
 
 private:
 
-    std::list<WifiApScanItem> wifiAps;
-    std::list<CellTowerScanItem> cellTowers;
+    std::vector<WifiApScanItem> wifiAps;
+    std::vector<CellTowerScanItem> cellTowers;
+    // Scratch space for generateFingerprint(), kept to avoid reallocating
+    std::vector<uint64_t> fingerprintKeys;
 };
 
 #endif // COMBAIN_REQUEST_BUILDER_H
@@ -0,0 +1,631 @@
+#include "CombainResponseParser.h"
+
+#include <cstdlib>
+#include <string>
+
+// Responses are shallow, so anything nested deeper than this is rejected rather than risking the
+// stack on a hostile or corrupt body.
+#define MAX_NESTING_DEPTH 32
+
+// Numbers up to this long are converted without allocating. JSON allows longer ones, which are
+// skipped without conversion where the field isn't needed, and converted through a heap copy where
+// it is.
+#define MAX_NUMBER_CHARS 63
+
+namespace
+{
+
+// A string value or key in the response body. Nothing is copied or unescaped until a field is
+// known to be needed.
+struct StringRef
+{
+    const char *begin;
+    size_t len;
+    bool hasEscapes;
+};
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Validates and walks a JSON document in a single pass directly over the received bytes, without
+ * building a tree or allocating.
+ */
+//--------------------------------------------------------------------------------------------------
+class JsonScanner
+{
+public:
+    JsonScanner(const char *s, size_t len)
+        : p(s), end(s + len), depth(0)
+    {}
+
+    bool atEnd(void)
+    {
+        this->skipWhitespace();
+        return this->p == this->end;
+    }
+
+    bool consume(char c)
+    {
+        this->skipWhitespace();
+        if (this->p < this->end && *this->p == c)
+        {
+            this->p++;
+            return true;
+        }
+        return false;
+    }
+
+    bool peek(char c)
+    {
+        this->skipWhitespace();
+        return this->p < this->end && *this->p == c;
+    }
+
+    // Walks an object, calling onMember(key) for each member. onMember must consume the value.
+    template <class F> bool parseObject(F onMember)
+    {
+        if (!this->consume('{') || ++this->depth > MAX_NESTING_DEPTH)
+        {
+            return false;
+        }
+        if (!this->consume('}'))
+        {
+            do
+            {
+                StringRef key;
+                if (!this->parseString(&key) || !this->consume(':') || !onMember(key))
+                {
+                    return false;
+                }
+            } while (this->consume(','));
+
+            if (!this->consume('}'))
+            {
+                return false;
+            }
+        }
+        this->depth--;
+        return true;
+    }
+
+    // Walks an array, calling onElement(index) for each element. onElement must consume the value.
+    template <class F> bool parseArray(F onElement)
+    {
+        if (!this->consume('[') || ++this->depth > MAX_NESTING_DEPTH)
+        {
+            return false;
+        }
+        if (!this->consume(']'))
+        {
+            size_t i = 0;
+            do
+            {
+                if (!onElement(i++))
+                {
+                    return false;
+                }
+            } while (this->consume(','));
+
+            if (!this->consume(']'))
+            {
+                return false;
+            }
+        }
+        this->depth--;
+        return true;
+    }
+
+    bool parseString(StringRef *out)
+    {
+        if (!this->consume('"'))
+        {
+            return false;
+        }
+        out->begin = this->p;
+        out->hasEscapes = false;
+        while (this->p < this->end)
+        {
+            const unsigned char c = *this->p;
+            if (c == '"')
+            {
+                out->len = this->p - out->begin;
+                this->p++;
+                return true;
+            }
+            else if (c < 0x20)
+            {
+                return false;
+            }
+            else if (c == '\\')
+            {
+                out->hasEscapes = true;
+                this->p++;
+                if (this->p >= this->end)
+                {
+                    return false;
+                }
+                switch (*this->p)
+                {
+                case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+                    break;
+
+                case 'u':
+                    for (int i = 0; i < 4; i++)
+                    {
+                        this->p++;
+                        if (this->p >= this->end || HexValue(*this->p) < 0)
+                        {
+                            return false;
+                        }
+                    }
+                    break;
+
+                default:
+                    return false;
+                }
+            }
+            this->p++;
+        }
+        return false;
+    }
+
+    bool parseNumber(double *out, bool *isInteger)
+    {
+        this->skipWhitespace();
+        const char *start = this->p;
+        if (!this->scanNumber(isInteger))
+        {
+            return false;
+        }
+
+        const size_t len = this->p - start;
+        if (len > MAX_NUMBER_CHARS)
+        {
+            *out = strtod(std::string(start, len).c_str(), NULL);
+            return true;
+        }
+        // The body isn't necessarily terminated after the number, so convert from a copy
+        char s[MAX_NUMBER_CHARS + 1];
+        memcpy(s, start, len);
+        s[len] = '\0';
+        *out = strtod(s, NULL);
+        return true;
+    }
+
+    // Validates and skips over any value
+    bool skipValue(void)
+    {
+        this->skipWhitespace();
+        if (this->p >= this->end)
+        {
+            return false;
+        }
+
+        switch (*this->p)
+        {
+        case '{':
+            return this->parseObject([this] (const StringRef&) { return this->skipValue(); });
+
+        case '[':
+            return this->parseArray([this] (size_t) { return this->skipValue(); });
+
+        case '"':
+        {
+            StringRef s;
+            return this->parseString(&s);
+        }
+
+        case 't':
+            return this->acceptLiteral("true");
+
+        case 'f':
+            return this->acceptLiteral("false");
+
+        case 'n':
+            return this->acceptLiteral("null");
+
+        default:
+        {
+            // Numbers which aren't needed are validated but not converted, whatever their length
+            bool isInteger;
+            return this->scanNumber(&isInteger);
+        }
+        }
+    }
+
+    static int HexValue(char c)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f')
+        {
+            return 10 + c - 'a';
+        }
+        if (c >= 'A' && c <= 'F')
+        {
+            return 10 + c - 'A';
+        }
+        return -1;
+    }
+
+private:
+    // Moves past a number, checking that it has JSON's syntax
+    bool scanNumber(bool *isInteger)
+    {
+        *isInteger = true;
+
+        this->accept('-');
+        if (this->accept('0'))
+        {
+            // No leading zeros
+        }
+        else if (!this->acceptDigits())
+        {
+            return false;
+        }
+        if (this->accept('.'))
+        {
+            *isInteger = false;
+            if (!this->acceptDigits())
+            {
+                return false;
+            }
+        }
+        if (this->accept('e') || this->accept('E'))
+        {
+            *isInteger = false;
+            if (!this->accept('+'))
+            {
+                this->accept('-');
+            }
+            if (!this->acceptDigits())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void skipWhitespace(void)
+    {
+        while (this->p < this->end &&
+               (*this->p == ' ' || *this->p == '\t' || *this->p == '\n' || *this->p == '\r'))
+        {
+            this->p++;
+        }
+    }
+
+    bool accept(char c)
+    {
+        if (this->p < this->end && *this->p == c)
+        {
+            this->p++;
+            return true;
+        }
+        return false;
+    }
+
+    bool acceptDigits(void)
+    {
+        const char *start = this->p;
+        while (this->p < this->end && *this->p >= '0' && *this->p <= '9')
+        {
+            this->p++;
+        }
+        return this->p != start;
+    }
+
+    bool acceptLiteral(const char *literal)
+    {
+        const size_t len = strlen(literal);
+        if ((size_t)(this->end - this->p) < len || memcmp(this->p, literal, len) != 0)
+        {
+            return false;
+        }
+        this->p += len;
+        return true;
+    }
+
+    const char *p;
+    const char *end;
+    int depth;
+};
+
+struct ParsedString
+{
+    bool present;
+    StringRef value;
+};
+
+struct ParsedNumber
+{
+    bool present;
+    bool isInteger;
+    double value;
+};
+
+} // anonymous namespace
+
+static uint32_t ReadHex4(const char *s);
+static size_t EncodeUtf8(char *out, uint32_t codePoint);
+static void Unescape(const StringRef &s, char *out, size_t outSize);
+static bool KeyEquals(const StringRef &key, const char *name);
+static bool ParseStringMember(JsonScanner &scanner, ParsedString *out);
+static bool ParseNumberMember(JsonScanner &scanner, ParsedNumber *out);
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Parses a response from the Combain server in a single pass over the received body. Only the
+ * fields of a success or error response are extracted; everything else is validated and skipped.
+ *
+ * The result is set to a success or error response, or to a parse failure if the body isn't valid
+ * JSON or doesn't have the fields of either response. String fields are unescaped straight into
+ * the result, so nothing is allocated.
+ */
+//--------------------------------------------------------------------------------------------------
+void CombainParseResponse(const std::string &body, CombainResult *result)
+{
+    JsonScanner scanner(body.data(), body.size());
+
+    ParsedNumber lat = {};
+    ParsedNumber lng = {};
+    ParsedNumber accuracy = {};
+    ParsedNumber code = {};
+    ParsedString message = {};
+    ParsedString domain = {};
+    ParsedString reason = {};
+    ParsedString errorMessage = {};
+
+    // Fields of one entry of error.errors
+    auto parseErrorDetail = [&] (void) {
+        return scanner.parseObject([&] (const StringRef& key) {
+            if (KeyEquals(key, "domain"))
+            {
+                return ParseStringMember(scanner, &domain);
+            }
+            if (KeyEquals(key, "reason"))
+            {
+                return ParseStringMember(scanner, &reason);
+            }
+            if (KeyEquals(key, "message"))
+            {
+                return ParseStringMember(scanner, &errorMessage);
+            }
+            return scanner.skipValue();
+        });
+    };
+
+    const bool valid = scanner.parseObject([&] (const StringRef& key) {
+        if (KeyEquals(key, "location"))
+        {
+            if (!scanner.peek('{'))
+            {
+                return scanner.skipValue();
+            }
+            return scanner.parseObject([&] (const StringRef& locationKey) {
+                if (KeyEquals(locationKey, "lat"))
+                {
+                    return ParseNumberMember(scanner, &lat);
+                }
+                if (KeyEquals(locationKey, "lng"))
+                {
+                    return ParseNumberMember(scanner, &lng);
+                }
+                return scanner.skipValue();
+            });
+        }
+        if (KeyEquals(key, "accuracy"))
+        {
+            return ParseNumberMember(scanner, &accuracy);
+        }
+        if (KeyEquals(key, "error"))
+        {
+            if (!scanner.peek('{'))
+            {
+                return scanner.skipValue();
+            }
+            return scanner.parseObject([&] (const StringRef& errorKey) {
+                if (KeyEquals(errorKey, "code"))
+                {
+                    return ParseNumberMember(scanner, &code);
+                }
+                if (KeyEquals(errorKey, "message"))
+                {
+                    return ParseStringMember(scanner, &message);
+                }
+                if (KeyEquals(errorKey, "errors"))
+                {
+                    // The details are normally a list, but older responses used a single object.
+                    // Only the first entry is kept.
+                    if (scanner.peek('{'))
+                    {
+                        return parseErrorDetail();
+                    }
+                    if (scanner.peek('['))
+                    {
+                        return scanner.parseArray([&] (size_t i) {
+                            return (i == 0 && scanner.peek('{')) ?
+                                parseErrorDetail() : scanner.skipValue();
+                        });
+                    }
+                }
+                return scanner.skipValue();
+            });
+        }
+        return scanner.skipValue();
+    }) && scanner.atEnd();
+
+    if (valid && lat.present && lng.present && accuracy.present)
+    {
+        result->setSuccess(lat.value, lng.value, accuracy.value);
+        return;
+    }
+
+    // A code which doesn't fit in the result can't be a real HTTP status, so the body is reported
+    // as unparseable rather than converting it
+    if (valid && code.present && code.isInteger && code.value >= 0 && code.value <= UINT16_MAX &&
+        message.present && domain.present && reason.present && errorMessage.present)
+    {
+        CombainErrorResponse &error = result->setError(code.value);
+        Unescape(message.value, error.message, sizeof(error.message));
+        CombainError &first = error.firstError;
+        Unescape(domain.value, first.domain, sizeof(first.domain));
+        Unescape(reason.value, first.reason, sizeof(first.reason));
+        Unescape(errorMessage.value, first.message, sizeof(first.message));
+        return;
+    }
+
+    result->setParseFailure(body.c_str());
+}
+
+
+//----------------- STATIC
+static bool ParseStringMember(JsonScanner &scanner, ParsedString *out)
+{
+    if (!scanner.peek('"'))
+    {
+        // Wrong type. Treat the field as absent, as json_unpack() would.
+        out->present = false;
+        return scanner.skipValue();
+    }
+    out->present = scanner.parseString(&out->value);
+    return out->present;
+}
+
+static bool ParseNumberMember(JsonScanner &scanner, ParsedNumber *out)
+{
+    if (scanner.peek('"') || scanner.peek('{') || scanner.peek('[') || scanner.peek('t') ||
+        scanner.peek('f') || scanner.peek('n'))
+    {
+        out->present = false;
+        return scanner.skipValue();
+    }
+    out->present = scanner.parseNumber(&out->value, &out->isInteger);
+    return out->present;
+}
+
+static bool KeyEquals(const StringRef &key, const char *name)
+{
+    if (!key.hasEscapes)
+    {
+        return strlen(name) == key.len && memcmp(key.begin, name, key.len) == 0;
+    }
+    // None of the keys that are looked for are anywhere near this long
+    char unescaped[64];
+    Unescape(key, unescaped, sizeof(unescaped));
+    return strcmp(unescaped, name) == 0;
+}
+
+static uint32_t ReadHex4(const char *s)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        v = (v << 4) | JsonScanner::HexValue(s[i]);
+    }
+    return v;
+}
+
+static size_t EncodeUtf8(char *out, uint32_t codePoint)
+{
+    if (codePoint < 0x80)
+    {
+        out[0] = static_cast<char>(codePoint);
+        return 1;
+    }
+    if (codePoint < 0x800)
+    {
+        out[0] = static_cast<char>(0xC0 | (codePoint >> 6));
+        out[1] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        return 2;
+    }
+    if (codePoint < 0x10000)
+    {
+        out[0] = static_cast<char>(0xE0 | (codePoint >> 12));
+        out[1] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+        out[2] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        return 3;
+    }
+    out[0] = static_cast<char>(0xF0 | (codePoint >> 18));
+    out[1] = static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+    out[2] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+    out[3] = static_cast<char>(0x80 | (codePoint & 0x3F));
+    return 4;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Copies a string out of the body into a null terminated buffer, decoding its escapes. The string
+ * has already been validated by JsonScanner::parseString(). A string that doesn't fit is truncated
+ * at a character boundary.
+ */
+//--------------------------------------------------------------------------------------------------
+static void Unescape(const StringRef &s, char *out, size_t outSize)
+{
+    LE_ASSERT(outSize > 0);
+    const char *p = s.begin;
+    const char *end = s.begin + s.len;
+    size_t outLen = 0;
+    while (p < end)
+    {
+        char decoded[4];
+        size_t decodedLen = 1;
+        if (*p != '\\')
+        {
+            decoded[0] = *p;
+            // Keep multi-byte characters in the body together so that truncation doesn't split them
+            while (p + decodedLen < end && decodedLen < sizeof(decoded) &&
+                   (p[decodedLen] & 0xC0) == 0x80)
+            {
+                decoded[decodedLen] = p[decodedLen];
+                decodedLen++;
+            }
+            p += decodedLen;
+        }
+        else
+        {
+            p++;
+            switch (*p)
+            {
+            case 'b': decoded[0] = '\b'; break;
+            case 'f': decoded[0] = '\f'; break;
+            case 'n': decoded[0] = '\n'; break;
+            case 'r': decoded[0] = '\r'; break;
+            case 't': decoded[0] = '\t'; break;
+            case 'u':
+            {
+                uint32_t codePoint = ReadHex4(p + 1);
+                p += 4;
+                // Combine a UTF-16 surrogate pair
+                if (codePoint >= 0xD800 && codePoint <= 0xDBFF && end - p >= 7 && p[1] == '\\' &&
+                    p[2] == 'u')
+                {
+                    const uint32_t low = ReadHex4(p + 3);
+                    if (low >= 0xDC00 && low <= 0xDFFF)
+                    {
+                        codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+                decodedLen = EncodeUtf8(decoded, codePoint);
+                break;
+            }
+            default:
+                // '"', '\\' and '/' stand for themselves
+                decoded[0] = *p;
+                break;
+            }
+            p++;
+        }
+
+        if (outLen + decodedLen >= outSize)
+        {
+            break;
+        }
+        memcpy(out + outLen, decoded, decodedLen);
+        outLen += decodedLen;
+    }
+    out[outLen] = '\0';
+}
@@ -0,0 +1,12 @@
+#ifndef COMBAIN_RESPONSE_PARSER_H
+#define COMBAIN_RESPONSE_PARSER_H
+
+#include "legato.h"
+#include "interfaces.h"
+#include "CombainResult.h"
+
+#include <string>
+
+void CombainParseResponse(const std::string &body, CombainResult *result);
+
+#endif // COMBAIN_RESPONSE_PARSER_H
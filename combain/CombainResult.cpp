@@ -1,41 +1,93 @@
 #include "CombainResult.h"
 
 
-CombainResult::CombainResult(ma_combainLocation_Result_t type)
-    : type(type)
+CombainResult::CombainResult(void)
+    : set(false),
+      type(MA_COMBAINLOCATION_RESULT_COMMUNICATION_FAILURE)
 {}
 
 
-ma_combainLocation_Result_t CombainResult::getType(void) const
+void CombainResult::clear(void)
 {
-    return this->type;
+    this->set = false;
 }
 
 
-CombainSuccessResponse::CombainSuccessResponse(
-    double latitude, double longitude, double accuracyInMeters)
-    : CombainResult(MA_COMBAINLOCATION_RESULT_SUCCESS),
-      latitude(latitude),
-      longitude(longitude),
-      accuracyInMeters(accuracyInMeters)
-{}
+void CombainResult::setSuccess(double latitude, double longitude, double accuracyInMeters)
+{
+    this->set = true;
+    this->type = MA_COMBAINLOCATION_RESULT_SUCCESS;
+    this->success.latitude = latitude;
+    this->success.longitude = longitude;
+    this->success.accuracyInMeters = accuracyInMeters;
+}
 
 
-CombainErrorResponse::CombainErrorResponse(
-    uint16_t code, const std::string &message, std::initializer_list<CombainError> errors)
-    : CombainResult(MA_COMBAINLOCATION_RESULT_ERROR),
-      code(code),
-      message(message),
-      errors(errors)
-{}
+CombainErrorResponse &CombainResult::setError(uint16_t code)
+{
+    this->set = true;
+    this->type = MA_COMBAINLOCATION_RESULT_ERROR;
+    this->error.code = code;
+    this->error.message[0] = '\0';
+    this->error.firstError.domain[0] = '\0';
+    this->error.firstError.reason[0] = '\0';
+    this->error.firstError.message[0] = '\0';
+    return this->error;
+}
 
 
-CombainResponseParseFailure::CombainResponseParseFailure(const std::string &unparsed)
-    : CombainResult(MA_COMBAINLOCATION_RESULT_RESPONSE_PARSE_FAILURE),
-      unparsed(unparsed)
-{}
+void CombainResult::setParseFailure(const char *unparsed)
+{
+    this->set = true;
+    this->type = MA_COMBAINLOCATION_RESULT_RESPONSE_PARSE_FAILURE;
+    // Truncation is expected; clients can't retrieve any more than this
+    le_utf8_Copy(this->parseFailure.unparsed, unparsed, sizeof(this->parseFailure.unparsed), NULL);
+}
 
 
-CombainCommunicationFailure::CombainCommunicationFailure(void)
-    : CombainResult(MA_COMBAINLOCATION_RESULT_COMMUNICATION_FAILURE)
-{}
+void CombainResult::setCommunicationFailure(void)
+{
+    this->set = true;
+    this->type = MA_COMBAINLOCATION_RESULT_COMMUNICATION_FAILURE;
+}
+
+
+void CombainResult::setTimeout(void)
+{
+    this->set = true;
+    this->type = MA_COMBAINLOCATION_RESULT_TIMEOUT;
+}
+
+
+bool CombainResult::isSet(void) const
+{
+    return this->set;
+}
+
+
+ma_combainLocation_Result_t CombainResult::getType(void) const
+{
+    LE_ASSERT(this->set);
+    return this->type;
+}
+
+
+const CombainSuccessResponse &CombainResult::getSuccess(void) const
+{
+    LE_ASSERT(this->set && this->type == MA_COMBAINLOCATION_RESULT_SUCCESS);
+    return this->success;
+}
+
+
+const CombainErrorResponse &CombainResult::getError(void) const
+{
+    LE_ASSERT(this->set && this->type == MA_COMBAINLOCATION_RESULT_ERROR);
+    return this->error;
+}
+
+
+const CombainResponseParseFailure &CombainResult::getParseFailure(void) const
+{
+    LE_ASSERT(this->set && this->type == MA_COMBAINLOCATION_RESULT_RESPONSE_PARSE_FAILURE);
+    return this->parseFailure;
+}
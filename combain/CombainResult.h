@@ -4,25 +4,17 @@
 #include "legato.h"
 #include "interfaces.h"
 
-#include <initializer_list>
-#include <list>
-#include <string>
+// Sizes of the string fields, including the terminator. They match the buffers that
+// GetErrorResponse() and GetParseFailureResult() copy them into, so nothing a client could
+// retrieve is lost by storing them inline.
+#define COMBAIN_ERROR_DOMAIN_BYTES (64 + 1)
+#define COMBAIN_ERROR_REASON_BYTES (64 + 1)
+#define COMBAIN_ERROR_MESSAGE_BYTES (128 + 1)
+#define COMBAIN_UNPARSED_RESPONSE_BYTES (256 + 1)
 
 
-class CombainResult
-{
-public:
-    explicit CombainResult(ma_combainLocation_Result_t type);
-    ma_combainLocation_Result_t getType(void) const;
-private:
-    ma_combainLocation_Result_t type;
-};
-
-
-struct CombainSuccessResponse : public CombainResult
+struct CombainSuccessResponse
 {
-    CombainSuccessResponse(double latitude, double longitude, double accuracyInMeters);
-
     double latitude;
     double longitude;
     double accuracyInMeters;
@@ -31,29 +23,59 @@ struct CombainSuccessResponse : public CombainResult
 
 struct CombainError
 {
-    std::string domain;
-    std::string reason;
-    std::string message;
+    char domain[COMBAIN_ERROR_DOMAIN_BYTES];
+    char reason[COMBAIN_ERROR_REASON_BYTES];
+    char message[COMBAIN_ERROR_MESSAGE_BYTES];
 };
 
-struct CombainErrorResponse : public CombainResult
+struct CombainErrorResponse
 {
-    CombainErrorResponse(
-        uint16_t code, const std::string &message, std::initializer_list<CombainError> errors);
     uint16_t code;
-    std::string message;
-    std::list<CombainError> errors;
+    char message[COMBAIN_ERROR_MESSAGE_BYTES];
+    // The server may send a list of errors, but only the first is available to clients
+    CombainError firstError;
 };
 
-struct CombainResponseParseFailure : public CombainResult
+struct CombainResponseParseFailure
 {
-    explicit CombainResponseParseFailure(const std::string& unparsed);
-    std::string unparsed;
+    char unparsed[COMBAIN_UNPARSED_RESPONSE_BYTES];
 };
 
-struct CombainCommunicationFailure : public CombainResult
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * The outcome of a location request, stored by value. The type says which member of the union is
+ * valid, so results can be kept in pooled request records and copied to coalesced requests without
+ * any heap allocation.
+ */
+//--------------------------------------------------------------------------------------------------
+class CombainResult
 {
-    CombainCommunicationFailure(void);
+public:
+    CombainResult(void);
+
+    void clear(void);
+    void setSuccess(double latitude, double longitude, double accuracyInMeters);
+    CombainErrorResponse &setError(uint16_t code);
+    void setParseFailure(const char *unparsed);
+    void setCommunicationFailure(void);
+    void setTimeout(void);
+
+    bool isSet(void) const;
+    ma_combainLocation_Result_t getType(void) const;
+    const CombainSuccessResponse &getSuccess(void) const;
+    const CombainErrorResponse &getError(void) const;
+    const CombainResponseParseFailure &getParseFailure(void) const;
+
+private:
+    bool set;
+    ma_combainLocation_Result_t type;
+    union
+    {
+        CombainSuccessResponse success;
+        CombainErrorResponse error;
+        CombainResponseParseFailure parseFailure;
+    };
 };
 
 
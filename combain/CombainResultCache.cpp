@@ -0,0 +1,74 @@
+#include "CombainResultCache.h"
+
+
+CombainResultCache::CombainResultCache(size_t capacity, uint32_t ttlSeconds)
+    : capacity(capacity),
+      ttl({static_cast<time_t>(ttlSeconds), 0}),
+      stats()
+{
+    this->entries.reserve(capacity);
+}
+
+bool CombainResultCache::isEnabled(void) const
+{
+    return this->capacity > 0 && this->ttl.sec > 0;
+}
+
+bool CombainResultCache::lookup(const std::string &fingerprint, CombainSuccessResponse *result)
+{
+    auto it = this->entries.find(fingerprint);
+    if (it == this->entries.end())
+    {
+        this->stats.misses++;
+        return false;
+    }
+
+    if (le_clk_GreaterThan(le_clk_GetRelativeTime(), it->second.expiry))
+    {
+        this->lru.erase(it->second.lruPosition);
+        this->entries.erase(it);
+        this->stats.misses++;
+        return false;
+    }
+
+    this->lru.splice(this->lru.begin(), this->lru, it->second.lruPosition);
+    this->stats.hits++;
+    *result = it->second.result;
+    return true;
+}
+
+void CombainResultCache::insert(
+    const std::string &fingerprint, const CombainSuccessResponse &result)
+{
+    if (!this->isEnabled())
+    {
+        return;
+    }
+
+    const le_clk_Time_t expiry = le_clk_Add(le_clk_GetRelativeTime(), this->ttl);
+    auto it = this->entries.find(fingerprint);
+    if (it != this->entries.end())
+    {
+        it->second.result = result;
+        it->second.expiry = expiry;
+        this->lru.splice(this->lru.begin(), this->lru, it->second.lruPosition);
+        return;
+    }
+
+    if (this->entries.size() >= this->capacity)
+    {
+        this->entries.erase(this->lru.back());
+        this->lru.pop_back();
+        this->stats.evictions++;
+    }
+
+    this->lru.push_front(fingerprint);
+    this->entries.emplace(fingerprint, Entry{result, expiry, this->lru.begin()});
+}
+
+CombainResultCache::Stats CombainResultCache::getStats(void) const
+{
+    Stats s = this->stats;
+    s.size = this->entries.size();
+    return s;
+}
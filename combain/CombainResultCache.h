@@ -0,0 +1,52 @@
+#ifndef COMBAIN_RESULT_CACHE_H
+#define COMBAIN_RESULT_CACHE_H
+
+#include "legato.h"
+#include "interfaces.h"
+#include "CombainResult.h"
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Caches successful results by scan fingerprint so that a device which hasn't moved doesn't need to
+ * ask the Combain server again. The least recently used entry is evicted when the cache is full.
+ */
+//--------------------------------------------------------------------------------------------------
+class CombainResultCache
+{
+public:
+    struct Stats
+    {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t evictions;
+        uint32_t size;
+    };
+
+    CombainResultCache(size_t capacity, uint32_t ttlSeconds);
+
+    bool isEnabled(void) const;
+    bool lookup(const std::string &fingerprint, CombainSuccessResponse *result);
+    void insert(const std::string &fingerprint, const CombainSuccessResponse &result);
+    Stats getStats(void) const;
+
+private:
+    struct Entry
+    {
+        CombainSuccessResponse result;
+        le_clk_Time_t expiry;
+        std::list<std::string>::iterator lruPosition;
+    };
+
+    size_t capacity;
+    le_clk_Time_t ttl;
+    std::unordered_map<std::string, Entry> entries;
+    // Most recently used fingerprint at the front
+    std::list<std::string> lru;
+    Stats stats;
+};
+
+#endif // COMBAIN_RESULT_CACHE_H
@@ -0,0 +1,156 @@
+#include "CombainStats.h"
+
+#include <atomic>
+
+#define NUM_STAGES (MA_COMBAINLOCATION_STAGE_TOTAL + 1)
+
+// Upper bound of the first histogram bucket is 2^FIRST_BUCKET_SHIFT microseconds
+#define FIRST_BUCKET_SHIFT 5
+
+struct LatencyHistogram
+{
+    std::atomic<uint32_t> buckets[MA_COMBAINLOCATION_LATENCY_HISTOGRAM_BUCKETS];
+    std::atomic<uint32_t> count;
+    std::atomic<uint64_t> totalMicroseconds;
+};
+
+// Zero initialized as they have static storage duration
+static LatencyHistogram Histograms[NUM_STAGES];
+
+static struct
+{
+    std::atomic<uint32_t> requests;
+    std::atomic<uint32_t> serverRequests;
+    std::atomic<uint32_t> results[MA_COMBAINLOCATION_MAX_RESULT_TYPES];
+    std::atomic<uint64_t> bytesOut;
+    std::atomic<uint64_t> bytesIn;
+    std::atomic<uint64_t> uncompressedBytesOut;
+    std::atomic<uint64_t> uncompressedBytesIn;
+    std::atomic<uint32_t> apsRemoved;
+    std::atomic<uint64_t> bytesRemoved;
+} Counters;
+
+static size_t BucketForLatency(uint64_t microseconds);
+
+
+uint64_t CombainStatsNowUs(void)
+{
+    const le_clk_Time_t now = le_clk_GetRelativeTime();
+    return static_cast<uint64_t>(now.sec) * 1000000 + now.usec;
+}
+
+void CombainStatsRecordLatency(ma_combainLocation_Stage_t stage, uint64_t microseconds)
+{
+    LE_ASSERT(stage < NUM_STAGES);
+    LatencyHistogram &h = Histograms[stage];
+    h.buckets[BucketForLatency(microseconds)].fetch_add(1, std::memory_order_relaxed);
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.totalMicroseconds.fetch_add(microseconds, std::memory_order_relaxed);
+}
+
+void CombainStatsCountRequest(void)
+{
+    Counters.requests.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Wire bytes are the body as it was sent or received, which is after compression if any was used
+void CombainStatsCountServerRequest(size_t wireBytes, size_t bodyBytes)
+{
+    Counters.serverRequests.fetch_add(1, std::memory_order_relaxed);
+    Counters.bytesOut.fetch_add(wireBytes, std::memory_order_relaxed);
+    Counters.uncompressedBytesOut.fetch_add(bodyBytes, std::memory_order_relaxed);
+}
+
+void CombainStatsCountResponse(size_t wireBytes, size_t bodyBytes)
+{
+    Counters.bytesIn.fetch_add(wireBytes, std::memory_order_relaxed);
+    Counters.uncompressedBytesIn.fetch_add(bodyBytes, std::memory_order_relaxed);
+}
+
+void CombainStatsCountResult(ma_combainLocation_Result_t result)
+{
+    LE_ASSERT(result < MA_COMBAINLOCATION_MAX_RESULT_TYPES);
+    Counters.results[result].fetch_add(1, std::memory_order_relaxed);
+}
+
+void CombainStatsCountApSelection(uint32_t apsRemoved, uint32_t bytesRemoved)
+{
+    Counters.apsRemoved.fetch_add(apsRemoved, std::memory_order_relaxed);
+    Counters.bytesRemoved.fetch_add(bytesRemoved, std::memory_order_relaxed);
+}
+
+void CombainStatsGetCounters(
+    uint32_t *requests,
+    uint32_t *serverRequests,
+    uint32_t *resultCounts,
+    size_t *resultCountsSize,
+    uint64_t *bytesOut,
+    uint64_t *bytesIn,
+    uint64_t *uncompressedBytesOut,
+    uint64_t *uncompressedBytesIn,
+    uint32_t *apsRemoved,
+    uint64_t *bytesRemoved)
+{
+    *requests = Counters.requests.load(std::memory_order_relaxed);
+    *serverRequests = Counters.serverRequests.load(std::memory_order_relaxed);
+    if (*resultCountsSize > MA_COMBAINLOCATION_MAX_RESULT_TYPES)
+    {
+        *resultCountsSize = MA_COMBAINLOCATION_MAX_RESULT_TYPES;
+    }
+    for (size_t i = 0; i < *resultCountsSize; i++)
+    {
+        resultCounts[i] = Counters.results[i].load(std::memory_order_relaxed);
+    }
+    *bytesOut = Counters.bytesOut.load(std::memory_order_relaxed);
+    *bytesIn = Counters.bytesIn.load(std::memory_order_relaxed);
+    *uncompressedBytesOut = Counters.uncompressedBytesOut.load(std::memory_order_relaxed);
+    *uncompressedBytesIn = Counters.uncompressedBytesIn.load(std::memory_order_relaxed);
+    *apsRemoved = Counters.apsRemoved.load(std::memory_order_relaxed);
+    *bytesRemoved = Counters.bytesRemoved.load(std::memory_order_relaxed);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Copies out a histogram. The buckets are read one at a time while other threads may be recording,
+ * so the copy can be off by the few measurements recorded while it is being made.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t CombainStatsGetLatencyHistogram(
+    ma_combainLocation_Stage_t stage,
+    uint32_t *bucketCounts,
+    size_t *bucketCountsSize,
+    uint32_t *count,
+    uint64_t *totalMicroseconds)
+{
+    if (static_cast<uint32_t>(stage) >= NUM_STAGES)
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    const LatencyHistogram &h = Histograms[stage];
+    if (*bucketCountsSize > MA_COMBAINLOCATION_LATENCY_HISTOGRAM_BUCKETS)
+    {
+        *bucketCountsSize = MA_COMBAINLOCATION_LATENCY_HISTOGRAM_BUCKETS;
+    }
+    for (size_t i = 0; i < *bucketCountsSize; i++)
+    {
+        bucketCounts[i] = h.buckets[i].load(std::memory_order_relaxed);
+    }
+    *count = h.count.load(std::memory_order_relaxed);
+    *totalMicroseconds = h.totalMicroseconds.load(std::memory_order_relaxed);
+    return LE_OK;
+}
+
+
+//----------------- STATIC
+static size_t BucketForLatency(uint64_t microseconds)
+{
+    size_t bucket = 0;
+    uint64_t bound = 1ULL << FIRST_BUCKET_SHIFT;
+    while (microseconds >= bound && bucket < MA_COMBAINLOCATION_LATENCY_HISTOGRAM_BUCKETS - 1)
+    {
+        bound <<= 1;
+        bucket++;
+    }
+    return bucket;
+}
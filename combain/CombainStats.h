@@ -0,0 +1,40 @@
+#ifndef COMBAIN_STATS_H
+#define COMBAIN_STATS_H
+
+#include "legato.h"
+#include "interfaces.h"
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Counters and per-stage latency histograms for the service. Everything here is updated with
+ * relaxed atomic operations, so it may be recorded from any thread without locking.
+ */
+//--------------------------------------------------------------------------------------------------
+
+uint64_t CombainStatsNowUs(void);
+void CombainStatsRecordLatency(ma_combainLocation_Stage_t stage, uint64_t microseconds);
+void CombainStatsCountRequest(void);
+void CombainStatsCountServerRequest(size_t wireBytes, size_t bodyBytes);
+void CombainStatsCountResponse(size_t wireBytes, size_t bodyBytes);
+void CombainStatsCountResult(ma_combainLocation_Result_t result);
+void CombainStatsCountApSelection(uint32_t apsRemoved, uint32_t bytesRemoved);
+
+void CombainStatsGetCounters(
+    uint32_t *requests,
+    uint32_t *serverRequests,
+    uint32_t *resultCounts,
+    size_t *resultCountsSize,
+    uint64_t *bytesOut,
+    uint64_t *bytesIn,
+    uint64_t *uncompressedBytesOut,
+    uint64_t *uncompressedBytesIn,
+    uint32_t *apsRemoved,
+    uint64_t *bytesRemoved);
+le_result_t CombainStatsGetLatencyHistogram(
+    ma_combainLocation_Stage_t stage,
+    uint32_t *bucketCounts,
+    size_t *bucketCountsSize,
+    uint32_t *count,
+    uint64_t *totalMicroseconds);
+
+#endif // COMBAIN_STATS_H
@@ -0,0 +1,211 @@
+#include "CombainTrace.h"
+
+#include <algorithm>
+#include <cstring>
+
+#define TRACE_FILE_MAGIC 0x43525443 // "CTRC"
+#define TRACE_FILE_VERSION 1
+
+// How often the writer thread moves records from the ring to the file
+#define TRACE_FLUSH_INTERVAL_MS 250
+
+static size_t RoundUpToPowerOfTwo(size_t n);
+
+
+CombainTrace::CombainTrace(const char *path, size_t bufferBytes, size_t maxFileBytes)
+    : path(path),
+      rotatedPath(std::string(path) + ".1"),
+      maxFileBytes(maxFileBytes),
+      mask(RoundUpToPowerOfTwo(bufferBytes) - 1),
+      buffer(new uint8_t[mask + 1]),
+      head(0),
+      tail(0),
+      numRecords(0),
+      numDropped(0),
+      numRotations(0),
+      file(NULL),
+      fileBytes(0)
+{}
+
+void CombainTrace::start(void)
+{
+    le_thread_Ref_t thread = le_thread_Create("CombainTrace", ThreadFunc, this);
+    le_thread_Start(thread);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Appends a record to the ring. Must only be called from the main thread. The record is dropped if
+ * the ring doesn't have room for it.
+ */
+//--------------------------------------------------------------------------------------------------
+void CombainTrace::record(
+    RecordType type,
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const char *data,
+    size_t len,
+    uint8_t result)
+{
+    const size_t recordBytes = sizeof(TraceRecordHeader) + len;
+    const size_t t = this->tail.load(std::memory_order_relaxed);
+    const size_t h = this->head.load(std::memory_order_acquire);
+    if (recordBytes > (this->mask + 1) - (t - h))
+    {
+        this->numDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    const le_clk_Time_t now = le_clk_GetRelativeTime();
+    TraceRecordHeader header;
+    header.length = len;
+    header.handle = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(handle));
+    header.timestampUs = static_cast<uint64_t>(now.sec) * 1000000 + now.usec;
+    header.type = type;
+    header.result = result;
+    this->copyIn(t, &header, sizeof(header));
+    if (len > 0)
+    {
+        this->copyIn(t + sizeof(header), data, len);
+    }
+    this->tail.store(t + recordBytes, std::memory_order_release);
+    this->numRecords.fetch_add(1, std::memory_order_relaxed);
+}
+
+CombainTrace::Stats CombainTrace::getStats(void) const
+{
+    Stats s;
+    s.records = this->numRecords.load(std::memory_order_relaxed);
+    s.dropped = this->numDropped.load(std::memory_order_relaxed);
+    s.rotations = this->numRotations.load(std::memory_order_relaxed);
+    return s;
+}
+
+void *CombainTrace::ThreadFunc(void *context)
+{
+    CombainTrace *trace = static_cast<CombainTrace *>(context);
+
+    // Keep the trace from the previous run rather than overwriting it
+    rename(trace->path.c_str(), trace->rotatedPath.c_str());
+    trace->openFile();
+
+    le_timer_Ref_t timer = le_timer_Create("CombainTraceFlush");
+    LE_ASSERT_OK(le_timer_SetHandler(timer, FlushTimerHandler));
+    LE_ASSERT_OK(le_timer_SetContextPtr(timer, trace));
+    LE_ASSERT_OK(le_timer_SetMsInterval(timer, TRACE_FLUSH_INTERVAL_MS));
+    LE_ASSERT_OK(le_timer_SetRepeat(timer, 0));
+    LE_ASSERT_OK(le_timer_Start(timer));
+
+    le_event_RunLoop();
+    return NULL;
+}
+
+void CombainTrace::FlushTimerHandler(le_timer_Ref_t timer)
+{
+    static_cast<CombainTrace *>(le_timer_GetContextPtr(timer))->flush();
+}
+
+void CombainTrace::copyIn(size_t pos, const void *data, size_t len)
+{
+    const size_t offset = pos & this->mask;
+    const size_t first = std::min(len, (this->mask + 1) - offset);
+    memcpy(&this->buffer[offset], data, first);
+    memcpy(&this->buffer[0], static_cast<const uint8_t *>(data) + first, len - first);
+}
+
+void CombainTrace::copyOut(size_t pos, void *data, size_t len) const
+{
+    const size_t offset = pos & this->mask;
+    const size_t first = std::min(len, (this->mask + 1) - offset);
+    memcpy(data, &this->buffer[offset], first);
+    memcpy(static_cast<uint8_t *>(data) + first, &this->buffer[0], len - first);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Moves every complete record from the ring to the file, starting a new file first whenever a
+ * record would take the current one over its maximum size. Records are consumed even if they
+ * can't be written so that the ring never stays full.
+ */
+//--------------------------------------------------------------------------------------------------
+void CombainTrace::flush(void)
+{
+    size_t h = this->head.load(std::memory_order_relaxed);
+    const size_t t = this->tail.load(std::memory_order_acquire);
+    while (h != t)
+    {
+        TraceRecordHeader header;
+        this->copyOut(h, &header, sizeof(header));
+        const size_t recordBytes = sizeof(header) + header.length;
+
+        if (this->file != NULL && this->fileBytes > sizeof(TraceFileHeader) &&
+            this->fileBytes + recordBytes > this->maxFileBytes)
+        {
+            fclose(this->file);
+            this->file = NULL;
+            rename(this->path.c_str(), this->rotatedPath.c_str());
+            this->numRotations.fetch_add(1, std::memory_order_relaxed);
+            this->openFile();
+        }
+
+        if (this->file != NULL && !this->writeFromRing(h, recordBytes))
+        {
+            LE_WARN(
+                "Couldn't write to the trace file \"%s\". Tracing stopped.", this->path.c_str());
+            fclose(this->file);
+            this->file = NULL;
+        }
+        h += recordBytes;
+    }
+
+    if (this->file != NULL)
+    {
+        fflush(this->file);
+    }
+    this->head.store(h, std::memory_order_release);
+}
+
+void CombainTrace::openFile(void)
+{
+    this->file = fopen(this->path.c_str(), "wb");
+    if (this->file == NULL)
+    {
+        LE_WARN("Couldn't create the trace file \"%s\"", this->path.c_str());
+        return;
+    }
+
+    const TraceFileHeader header = {TRACE_FILE_MAGIC, TRACE_FILE_VERSION};
+    this->fileBytes = 0;
+    if (fwrite(&header, sizeof(header), 1, this->file) != 1)
+    {
+        LE_WARN("Couldn't write to the trace file \"%s\"", this->path.c_str());
+        fclose(this->file);
+        this->file = NULL;
+        return;
+    }
+    this->fileBytes = sizeof(header);
+}
+
+bool CombainTrace::writeFromRing(size_t pos, size_t len)
+{
+    const size_t offset = pos & this->mask;
+    const size_t first = std::min(len, (this->mask + 1) - offset);
+    if (fwrite(&this->buffer[offset], 1, first, this->file) != first ||
+        fwrite(&this->buffer[0], 1, len - first, this->file) != len - first)
+    {
+        return false;
+    }
+    this->fileBytes += len;
+    return true;
+}
+
+
+//----------------- STATIC
+static size_t RoundUpToPowerOfTwo(size_t n)
+{
+    size_t p = 1;
+    while (p < n)
+    {
+        p <<= 1;
+    }
+    return p;
+}
@@ -0,0 +1,98 @@
+#ifndef COMBAIN_TRACE_H
+#define COMBAIN_TRACE_H
+
+#include "legato.h"
+#include "interfaces.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Records request bodies, responses and results to a binary trace file for offline analysis.
+ *
+ * Records are appended to an in-memory ring by the main thread without locking or blocking, and a
+ * separate thread periodically moves them to the file. When the ring is full, records are dropped
+ * and counted rather than slowing the caller down. When the file reaches its maximum size it is
+ * renamed with a ".1" suffix, replacing any earlier one, and a new file is started.
+ *
+ * The file starts with a TraceFileHeader, followed by records. Each record is a TraceRecordHeader
+ * followed by its data. All values are in host byte order.
+ */
+//--------------------------------------------------------------------------------------------------
+class CombainTrace
+{
+public:
+    enum RecordType
+    {
+        RECORD_REQUEST = 1,  ///< Request body sent to the server, or coalesced with one in flight
+        RECORD_RESPONSE = 2, ///< Response body received from the server. Empty if none was.
+        RECORD_RESULT = 3,   ///< Result delivered to a client. No data.
+    };
+
+    struct __attribute__((packed)) TraceFileHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+    };
+
+    struct __attribute__((packed)) TraceRecordHeader
+    {
+        uint32_t length;      ///< Bytes of data following the header
+        uint32_t handle;      ///< Request handle
+        uint64_t timestampUs; ///< Relative (monotonic) clock
+        uint8_t type;         ///< RecordType
+        uint8_t result;       ///< ma_combainLocation_Result_t for RECORD_RESULT, otherwise 0
+    };
+
+    struct Stats
+    {
+        uint32_t records;
+        uint32_t dropped;
+        uint32_t rotations;
+    };
+
+    CombainTrace(const char *path, size_t bufferBytes, size_t maxFileBytes);
+
+    void start(void);
+    void record(
+        RecordType type,
+        ma_combainLocation_LocReqHandleRef_t handle,
+        const char *data,
+        size_t len,
+        uint8_t result);
+    Stats getStats(void) const;
+
+private:
+    static void *ThreadFunc(void *context);
+    static void FlushTimerHandler(le_timer_Ref_t timer);
+
+    void copyIn(size_t pos, const void *data, size_t len);
+    void copyOut(size_t pos, void *data, size_t len) const;
+    void flush(void);
+    void openFile(void);
+    bool writeFromRing(size_t pos, size_t len);
+
+    const std::string path;
+    const std::string rotatedPath;
+    const size_t maxFileBytes;
+
+    // The indices increase monotonically and are reduced to a buffer offset with the mask
+    const size_t mask;
+    std::unique_ptr<uint8_t[]> buffer;
+    // Written by the writer thread
+    std::atomic<size_t> head;
+    // Written by the main thread
+    std::atomic<size_t> tail;
+
+    std::atomic<uint32_t> numRecords;
+    std::atomic<uint32_t> numDropped;
+    std::atomic<uint32_t> numRotations;
+
+    // Writer thread only
+    FILE *file;
+    size_t fileBytes;
+};
+
+#endif // COMBAIN_TRACE_H
@@ -0,0 +1,161 @@
+#ifndef HANDLE_TABLE_H
+#define HANDLE_TABLE_H
+
+#include <stdint.h>
+#include <vector>
+
+// A fixed-capacity table of objects addressed by opaque handles.
+//
+// Each slot has a generation counter which is bumped whenever the slot is freed, and handles carry
+// the generation of the slot that they were issued for. Creating, looking up and destroying an
+// object are all O(1), slots are reused, and a handle to a destroyed object is rejected even after
+// its slot has been reused for a new object.
+//
+// Handles are odd, non-zero values so that they can be passed to clients as Legato references.
+// Above the odd bit, a handle holds the slot index in as few bits as the capacity needs, and the
+// generation in the rest, up to 32 bits. A slot is retired instead of being reused once its
+// generation runs out, so a stale handle can never match again. With 32-bit handles and the
+// default capacity of 64, that is after about 33 million uses of the slot.
+//
+// T must be default constructible and have a clear() method, which is called when an object is
+// destroyed. clear() may keep storage that the object owns so that the next object created in the
+// same slot can reuse it without allocating.
+template <class T> class HandleTable
+{
+public:
+    // At most 15 bits of slot index, which leaves 16 bits of generation in a 32-bit handle
+    static const size_t MaxCapacity = 0x7FFF;
+
+    explicit HandleTable(size_t capacity)
+        : slots(capacity < MaxCapacity ? capacity : MaxCapacity), indexBits(1), numInUse(0)
+    {
+        while ((static_cast<size_t>(1) << this->indexBits) < this->slots.size())
+        {
+            this->indexBits++;
+        }
+        const unsigned generationBits = sizeof(uintptr_t) * 8 - 1 - this->indexBits;
+        this->maxGeneration =
+            (generationBits >= 32) ? UINT32_MAX : (static_cast<uint32_t>(1) << generationBits) - 1;
+
+        this->freeSlots.reserve(this->slots.size());
+        for (size_t i = this->slots.size(); i > 0; i--)
+        {
+            this->freeSlots.push_back(i - 1);
+        }
+    }
+
+    // Returns a cleared object. Returns NULL if the table is full.
+    T* create(uintptr_t *handle)
+    {
+        if (this->freeSlots.empty())
+        {
+            return NULL;
+        }
+        const uint32_t index = this->freeSlots.back();
+        this->freeSlots.pop_back();
+
+        Slot &s = this->slots[index];
+        s.inUse = true;
+        this->numInUse++;
+        *handle = this->makeHandle(index, s.generation);
+        return &s.value;
+    }
+
+    // Returns NULL if the handle doesn't refer to a live object
+    T* lookup(uintptr_t handle)
+    {
+        Slot *s = this->slotFromHandle(handle);
+        return s ? &s->value : NULL;
+    }
+
+    // Destroys the object that the handle refers to. Returns false if the handle doesn't refer to
+    // a live object.
+    bool destroy(uintptr_t handle)
+    {
+        Slot *s = this->slotFromHandle(handle);
+        if (!s)
+        {
+            return false;
+        }
+        this->release(s);
+        return true;
+    }
+
+    // Destroys every live object for which pred(object) returns true
+    template <class F> void destroyIf(F pred)
+    {
+        for (auto& s : this->slots)
+        {
+            if (s.inUse && pred(s.value))
+            {
+                this->release(&s);
+            }
+        }
+    }
+
+    size_t size(void) const
+    {
+        return this->numInUse;
+    }
+
+    size_t capacity(void) const
+    {
+        return this->slots.size();
+    }
+
+private:
+    struct Slot
+    {
+        Slot(void) : generation(0), inUse(false), value() {}
+        uint32_t generation;
+        bool inUse;
+        T value;
+    };
+
+    uintptr_t makeHandle(uint32_t index, uint32_t generation) const
+    {
+        return (static_cast<uintptr_t>(generation) << (1 + this->indexBits)) |
+            (static_cast<uintptr_t>(index) << 1) | 1;
+    }
+
+    Slot* slotFromHandle(uintptr_t handle)
+    {
+        if ((handle & 1) == 0)
+        {
+            return NULL;
+        }
+        const uintptr_t indexMask = (static_cast<uintptr_t>(1) << this->indexBits) - 1;
+        const uintptr_t index = (handle >> 1) & indexMask;
+        const uintptr_t generation = handle >> (1 + this->indexBits);
+        if (index >= this->slots.size() || generation > this->maxGeneration)
+        {
+            return NULL;
+        }
+        Slot &s = this->slots[index];
+        return (s.inUse && s.generation == generation) ? &s : NULL;
+    }
+
+    void release(Slot *s)
+    {
+        s->value.clear();
+        s->inUse = false;
+        this->numInUse--;
+        if (s->generation == this->maxGeneration)
+        {
+            // Reusing the slot would reissue a handle that a client may still hold
+            return;
+        }
+        s->generation++;
+        this->freeSlots.push_back(s - &this->slots[0]);
+    }
+
+    std::vector<Slot> slots;
+    std::vector<uint32_t> freeSlots;
+    unsigned indexBits;
+    uint32_t maxGeneration;
+    size_t numInUse;
+};
+
+template <class T> const size_t HandleTable<T>::MaxCapacity;
+
+#endif // HANDLE_TABLE_H
@@ -0,0 +1,117 @@
+#ifndef SPSC_CHANNEL_H
+#define SPSC_CHANNEL_H
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// A bounded, lock-free channel between exactly one producer thread and one consumer thread.
+//
+// Elements are moved into and out of a fixed ring of slots, so passing an element through the
+// channel never copies it and never allocates. Neither side ever blocks; the producer is told when
+// the channel is full and the consumer when it is empty, and each side is expected to have its own
+// way of waiting (an event loop, curl_multi_wait(), etc.).
+template <class T> class SpscChannel
+{
+public:
+    // The capacity is rounded up to a power of two.
+    explicit SpscChannel(size_t capacity)
+        : mask(RoundUpToPowerOfTwo(capacity) - 1),
+          slots(new T[mask + 1]),
+          head(0),
+          tail(0),
+          cachedHead(0),
+          cachedTail(0)
+    {}
+
+    SpscChannel(const SpscChannel&) = delete;
+    SpscChannel& operator=(const SpscChannel&) = delete;
+
+    // Producer only. Moves val into the channel unless the channel is full, in which case val is
+    // left untouched and false is returned.
+    bool tryPush(T&& val)
+    {
+        const size_t t = this->tail.load(std::memory_order_relaxed);
+        if (t - this->cachedHead > this->mask)
+        {
+            this->cachedHead = this->head.load(std::memory_order_acquire);
+            if (t - this->cachedHead > this->mask)
+            {
+                return false;
+            }
+        }
+        this->slots[t & this->mask] = std::move(val);
+        this->tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Moves the oldest element into val. Returns false if the channel is empty.
+    bool tryPop(T& val)
+    {
+        const size_t h = this->head.load(std::memory_order_relaxed);
+        if (h == this->cachedTail)
+        {
+            this->cachedTail = this->tail.load(std::memory_order_acquire);
+            if (h == this->cachedTail)
+            {
+                return false;
+            }
+        }
+        val = std::move(this->slots[h & this->mask]);
+        this->head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Moves up to max elements onto the end of out, publishing the freed slots to
+    // the producer once for the whole batch. Returns the number of elements moved.
+    size_t drain(std::vector<T>& out, size_t max)
+    {
+        const size_t h = this->head.load(std::memory_order_relaxed);
+        this->cachedTail = this->tail.load(std::memory_order_acquire);
+        size_t n = this->cachedTail - h;
+        if (n > max)
+        {
+            n = max;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            out.push_back(std::move(this->slots[(h + i) & this->mask]));
+        }
+        this->head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    size_t capacity(void) const
+    {
+        return this->mask + 1;
+    }
+
+private:
+    static size_t RoundUpToPowerOfTwo(size_t n)
+    {
+        size_t p = 1;
+        while (p < n)
+        {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    // The indices increase monotonically and are reduced to a slot with the mask, so the channel is
+    // full when tail - head == capacity and empty when they are equal.
+    const size_t mask;
+    std::unique_ptr<T[]> slots;
+
+    // Written by the consumer
+    alignas(64) std::atomic<size_t> head;
+    // Written by the producer
+    alignas(64) std::atomic<size_t> tail;
+
+    // The producer's last view of head. Producer only.
+    alignas(64) size_t cachedHead;
+    // The consumer's last view of tail. Consumer only.
+    alignas(64) size_t cachedTail;
+};
+
+#endif // SPSC_CHANNEL_H
@@ -1,42 +1,181 @@
 #include "legato.h"
 #include "interfaces.h"
 
-#include <list>
+#include <algorithm>
+#include <atomic>
 #include <stdexcept>
 #include <memory>
-#include <algorithm>
-#include <jansson.h>
+#include <unordered_map>
+#include <vector>
 
 #include "CombainRequestBuilder.h"
 #include "CombainResult.h"
+#include "CombainResponseParser.h"
 #include "CombainHttp.h"
-#include "ThreadSafeQueue.h"
+#include "CombainConfig.h"
+#include "CombainResultCache.h"
+#include "CombainApDatabase.h"
+#include "SpscChannel.h"
+#include "HandleTable.h"
+#include "CombainAllocCounter.h"
+#include "CombainTrace.h"
+#include "CombainStats.h"
 
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Everything the service holds for one request. Records live in the Requests table and are cleared
+ * rather than freed when a request is destroyed, so the storage of their containers is reused by
+ * later requests and a warmed up service doesn't allocate to create, build or resolve one.
+ */
+//--------------------------------------------------------------------------------------------------
 struct RequestRecord
 {
+    RequestRecord(void);
+    void clear(void);
+
     ma_combainLocation_LocReqHandleRef_t handle;
     le_msg_SessionRef_t clientSession;
-    std::shared_ptr<CombainRequestBuilder> request;
+    CombainRequestBuilder request;
+    bool submitted;
     ma_combainLocation_LocationResultHandlerFunc_t responseHandler;
+    // Set instead of responseHandler for requests submitted with SubmitScan()
+    ma_combainLocation_LocationFixHandlerFunc_t fixHandler;
     void *responseHandlerContext;
-    std::shared_ptr<CombainResult> result;
+    CombainResult result;
+    std::string fingerprint;
+    std::vector<CombainApDatabase::Observation> observedAps;
+    uint64_t allocationsAtCreate;
+    uint64_t allocatedBytesAtCreate;
+    uint64_t submitTimeUs;
+    CombainApSelectionStats apSelection;
+    ma_combainLocation_Priority_t priority;
+    uint32_t deadlineMs;
+    // The handle that the HTTP request this is waiting for was sent with, which is this request's
+    // own handle unless it was coalesced. NULL if it isn't waiting for one.
+    ma_combainLocation_LocReqHandleRef_t inFlightHandle;
 };
 
-// Just use a list for all of the requests because it's very unlikely that there will be more than
-// one or two active at a time.
-static std::list<RequestRecord> Requests;
+// All requests, addressed by the handles given to clients. Sized from /MaxRequests at startup.
+static std::unique_ptr<HandleTable<RequestRecord>> Requests;
+
+// Capacities of the channels to and from the HTTP thread. Submissions fail with LE_NO_MEMORY when
+// the request channel is full.
+#define REQUEST_CHANNEL_CAPACITY 64
+#define RESPONSE_CHANNEL_CAPACITY 64
+#define CANCEL_CHANNEL_CAPACITY 64
 
-ThreadSafeQueue<std::tuple<ma_combainLocation_LocReqHandleRef_t, std::string, std::string>> RequestJson;
-ThreadSafeQueue<std::tuple<ma_combainLocation_LocReqHandleRef_t, std::string>> ResponseJson;
+SpscChannel<CombainHttpRequest> RequestJson(REQUEST_CHANNEL_CAPACITY);
+SpscChannel<CombainHttpResponse> ResponseJson(RESPONSE_CHANNEL_CAPACITY);
+// Handles of in-flight requests which nobody is waiting for any more
+SpscChannel<ma_combainLocation_LocReqHandleRef_t> CancelledRequests(CANCEL_CHANNEL_CAPACITY);
 le_event_Id_t ResponseAvailableEvent;
+static CombainConfig Config;
+static CombainApSelectionPolicy ApSelectionPolicy;
+static std::unique_ptr<CombainResultCache> ResultCache;
+static std::unique_ptr<CombainApDatabase> ApDatabase;
+// Writes the AP database to flash, so that a slow filesystem doesn't hold up the main thread
+static le_thread_Ref_t ApDatabaseSaveThread;
+// Set from the main thread when a save is queued and cleared from the save thread once written
+static std::atomic<bool> ApDatabaseSaveBusy(false);
+static std::atomic<bool> ApDatabaseSaveFailed(false);
+// NULL unless tracing is enabled
+static std::unique_ptr<CombainTrace> Trace;
+
+// A request which has been sent to the HTTP thread and the handles of every request waiting for
+// its response. The priority and deadline are those it was sent with, which outlive the request
+// that sent it if that is destroyed while others are still waiting.
+struct InFlightRequest
+{
+    ma_combainLocation_Priority_t priority;
+    uint64_t deadlineUs;
+    std::vector<ma_combainLocation_LocReqHandleRef_t> waiters;
+};
+
+// Requests which have been sent to the HTTP thread, keyed by API key and request body. Identical
+// requests submitted while one is already queued or in flight wait for its response instead of
+// being sent again, as long as it is scheduled at least as well as they would be on their own.
+static std::unordered_map<std::string, InFlightRequest> InFlightRequests;
+// The InFlightRequests key for the handle that each in-flight request was sent with
+static std::unordered_map<ma_combainLocation_LocReqHandleRef_t, std::string> InFlightRequestKeys;
+static uint32_t NumCoalescedRequests;
+
+// Scratch space for checking a whole batch from AppendWifiAccessPoints() or AppendCellTowers()
+// before any of it is appended
+static std::vector<WifiApScanItem> WifiApBatch;
+static std::vector<CellTowerScanItem> CellTowerBatch;
+
+// Compared with the responseEvents count of the HTTP thread to check that responses are batched
+static uint32_t NumResponseEventsHandled;
+static uint32_t NumResponsesDelivered;
+
+// How often the learned AP database is written to flash if it has changed
+#define AP_DATABASE_SAVE_INTERVAL_MS (5 * 60 * 1000)
 
-static ma_combainLocation_LocReqHandleRef_t GenerateHandle(void);
 static RequestRecord* GetRequestRecordFromHandle(
     ma_combainLocation_LocReqHandleRef_t handle, bool matchClientSession);
-static bool TryParseAsSuccess(json_t *responseJson, std::shared_ptr<CombainResult>& result);
-static bool TryParseAsError(json_t *responseJson, std::shared_ptr<CombainResult>& result);
+static bool IsValidCellularTechnology(ma_combainLocation_CellularTech_t cellularTechnology);
+static le_result_t AppendWifiApBatch(
+    RequestRecord *requestRecord,
+    const uint8_t *bssids,
+    size_t bssidsSize,
+    const uint8_t *ssids,
+    size_t ssidsSize,
+    const uint8_t *ssidLengths,
+    size_t ssidLengthsSize,
+    const int16_t *signalStrengths,
+    size_t signalStrengthsSize);
+static le_result_t AppendCellTowerBatch(
+    RequestRecord *requestRecord,
+    const uint8_t *cellularTechnologies,
+    size_t cellularTechnologiesSize,
+    const uint16_t *mccs,
+    size_t mccsSize,
+    const uint16_t *mncs,
+    size_t mncsSize,
+    const uint32_t *lacs,
+    size_t lacsSize,
+    const uint32_t *cellIds,
+    size_t cellIdsSize,
+    const int32_t *signalStrengths,
+    size_t signalStrengthsSize);
+static le_result_t SubmitRequestRecord(RequestRecord *requestRecord, const char *apiKey);
+static void NotifyResult(RequestRecord *requestRecord);
+static void HandleResponse(const CombainHttpResponse &response);
+static void NotifyResultDeferred(void *handlePtr, void *unused);
+static bool TryResolveLocally(RequestRecord *requestRecord, bool isFallback);
+static std::vector<RequestRecord *> TakeWaitingRequests(
+    ma_combainLocation_LocReqHandleRef_t handle);
+static void StopWaiting(RequestRecord *requestRecord);
+static bool CanCoalesce(
+    const InFlightRequest &inFlight, ma_combainLocation_Priority_t priority, uint64_t deadlineUs);
+
+RequestRecord::RequestRecord(void)
+{
+    this->clear();
+}
 
+void RequestRecord::clear(void)
+{
+    this->handle = NULL;
+    this->clientSession = NULL;
+    this->request.clear();
+    this->submitted = false;
+    this->responseHandler = NULL;
+    this->fixHandler = NULL;
+    this->responseHandlerContext = NULL;
+    this->result.clear();
+    this->fingerprint.clear();
+    this->observedAps.clear();
+    this->allocationsAtCreate = 0;
+    this->allocatedBytesAtCreate = 0;
+    this->submitTimeUs = 0;
+    this->apSelection.apsRemoved = 0;
+    this->apSelection.bytesRemoved = 0;
+    this->priority = MA_COMBAINLOCATION_PRIORITY_NORMAL;
+    this->deadlineMs = 0;
+    this->inFlightHandle = NULL;
+}
 
 
 ma_combainLocation_LocReqHandleRef_t ma_combainLocation_CreateLocationRequest
@@ -44,13 +183,19 @@ ma_combainLocation_LocReqHandleRef_t ma_combainLocation_CreateLocationRequest
     void
 )
 {
-    Requests.emplace_back();
-    auto& r = Requests.back();
-    r.handle = GenerateHandle();
-    r.clientSession = ma_combainLocation_GetClientSessionRef();
-    r.request.reset(new CombainRequestBuilder());
+    uintptr_t handle;
+    RequestRecord *r = Requests->create(&handle);
+    if (!r)
+    {
+        LE_WARN("Can't create a request. All %zu request slots are in use.", Requests->capacity());
+        return NULL;
+    }
+    r->handle = reinterpret_cast<ma_combainLocation_LocReqHandleRef_t>(handle);
+    r->clientSession = ma_combainLocation_GetClientSessionRef();
+    r->allocationsAtCreate = CombainAllocCounterGet();
+    r->allocatedBytesAtCreate = CombainAllocCounterGetBytes();
 
-    return r.handle;
+    return r->handle;
 }
 
 le_result_t ma_combainLocation_AppendWifiAccessPoint
@@ -69,22 +214,20 @@ le_result_t ma_combainLocation_AppendWifiAccessPoint
         return LE_BAD_PARAMETER;
     }
 
-    if (!requestRecord->request)
+    if (requestRecord->submitted)
     {
-        // Request builder doesn't exist, must have already been submitted
         return LE_BUSY;
     }
 
-    std::unique_ptr<WifiApScanItem> ap;
     try {
-        ap.reset(new WifiApScanItem(bssid, bssidLen, ssid, ssidLen, signalStrength));
+        requestRecord->request.appendWifiAccessPoint(
+            WifiApScanItem(bssid, bssidLen, ssid, ssidLen, signalStrength));
     }
     catch (std::runtime_error& e)
     {
         LE_ERROR("Failed to append AP info: %s", e.what());
         return LE_BAD_PARAMETER;
     }
-    requestRecord->request->appendWifiAccessPoint(*ap);
 
     return LE_OK;
 }
@@ -99,6 +242,76 @@ le_result_t ma_combainLocation_AppendCellTower
     uint32_t cellId,        ///< Basestation Id for CDMAj
     int32_t signalStrength  ///< Signal strength in dBm
 )
+{
+    RequestRecord *requestRecord = GetRequestRecordFromHandle(handle, true);
+    if (!requestRecord || !IsValidCellularTechnology(cellularTechnology))
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    if (requestRecord->submitted)
+    {
+        return LE_BUSY;
+    }
+
+    requestRecord->request.appendCellTower(
+        CellTowerScanItem{cellularTechnology, mcc, mnc, lac, cellId, signalStrength});
+
+    return LE_OK;
+}
+
+le_result_t ma_combainLocation_AppendWifiAccessPoints
+(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const uint8_t *bssids,
+    size_t bssidsSize,
+    const uint8_t *ssids,
+    size_t ssidsSize,
+    const uint8_t *ssidLengths,
+    size_t ssidLengthsSize,
+    const int16_t *signalStrengths,
+    size_t signalStrengthsSize
+)
+{
+    RequestRecord *requestRecord = GetRequestRecordFromHandle(handle, true);
+    if (!requestRecord)
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    if (requestRecord->submitted)
+    {
+        return LE_BUSY;
+    }
+
+    return AppendWifiApBatch(
+        requestRecord,
+        bssids,
+        bssidsSize,
+        ssids,
+        ssidsSize,
+        ssidLengths,
+        ssidLengthsSize,
+        signalStrengths,
+        signalStrengthsSize);
+}
+
+le_result_t ma_combainLocation_AppendCellTowers
+(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    const uint8_t *cellularTechnologies,
+    size_t cellularTechnologiesSize,
+    const uint16_t *mccs,
+    size_t mccsSize,
+    const uint16_t *mncs,
+    size_t mncsSize,
+    const uint32_t *lacs,
+    size_t lacsSize,
+    const uint32_t *cellIds,
+    size_t cellIdsSize,
+    const int32_t *signalStrengths,
+    size_t signalStrengthsSize
+)
 {
     RequestRecord *requestRecord = GetRequestRecordFromHandle(handle, true);
     if (!requestRecord)
@@ -106,13 +319,50 @@ le_result_t ma_combainLocation_AppendCellTower
         return LE_BAD_PARAMETER;
     }
 
-    if (!requestRecord->request)
+    if (requestRecord->submitted)
+    {
+        return LE_BUSY;
+    }
+
+    return AppendCellTowerBatch(
+        requestRecord,
+        cellularTechnologies,
+        cellularTechnologiesSize,
+        mccs,
+        mccsSize,
+        mncs,
+        mncsSize,
+        lacs,
+        lacsSize,
+        cellIds,
+        cellIdsSize,
+        signalStrengths,
+        signalStrengthsSize);
+}
+
+le_result_t ma_combainLocation_SetSchedulingOptions
+(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    ma_combainLocation_Priority_t priority,
+    uint32_t deadlineMs
+)
+{
+    RequestRecord *requestRecord = GetRequestRecordFromHandle(handle, true);
+    if (!requestRecord ||
+        (priority != MA_COMBAINLOCATION_PRIORITY_LOW &&
+         priority != MA_COMBAINLOCATION_PRIORITY_NORMAL &&
+         priority != MA_COMBAINLOCATION_PRIORITY_HIGH))
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    if (requestRecord->submitted)
     {
-        // Request builder doesn't exist, must have already been submitted
         return LE_BUSY;
     }
 
-    // TODO
+    requestRecord->priority = priority;
+    requestRecord->deadlineMs = deadlineMs;
 
     return LE_OK;
 }
@@ -131,27 +381,93 @@ le_result_t ma_combainLocation_SubmitLocationRequest
         return LE_BAD_PARAMETER;
     }
 
-    if (!requestRecord->request)
+    if (requestRecord->submitted)
     {
-        // Request builder doesn't exist, must have already been submitted
         return LE_BUSY;
     }
 
-    std::string requestBody = requestRecord->request->generateRequestBody();
-    LE_DEBUG("Submitting request: %s", requestBody.c_str());
-    {
-        FILE* f = fopen("request.txt", "w");
-        LE_ASSERT(f != NULL);
-        fwrite(requestBody.c_str(), 1, requestBody.size(), f);
-        fclose(f);
-    }
     requestRecord->responseHandler = responseHandler;
     requestRecord->responseHandlerContext = context;
-    // NULL out the request generator since we're done with it
-    requestRecord->request.reset();
-    std::string apiKeyString(apiKey);
-    RequestJson.enqueue(std::make_tuple(handle, apiKeyString, requestBody));
 
+    return SubmitRequestRecord(requestRecord, apiKey);
+}
+
+le_result_t ma_combainLocation_SubmitScan
+(
+    const uint8_t *bssids,
+    size_t bssidsSize,
+    const uint8_t *ssids,
+    size_t ssidsSize,
+    const uint8_t *ssidLengths,
+    size_t ssidLengthsSize,
+    const int16_t *signalStrengths,
+    size_t signalStrengthsSize,
+    const uint8_t *cellularTechnologies,
+    size_t cellularTechnologiesSize,
+    const uint16_t *mccs,
+    size_t mccsSize,
+    const uint16_t *mncs,
+    size_t mncsSize,
+    const uint32_t *lacs,
+    size_t lacsSize,
+    const uint32_t *cellIds,
+    size_t cellIdsSize,
+    const int32_t *cellSignalStrengths,
+    size_t cellSignalStrengthsSize,
+    const char *apiKey,
+    ma_combainLocation_LocReqHandleRef_t *handlePtr,
+    ma_combainLocation_LocationFixHandlerFunc_t resultHandler,
+    void *context
+)
+{
+    *handlePtr = NULL;
+    ma_combainLocation_LocReqHandleRef_t handle = ma_combainLocation_CreateLocationRequest();
+    if (!handle)
+    {
+        return LE_NO_MEMORY;
+    }
+    RequestRecord *requestRecord = GetRequestRecordFromHandle(handle, false);
+
+    le_result_t res = AppendWifiApBatch(
+        requestRecord,
+        bssids,
+        bssidsSize,
+        ssids,
+        ssidsSize,
+        ssidLengths,
+        ssidLengthsSize,
+        signalStrengths,
+        signalStrengthsSize);
+    if (res == LE_OK)
+    {
+        res = AppendCellTowerBatch(
+            requestRecord,
+            cellularTechnologies,
+            cellularTechnologiesSize,
+            mccs,
+            mccsSize,
+            mncs,
+            mncsSize,
+            lacs,
+            lacsSize,
+            cellIds,
+            cellIdsSize,
+            cellSignalStrengths,
+            cellSignalStrengthsSize);
+    }
+    if (res == LE_OK)
+    {
+        requestRecord->fixHandler = resultHandler;
+        requestRecord->responseHandlerContext = context;
+        res = SubmitRequestRecord(requestRecord, apiKey);
+    }
+
+    if (res != LE_OK)
+    {
+        Requests->destroy(reinterpret_cast<uintptr_t>(handle));
+        return res;
+    }
+    *handlePtr = handle;
     return LE_OK;
 }
 
@@ -160,13 +476,12 @@ void ma_combainLocation_DestroyLocationRequest
     ma_combainLocation_LocReqHandleRef_t handle
 )
 {
-    std::remove_if(
-        Requests.begin(),
-        Requests.end(),
-        [handle] (const RequestRecord& rec) {
-            return handle == rec.handle &&
-                rec.clientSession == ma_combainLocation_GetClientSessionRef();
-        });
+    RequestRecord *requestRecord = GetRequestRecordFromHandle(handle, true);
+    if (requestRecord)
+    {
+        StopWaiting(requestRecord);
+        Requests->destroy(reinterpret_cast<uintptr_t>(handle));
+    }
 }
 
 le_result_t ma_combainLocation_GetSuccessResponse
@@ -183,22 +498,16 @@ le_result_t ma_combainLocation_GetSuccessResponse
         return LE_BAD_PARAMETER;
     }
 
-    auto r = requestRecord->result;
-    if (!r)
-    {
-        return LE_UNAVAILABLE;
-    }
-
-    if (r->getType() != MA_COMBAINLOCATION_RESULT_SUCCESS)
+    const CombainResult &r = requestRecord->result;
+    if (!r.isSet() || r.getType() != MA_COMBAINLOCATION_RESULT_SUCCESS)
     {
         return LE_UNAVAILABLE;
     }
 
-    std::shared_ptr<CombainSuccessResponse> sr = std::static_pointer_cast<CombainSuccessResponse>(r);
-
-    *latitude = sr->latitude;
-    *longitude = sr->longitude;
-    *accuracyInMeters = sr->accuracyInMeters;
+    const CombainSuccessResponse &sr = r.getSuccess();
+    *latitude = sr.latitude;
+    *longitude = sr.longitude;
+    *accuracyInMeters = sr.accuracyInMeters;
 
     ma_combainLocation_DestroyLocationRequest(handle);
 
@@ -225,35 +534,18 @@ le_result_t ma_combainLocation_GetErrorResponse
         return LE_BAD_PARAMETER;
     }
 
-    auto r = requestRecord->result;
-    if (!r)
+    const CombainResult &r = requestRecord->result;
+    if (!r.isSet() || r.getType() != MA_COMBAINLOCATION_RESULT_ERROR)
     {
         return LE_UNAVAILABLE;
     }
 
-    if (r->getType() != MA_COMBAINLOCATION_RESULT_ERROR)
-    {
-        return LE_UNAVAILABLE;
-    }
-
-    std::shared_ptr<CombainErrorResponse> er = std::static_pointer_cast<CombainErrorResponse>(r);
-
-    *code = er->code;
-    strncpy(message, er->message.c_str(), messageLen - 1);
-    message[messageLen - 1] = '\0';
-
-    auto it = er->errors.begin();
-    if (it != er->errors.end())
-    {
-        strncpy(firstDomain, it->domain.c_str(), firstDomainLen - 1);
-        firstDomain[firstDomainLen - 1] = '\0';
-
-        strncpy(firstReason, it->reason.c_str(), firstReasonLen - 1);
-        firstReason[firstReasonLen - 1] = '\0';
-
-        strncpy(firstMessage, it->message.c_str(), firstMessageLen - 1);
-        firstMessage[firstMessageLen - 1] = '\0';
-    }
+    const CombainErrorResponse &er = r.getError();
+    *code = er.code;
+    le_utf8_Copy(message, er.message, messageLen, NULL);
+    le_utf8_Copy(firstDomain, er.firstError.domain, firstDomainLen, NULL);
+    le_utf8_Copy(firstReason, er.firstError.reason, firstReasonLen, NULL);
+    le_utf8_Copy(firstMessage, er.firstError.message, firstMessageLen, NULL);
 
     ma_combainLocation_DestroyLocationRequest(handle);
 
@@ -274,28 +566,106 @@ le_result_t ma_combainLocation_GetParseFailureResult
         return LE_BAD_PARAMETER;
     }
 
-    auto r = requestRecord->result;
-    if (!r)
+    const CombainResult &r = requestRecord->result;
+    if (!r.isSet() || r.getType() != MA_COMBAINLOCATION_RESULT_RESPONSE_PARSE_FAILURE)
     {
         return LE_UNAVAILABLE;
     }
 
-    if (r->getType() != MA_COMBAINLOCATION_RESULT_RESPONSE_PARSE_FAILURE)
+    le_utf8_Copy(unparsedResponse, r.getParseFailure().unparsed, unparsedResponseLen, NULL);
+
+    return LE_OK;
+}
+
+void ma_combainLocation_GetStats
+(
+    uint32_t *requests,
+    uint32_t *serverRequests,
+    uint32_t *resultCounts,
+    size_t *resultCountsSize,
+    uint64_t *bytesOut,
+    uint64_t *bytesIn,
+    uint64_t *uncompressedBytesOut,
+    uint64_t *uncompressedBytesIn,
+    uint32_t *apsRemoved,
+    uint64_t *bytesRemoved
+)
+{
+    CombainStatsGetCounters(
+        requests,
+        serverRequests,
+        resultCounts,
+        resultCountsSize,
+        bytesOut,
+        bytesIn,
+        uncompressedBytesOut,
+        uncompressedBytesIn,
+        apsRemoved,
+        bytesRemoved);
+}
+
+le_result_t ma_combainLocation_GetApSelectionResult
+(
+    ma_combainLocation_LocReqHandleRef_t handle,
+    uint32_t *apsRemoved,
+    uint32_t *bytesRemoved
+)
+{
+    RequestRecord *requestRecord = GetRequestRecordFromHandle(handle, true);
+    if (!requestRecord)
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    if (!requestRecord->submitted)
     {
         return LE_UNAVAILABLE;
     }
 
-    std::shared_ptr<CombainResponseParseFailure> rpf =
-        std::static_pointer_cast<CombainResponseParseFailure>(r);
-
-    strncpy(
-        unparsedResponse,
-        rpf->unparsed.c_str(),
-        std::min(rpf->unparsed.length() + 1, unparsedResponseLen + 1));
+    *apsRemoved = requestRecord->apSelection.apsRemoved;
+    *bytesRemoved = requestRecord->apSelection.bytesRemoved;
 
     return LE_OK;
 }
 
+void ma_combainLocation_GetConnectionStats
+(
+    ma_combainLocation_CircuitState_t *circuitState,
+    uint32_t *consecutiveFailures,
+    uint32_t *circuitTrips,
+    uint32_t *retries,
+    uint32_t *fastFailures,
+    uint32_t *cancelled,
+    uint32_t *connectionsOpened,
+    uint32_t *connectionsReused,
+    uint32_t *http2Requests
+)
+{
+    const CombainHttpStats s = CombainHttpGetStats();
+    *circuitState = s.circuitState;
+    *consecutiveFailures = s.consecutiveFailures;
+    *circuitTrips = s.circuitTrips;
+    *retries = s.retries;
+    *fastFailures = s.fastFailures;
+    *cancelled = s.cancelled;
+    *connectionsOpened = s.connectionsOpened;
+    *connectionsReused = s.connectionsReused;
+    *http2Requests = s.http2Requests;
+}
+
+le_result_t ma_combainLocation_GetLatencyHistogram
+(
+    ma_combainLocation_Stage_t stage,
+    uint32_t *bucketCounts,
+    size_t *bucketCountsSize,
+    uint32_t *count,
+    uint64_t *totalMicroseconds
+)
+{
+    return CombainStatsGetLatencyHistogram(
+        stage, bucketCounts, bucketCountsSize, count, totalMicroseconds);
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * A handler for client disconnects which frees all resources associated with the client.
@@ -307,137 +677,614 @@ static void ClientSessionClosedHandler
     void* context
 )
 {
-    std::remove_if(
-        Requests.begin(),
-        Requests.end(),
-        [clientSession] (const RequestRecord& rec) {
-            return rec.clientSession == clientSession;
+    Requests->destroyIf(
+        [clientSession] (RequestRecord& rec) {
+            if (rec.clientSession != clientSession)
+            {
+                return false;
+            }
+            StopWaiting(&rec);
+            return true;
         });
 }
 
-static ma_combainLocation_LocReqHandleRef_t GenerateHandle(void)
+static RequestRecord* GetRequestRecordFromHandle(
+    ma_combainLocation_LocReqHandleRef_t handle, bool matchClientSession)
 {
-    static uint32_t next = 1;
+    RequestRecord *r = Requests->lookup(reinterpret_cast<uintptr_t>(handle));
+    if (r && matchClientSession && r->clientSession != ma_combainLocation_GetClientSessionRef())
+    {
+        return NULL;
+    }
+    return r;
+}
 
-    ma_combainLocation_LocReqHandleRef_t h = (ma_combainLocation_LocReqHandleRef_t)next;
-    next += 2;
-    return h;
+static bool IsValidCellularTechnology(ma_combainLocation_CellularTech_t cellularTechnology)
+{
+    switch (cellularTechnology)
+    {
+    case MA_COMBAINLOCATION_CELL_TECH_GSM:
+    case MA_COMBAINLOCATION_CELL_TECH_CDMA:
+    case MA_COMBAINLOCATION_CELL_TECH_LTE:
+    case MA_COMBAINLOCATION_CELL_TECH_WCDMA:
+        return true;
+
+    default:
+        return false;
+    }
 }
 
-static RequestRecord* GetRequestRecordFromHandle(
-    ma_combainLocation_LocReqHandleRef_t handle, bool matchClientSession)
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Appends APs packed as for AppendWifiAccessPoints(). Every AP is checked before any is appended.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t AppendWifiApBatch
+(
+    RequestRecord *requestRecord,
+    const uint8_t *bssids,
+    size_t bssidsSize,
+    const uint8_t *ssids,
+    size_t ssidsSize,
+    const uint8_t *ssidLengths,
+    size_t ssidLengthsSize,
+    const int16_t *signalStrengths,
+    size_t signalStrengthsSize
+)
 {
-    auto it = std::find_if(
-        Requests.begin(),
-        Requests.end(),
-        [handle, matchClientSession] (const RequestRecord& r) -> bool {
-            return (
-                r.handle == handle && (
-                    !matchClientSession ||
-                    r.clientSession == ma_combainLocation_GetClientSessionRef()));
-        });
-    return (it == Requests.end()) ? NULL : &(*it);
+    const size_t numAps = signalStrengthsSize;
+    if (ssidLengthsSize != numAps || bssidsSize != numAps * MA_COMBAINLOCATION_WIFI_BSSID_BYTES)
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    WifiApBatch.clear();
+    size_t ssidOffset = 0;
+    try {
+        for (size_t i = 0; i < numAps; i++)
+        {
+            if (ssidLengths[i] > ssidsSize - ssidOffset)
+            {
+                throw std::runtime_error("SSID lengths exceed the SSID bytes given");
+            }
+            WifiApBatch.push_back(
+                WifiApScanItem(
+                    &bssids[i * MA_COMBAINLOCATION_WIFI_BSSID_BYTES],
+                    MA_COMBAINLOCATION_WIFI_BSSID_BYTES,
+                    &ssids[ssidOffset],
+                    ssidLengths[i],
+                    signalStrengths[i]));
+            ssidOffset += ssidLengths[i];
+        }
+    }
+    catch (std::runtime_error& e)
+    {
+        LE_ERROR("Failed to append AP info: %s", e.what());
+        return LE_BAD_PARAMETER;
+    }
+    if (ssidOffset != ssidsSize)
+    {
+        LE_ERROR("Failed to append AP info: SSID bytes left over after the last AP");
+        return LE_BAD_PARAMETER;
+    }
+
+    requestRecord->request.appendWifiAccessPoints(WifiApBatch);
+    return LE_OK;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Appends towers packed as for AppendCellTowers(). Every tower is checked before any is appended.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t AppendCellTowerBatch
+(
+    RequestRecord *requestRecord,
+    const uint8_t *cellularTechnologies,
+    size_t cellularTechnologiesSize,
+    const uint16_t *mccs,
+    size_t mccsSize,
+    const uint16_t *mncs,
+    size_t mncsSize,
+    const uint32_t *lacs,
+    size_t lacsSize,
+    const uint32_t *cellIds,
+    size_t cellIdsSize,
+    const int32_t *signalStrengths,
+    size_t signalStrengthsSize
+)
+{
+    const size_t numTowers = signalStrengthsSize;
+    if (cellularTechnologiesSize != numTowers || mccsSize != numTowers || mncsSize != numTowers ||
+        lacsSize != numTowers || cellIdsSize != numTowers)
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    CellTowerBatch.clear();
+    for (size_t i = 0; i < numTowers; i++)
+    {
+        const auto cellularTechnology =
+            static_cast<ma_combainLocation_CellularTech_t>(cellularTechnologies[i]);
+        if (!IsValidCellularTechnology(cellularTechnology))
+        {
+            LE_ERROR("Failed to append cell tower: invalid technology %u", cellularTechnologies[i]);
+            return LE_BAD_PARAMETER;
+        }
+        CellTowerBatch.push_back(
+            CellTowerScanItem{
+                cellularTechnology, mccs[i], mncs[i], lacs[i], cellIds[i], signalStrengths[i]});
+    }
+
+    requestRecord->request.appendCellTowers(CellTowerBatch);
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Submits a request which has been built but not yet submitted, and whose result handler has been
+ * set. The result comes from the result cache, the AP database, an identical request which is
+ * already in flight or the server, in that order of preference.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t SubmitRequestRecord(RequestRecord *requestRecord, const char *apiKey)
+{
+    const ma_combainLocation_LocReqHandleRef_t handle = requestRecord->handle;
+    requestRecord->submitTimeUs = CombainStatsNowUs();
+    CombainStatsCountRequest();
+
+    // Before anything looks at the scan, so that the cache, the AP database and the server all see
+    // the same APs. Selecting again after a failed submission removes nothing more.
+    const CombainApSelectionStats selection =
+        requestRecord->request.selectWifiAccessPoints(ApSelectionPolicy);
+    if (selection.apsRemoved != 0)
+    {
+        LE_DEBUG(
+            "AP selection removed %u APs, saving %u bytes",
+            selection.apsRemoved,
+            selection.bytesRemoved);
+        requestRecord->apSelection.apsRemoved += selection.apsRemoved;
+        requestRecord->apSelection.bytesRemoved += selection.bytesRemoved;
+        CombainStatsCountApSelection(selection.apsRemoved, selection.bytesRemoved);
+    }
+
+    if (ResultCache->isEnabled())
+    {
+        requestRecord->request.generateFingerprint(&requestRecord->fingerprint);
+        CombainSuccessResponse cached;
+        const bool isCached = ResultCache->lookup(requestRecord->fingerprint, &cached);
+        const CombainResultCache::Stats cacheStats = ResultCache->getStats();
+        LE_DEBUG("Result cache hits=%u, misses=%u", cacheStats.hits, cacheStats.misses);
+        if (isCached)
+        {
+            LE_DEBUG("Using cached result for request");
+            requestRecord->submitted = true;
+            requestRecord->result.setSuccess(
+                cached.latitude, cached.longitude, cached.accuracyInMeters);
+            // The client doesn't expect the handler to be called until this function has returned
+            le_event_QueueFunction(NotifyResultDeferred, handle, NULL);
+            return LE_OK;
+        }
+    }
+
+    if (ApDatabase->isEnabled())
+    {
+        CombainApDatabase::observe(
+            requestRecord->request.getWifiAccessPoints(), &requestRecord->observedAps);
+        if (Config.apDatabasePreferLocal && TryResolveLocally(requestRecord, false))
+        {
+            LE_DEBUG("Resolved request from the learned AP database");
+            requestRecord->submitted = true;
+            le_event_QueueFunction(NotifyResultDeferred, handle, NULL);
+            return LE_OK;
+        }
+    }
+
+    std::string requestBody = requestRecord->request.generateRequestBody();
+    LE_DEBUG("Submitting request: %s", requestBody.c_str());
+    if (Trace)
+    {
+        Trace->record(
+            CombainTrace::RECORD_REQUEST, handle, requestBody.data(), requestBody.size(), 0);
+    }
+    std::string apiKeyString(apiKey);
+
+    const uint64_t deadlineUs = requestRecord->deadlineMs == 0 ?
+        0 :
+        requestRecord->submitTimeUs + requestRecord->deadlineMs * 1000ULL;
+
+    std::string requestKey = apiKeyString + '\n' + requestBody;
+    auto inFlight = InFlightRequests.find(requestKey);
+    const bool isDuplicate = (inFlight != InFlightRequests.end());
+    if (isDuplicate && CanCoalesce(inFlight->second, requestRecord->priority, deadlineUs))
+    {
+        // Every handle in the list is live, as destroyed requests stop waiting
+        RequestRecord *waiter = GetRequestRecordFromHandle(inFlight->second.waiters.front(), false);
+        LE_ASSERT(waiter && waiter->inFlightHandle);
+        requestRecord->submitted = true;
+        requestRecord->inFlightHandle = waiter->inFlightHandle;
+        inFlight->second.waiters.push_back(handle);
+        NumCoalescedRequests++;
+        LE_DEBUG(
+            "Request is identical to one in flight. %u requests coalesced so far.",
+            NumCoalescedRequests);
+        return LE_OK;
+    }
+    if (!RequestJson.tryPush(
+            CombainHttpRequest{
+                handle,
+                std::move(apiKeyString),
+                std::move(requestBody),
+                requestRecord->submitTimeUs,
+                requestRecord->priority,
+                deadlineUs}))
+    {
+        LE_WARN("Request queue is full");
+        return LE_NO_MEMORY;
+    }
+    requestRecord->submitted = true;
+    requestRecord->inFlightHandle = handle;
+    if (isDuplicate)
+    {
+        // Sent on its own. Later duplicates keep coalescing onto the request already in flight.
+        LE_DEBUG("Request is identical to one in flight, but needs an earlier or higher slot");
+    }
+    else
+    {
+        InFlightRequestKeys.emplace(handle, requestKey);
+        InFlightRequests.emplace(
+            std::move(requestKey),
+            InFlightRequest{requestRecord->priority, deadlineUs, {handle}});
+    }
+    CombainHttpWakeup();
+
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Delivers every response waiting in ResponseJson. The HTTP thread doesn't report the event again
+ * until this has run, so a burst of responses is handled in one pass.
+ */
+//--------------------------------------------------------------------------------------------------
 static void HandleResponseAvailable(void *reportPayload)
 {
-    auto t = ResponseJson.dequeue();
-    ma_combainLocation_LocReqHandleRef_t handle = std::get<0>(t);
-    std::string responseJsonStr = std::get<1>(t);
+    // Kept between calls so that draining doesn't allocate
+    static std::vector<CombainHttpResponse> responses;
 
-    RequestRecord *requestRecord = GetRequestRecordFromHandle(handle, false);
-    if (!requestRecord)
+    CombainHttpAckResponseEvent();
+    const size_t numResponses = ResponseJson.drain(responses, ResponseJson.capacity());
+    if (numResponses == ResponseJson.capacity())
+    {
+        // The channel was full, so the HTTP thread may be holding responses back
+        CombainHttpWakeup();
+    }
+
+    NumResponseEventsHandled++;
+    NumResponsesDelivered += numResponses;
+    LE_DEBUG(
+        "Handling %zu responses. %u responses delivered in %u events so far.",
+        numResponses,
+        NumResponsesDelivered,
+        NumResponseEventsHandled);
+
+    for (auto &response : responses)
+    {
+        CombainStatsRecordLatency(
+            MA_COMBAINLOCATION_STAGE_DELIVERY, CombainStatsNowUs() - response.completeTimeUs);
+        HandleResponse(response);
+    }
+    responses.clear();
+}
+
+static void HandleResponse(const CombainHttpResponse &response)
+{
+    const ma_combainLocation_LocReqHandleRef_t handle = response.handle;
+    if (Trace)
+    {
+        Trace->record(
+            CombainTrace::RECORD_RESPONSE,
+            handle,
+            response.body.data(),
+            response.body.size(),
+            0);
+    }
+
+    std::vector<RequestRecord *> waiting = TakeWaitingRequests(handle);
+    if (waiting.empty())
     {
         // Just do nothing the request no longer exists
         LE_WARN("Received a response for an invalid handle");
         return;
     }
 
+    // All of the waiting requests have the same body, so any of them can stand in for the others
+    // when parsing the response and learning from it.
+    RequestRecord *requestRecord = waiting.front();
+
     // There should never be a previous result
-    LE_ASSERT(!requestRecord->result);
+    LE_ASSERT(!requestRecord->result.isSet());
 
-    // TODO: This is a bit gross that we're using an empty response to signal a communication
-    // failure. We may wish to be more expressive about why the communication failed.
-    if (responseJsonStr.empty())
+    bool resolvedLocally = false;
+    if (response.status == CombainHttpResponse::DEADLINE_EXPIRED)
     {
-        requestRecord->result.reset(new CombainCommunicationFailure());
+        requestRecord->result.setTimeout();
+    }
+    else if (response.status == CombainHttpResponse::COMMUNICATION_FAILURE)
+    {
+        resolvedLocally = TryResolveLocally(requestRecord, true);
+        if (resolvedLocally)
+        {
+            LE_INFO("Combain server unreachable. Using a position from the learned AP database.");
+        }
+        else
+        {
+            requestRecord->result.setCommunicationFailure();
+        }
     }
     else
     {
-        // try to parse the response as json
-        json_error_t loadError;
-        const size_t loadFlags = 0;
-        json_t *responseJson = json_loads(responseJsonStr.c_str(), loadFlags, &loadError);
-        if (responseJson == NULL)
+        const uint64_t parseStartUs = CombainStatsNowUs();
+        CombainParseResponse(response.body, &requestRecord->result);
+        CombainStatsRecordLatency(
+            MA_COMBAINLOCATION_STAGE_PARSE, CombainStatsNowUs() - parseStartUs);
+    }
+
+    if (!resolvedLocally && requestRecord->result.getType() == MA_COMBAINLOCATION_RESULT_SUCCESS)
+    {
+        const CombainSuccessResponse &success = requestRecord->result.getSuccess();
+        if (!requestRecord->fingerprint.empty())
         {
-            requestRecord->result.reset(new CombainResponseParseFailure(responseJsonStr));
+            ResultCache->insert(requestRecord->fingerprint, success);
         }
-        else if (!TryParseAsSuccess(responseJson, requestRecord->result) &&
-                 !TryParseAsError(responseJson, requestRecord->result))
+        ApDatabase->learn(requestRecord->observedAps, success);
+    }
+
+    for (auto r : waiting)
+    {
+        if (r != requestRecord)
         {
-            requestRecord->result.reset(new CombainResponseParseFailure(responseJsonStr));
+            LE_ASSERT(!r->result.isSet());
+            r->result = requestRecord->result;
         }
+    }
+    // Only once every result is set, as notifying may destroy a request
+    for (auto r : waiting)
+    {
+        NotifyResult(r);
+    }
+}
 
-        json_decref(responseJson);
+//--------------------------------------------------------------------------------------------------
+/**
+ * Removes the in-flight entry for the request that was sent to the server with the given handle.
+ *
+ * @return the records of every request still waiting for the response
+ */
+//--------------------------------------------------------------------------------------------------
+static std::vector<RequestRecord *> TakeWaitingRequests(
+    ma_combainLocation_LocReqHandleRef_t handle)
+{
+    std::vector<ma_combainLocation_LocReqHandleRef_t> handles;
+    auto keyIt = InFlightRequestKeys.find(handle);
+    if (keyIt == InFlightRequestKeys.end())
+    {
+        handles.push_back(handle);
+    }
+    else
+    {
+        auto waitersIt = InFlightRequests.find(keyIt->second);
+        LE_ASSERT(waitersIt != InFlightRequests.end());
+        handles.swap(waitersIt->second.waiters);
+        InFlightRequests.erase(waitersIt);
+        InFlightRequestKeys.erase(keyIt);
     }
 
-    requestRecord->responseHandler(
-        handle, requestRecord->result->getType(), requestRecord->responseHandlerContext);
+    std::vector<RequestRecord *> waiting;
+    for (auto h : handles)
+    {
+        RequestRecord *r = GetRequestRecordFromHandle(h, false);
+        if (r)
+        {
+            r->inFlightHandle = NULL;
+            waiting.push_back(r);
+        }
+    }
+    return waiting;
 }
 
-static bool TryParseAsError(json_t *responseJson, std::shared_ptr<CombainResult>& result)
+//--------------------------------------------------------------------------------------------------
+/**
+ * Called when a request is destroyed. If it was the last request waiting for an HTTP request, the
+ * HTTP thread is told to drop it, whether it is still queued or already in flight. A request which
+ * was sent on its own, rather than coalesced, is the only one waiting for it.
+ */
+//--------------------------------------------------------------------------------------------------
+static void StopWaiting(RequestRecord *requestRecord)
 {
-    const char *domain;
-    const char *reason;
-    const char *errorMessage;
-    int code;
-    const char *message;
-    const int errorUnpackRes = json_unpack(
-        responseJson,
-        "{s:{s:{s:s,s:s,s:s},s:i,s:s}}",
-        "error",
-        "errors",
-        "domain",
-        &domain,
-        "reason",
-        &reason,
-        "message",
-        &errorMessage,
-        "code",
-        &code,
-        "message",
-        &message);
-    const bool parseSuccess = (errorUnpackRes == 0);
-    if (parseSuccess)
+    ma_combainLocation_LocReqHandleRef_t inFlightHandle = requestRecord->inFlightHandle;
+    if (!inFlightHandle)
+    {
+        return;
+    }
+    requestRecord->inFlightHandle = NULL;
+
+    auto keyIt = InFlightRequestKeys.find(inFlightHandle);
+    if (keyIt != InFlightRequestKeys.end())
     {
-        result.reset(new CombainErrorResponse(code, message, {{domain, reason, errorMessage}}));
+        auto waitersIt = InFlightRequests.find(keyIt->second);
+        LE_ASSERT(waitersIt != InFlightRequests.end());
+        auto &waiters = waitersIt->second.waiters;
+        waiters.erase(
+            std::remove(waiters.begin(), waiters.end(), requestRecord->handle), waiters.end());
+        if (!waiters.empty())
+        {
+            return;
+        }
+
+        InFlightRequests.erase(waitersIt);
+        InFlightRequestKeys.erase(keyIt);
+    }
+    if (!CancelledRequests.tryPush(std::move(inFlightHandle)))
+    {
+        LE_WARN("Cancellation queue is full. The request's response will be discarded instead.");
+        return;
     }
+    CombainHttpWakeup();
+}
 
-    return parseSuccess;
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks whether a request may wait for an identical one which is already queued or in flight.
+ *
+ * The HTTP thread only uses the priority and deadline while the request is queued, so waiting must
+ * neither leave the new request behind others it would have been sent before, nor have it dropped
+ * when the first request's deadline passes while the new request's hasn't.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool CanCoalesce(
+    const InFlightRequest &inFlight, ma_combainLocation_Priority_t priority, uint64_t deadlineUs)
+{
+    // No deadline sorts after every deadline and never expires
+    const uint64_t inFlightDeadline = inFlight.deadlineUs != 0 ? inFlight.deadlineUs : UINT64_MAX;
+    const uint64_t deadline = deadlineUs != 0 ? deadlineUs : UINT64_MAX;
+    if (inFlight.priority < priority || inFlightDeadline < deadline)
+    {
+        return false;
+    }
+    // At the same priority, a later deadline would be scheduled later
+    return inFlight.priority > priority || inFlightDeadline == deadline;
 }
 
-static bool TryParseAsSuccess(json_t *responseJson, std::shared_ptr<CombainResult>& result)
+//--------------------------------------------------------------------------------------------------
+/**
+ * Tries to produce a success result for a request from the learned AP database.
+ *
+ * @return true if requestRecord->result was set
+ */
+//--------------------------------------------------------------------------------------------------
+static bool TryResolveLocally(RequestRecord *requestRecord, bool isFallback)
 {
     double latitude;
     double longitude;
-    int accuracy;
-    const int successUnpackRes = json_unpack(
-        responseJson,
-        "{s:{s:F,s:F},s:i}",
-        "location",
-        "lat",
-        &latitude,
-        "lng",
-        &longitude,
-        "accuracy",
-        &accuracy);
-    const bool parseSuccess = (successUnpackRes == 0);
-    if (parseSuccess)
+    double accuracyInMeters;
+    if (!ApDatabase->estimate(
+            requestRecord->observedAps, isFallback, &latitude, &longitude, &accuracyInMeters))
     {
-        result.reset(new CombainSuccessResponse(latitude, longitude, accuracy));
+        return false;
     }
 
-    return parseSuccess;
+    requestRecord->result.setSuccess(latitude, longitude, accuracyInMeters);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Runs on the AP database save thread and writes a snapshot taken by SaveApDatabase().
+ */
+//--------------------------------------------------------------------------------------------------
+static void WriteApDatabase(void *imagePtr, void *unused)
+{
+    std::unique_ptr<std::string> image(static_cast<std::string *>(imagePtr));
+    const bool failed =
+        (CombainApDatabase::writeFile(Config.apDatabasePath, *image) != LE_OK);
+    if (failed)
+    {
+        LE_WARN("Couldn't save the AP database to \"%s\"", Config.apDatabasePath);
+    }
+    ApDatabaseSaveFailed.store(failed);
+    ApDatabaseSaveBusy.store(false);
+}
+
+static void *ApDatabaseSaveThreadFunc(void *context)
+{
+    le_event_RunLoop();
+    return NULL;
+}
+
+static void SaveApDatabase(le_timer_Ref_t timer)
+{
+    // A failed save leaves the database clean, so retry it even if nothing has been learned since
+    if (ApDatabaseSaveBusy.load() || !(ApDatabase->isDirty() || ApDatabaseSaveFailed.load()))
+    {
+        return;
+    }
+
+    // Only the snapshot is taken here. The file is written on the save thread.
+    std::unique_ptr<std::string> image(new std::string());
+    ApDatabase->serialize(image.get());
+    ApDatabaseSaveBusy.store(true);
+    le_event_QueueFunctionToThread(ApDatabaseSaveThread, WriteApDatabase, image.release(), NULL);
+}
+
+static void NotifyResult(RequestRecord *requestRecord)
+{
+#ifdef COMBAIN_COUNT_ALLOCATIONS
+    LE_DEBUG(
+        "Request made %" PRIu64 " heap allocations totalling %" PRIu64 " bytes",
+        CombainAllocCounterGet() - requestRecord->allocationsAtCreate,
+        CombainAllocCounterGetBytes() - requestRecord->allocatedBytesAtCreate);
+#endif
+    const ma_combainLocation_Result_t result = requestRecord->result.getType();
+    if (Trace)
+    {
+        Trace->record(CombainTrace::RECORD_RESULT, requestRecord->handle, NULL, 0, result);
+    }
+    CombainStatsCountResult(result);
+
+    const uint64_t callbackStartUs = CombainStatsNowUs();
+    CombainStatsRecordLatency(
+        MA_COMBAINLOCATION_STAGE_TOTAL, callbackStartUs - requestRecord->submitTimeUs);
+    if (requestRecord->fixHandler)
+    {
+        // The fix is passed inline. For other results the client fetches the details as it would
+        // for a LocationResultHandler.
+        CombainSuccessResponse fix = {0.0, 0.0, 0.0};
+        if (result == MA_COMBAINLOCATION_RESULT_SUCCESS)
+        {
+            fix = requestRecord->result.getSuccess();
+        }
+        requestRecord->fixHandler(
+            requestRecord->handle,
+            result,
+            fix.latitude,
+            fix.longitude,
+            fix.accuracyInMeters,
+            requestRecord->responseHandlerContext);
+    }
+    else
+    {
+        requestRecord->responseHandler(
+            requestRecord->handle, result, requestRecord->responseHandlerContext);
+    }
+    CombainStatsRecordLatency(
+        MA_COMBAINLOCATION_STAGE_CALLBACK, CombainStatsNowUs() - callbackStartUs);
+
+    if (requestRecord->fixHandler && result == MA_COMBAINLOCATION_RESULT_SUCCESS)
+    {
+        // The client already has everything there is to know about the fix
+        Requests->destroy(reinterpret_cast<uintptr_t>(requestRecord->handle));
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Notifies the client of a result which was available immediately on submission, from the event
+ * loop rather than from within the submit call.
+ */
+//--------------------------------------------------------------------------------------------------
+static void NotifyResultDeferred(void *handlePtr, void *unused)
+{
+    auto handle = reinterpret_cast<ma_combainLocation_LocReqHandleRef_t>(handlePtr);
+    RequestRecord *requestRecord = GetRequestRecordFromHandle(handle, false);
+    if (!requestRecord)
+    {
+        // The client destroyed the request before the result was delivered
+        return;
+    }
+
+    NotifyResult(requestRecord);
 }
 
 COMPONENT_INIT
@@ -449,7 +1296,48 @@ COMPONENT_INIT
     le_msg_AddServiceCloseHandler(
         ma_combainLocation_GetServiceRef(), ClientSessionClosedHandler, NULL);
 
-    CombainHttpInit(&RequestJson, &ResponseJson, ResponseAvailableEvent);
+    CombainConfigLoad(&Config);
+    Requests.reset(new HandleTable<RequestRecord>(Config.maxRequests));
+    ApSelectionPolicy.dedupe = Config.apSelectionDedupe;
+    ApSelectionPolicy.dropRandomizedMacs = Config.apSelectionDropRandomizedMacs;
+    ApSelectionPolicy.minSignalStrength = Config.apSelectionMinSignalDbm;
+    ApSelectionPolicy.maxAps = Config.apSelectionMaxAps;
+    ResultCache.reset(
+        new CombainResultCache(Config.resultCacheCapacity, Config.resultCacheTtlSeconds));
+
+    ApDatabase.reset(new CombainApDatabase(
+        Config.apDatabaseCapacity,
+        Config.apDatabaseMinKnownAps,
+        Config.apDatabaseMinKnownPercent,
+        Config.apDatabaseMaxAgeSeconds));
+    if (ApDatabase->isEnabled() && Config.apDatabasePath[0] != '\0')
+    {
+        const le_result_t loadRes = ApDatabase->load(Config.apDatabasePath);
+        if (loadRes != LE_OK && loadRes != LE_NOT_FOUND)
+        {
+            LE_WARN("Couldn't load the AP database from \"%s\"", Config.apDatabasePath);
+        }
+        LE_INFO("Loaded %u APs from the AP database", ApDatabase->getStats().size);
+
+        ApDatabaseSaveThread =
+            le_thread_Create("CombainApDatabaseSave", ApDatabaseSaveThreadFunc, NULL);
+        le_thread_Start(ApDatabaseSaveThread);
+        le_timer_Ref_t saveTimer = le_timer_Create("CombainApDatabaseSave");
+        LE_ASSERT_OK(le_timer_SetHandler(saveTimer, SaveApDatabase));
+        LE_ASSERT_OK(le_timer_SetMsInterval(saveTimer, AP_DATABASE_SAVE_INTERVAL_MS));
+        LE_ASSERT_OK(le_timer_SetRepeat(saveTimer, 0));
+        LE_ASSERT_OK(le_timer_Start(saveTimer));
+    }
+
+    if (Config.traceEnabled)
+    {
+        Trace.reset(
+            new CombainTrace(Config.tracePath, Config.traceBufferBytes, Config.traceMaxFileBytes));
+        Trace->start();
+    }
+
+    CombainHttpInit(
+        &RequestJson, &ResponseJson, &CancelledRequests, ResponseAvailableEvent, Config);
     le_thread_Ref_t httpThread = le_thread_Create("CombainHttp", CombainHttpThreadFunc, NULL);
     le_thread_Start(httpThread);
 }
@@ -2,6 +2,7 @@
 #include "interfaces.h"
 
 #include <stdio.h>
+#include <string.h>
 
 static struct
 {
@@ -9,6 +10,7 @@ static struct
     bool useWifi;
     bool useCellular;
     const char *combainApiKey;
+    const char *command;
 } CliArgs;
 
 static struct
@@ -24,6 +26,181 @@ static void Usage(FILE *stream)
     fprintf(stream, "Usage: ");
     fprintf(stream, le_arg_GetProgramName());
     fprintf(stream, "[-h|--help] [-k|--api-key <KEY>][-w|--wifi] [-c|--cellular]\n");
+    fprintf(stream, "       ");
+    fprintf(stream, le_arg_GetProgramName());
+    fprintf(stream, " stats\n");
+}
+
+static void CommandArgHandler(const char *arg)
+{
+    CliArgs.command = arg;
+}
+
+static const char *StageName(ma_combainLocation_Stage_t stage)
+{
+    switch (stage)
+    {
+    case MA_COMBAINLOCATION_STAGE_QUEUE:      return "queue";
+    case MA_COMBAINLOCATION_STAGE_DNS:        return "dns";
+    case MA_COMBAINLOCATION_STAGE_CONNECT:    return "connect";
+    case MA_COMBAINLOCATION_STAGE_TLS:        return "tls";
+    case MA_COMBAINLOCATION_STAGE_FIRST_BYTE: return "firstByte";
+    case MA_COMBAINLOCATION_STAGE_TRANSFER:   return "transfer";
+    case MA_COMBAINLOCATION_STAGE_DELIVERY:   return "delivery";
+    case MA_COMBAINLOCATION_STAGE_PARSE:      return "parse";
+    case MA_COMBAINLOCATION_STAGE_CALLBACK:   return "callback";
+    case MA_COMBAINLOCATION_STAGE_TOTAL:      return "total";
+    default:                                  return "unknown";
+    }
+}
+
+// Formats the upper bound of the histogram bucket which the given fraction of measurements fall in
+static void FormatPercentile(
+    const uint32_t *bucketCounts,
+    size_t numBuckets,
+    uint32_t count,
+    double fraction,
+    char *out,
+    size_t outLen)
+{
+    const double target = fraction * count;
+    uint32_t cumulative = 0;
+    size_t i;
+    for (i = 0; i < numBuckets - 1; i++)
+    {
+        cumulative += bucketCounts[i];
+        if (cumulative >= target)
+        {
+            break;
+        }
+    }
+
+    // Bucket 0 has an upper bound of 32us, the bound doubles with each bucket and the last bucket
+    // has no upper bound
+    if (i == numBuckets - 1)
+    {
+        snprintf(out, outLen, ">%.0f", (32ULL << (i - 1)) / 1000.0);
+    }
+    else
+    {
+        snprintf(out, outLen, "%.3f", (32ULL << i) / 1000.0);
+    }
+}
+
+static void PrintStats(void)
+{
+    uint32_t requests;
+    uint32_t serverRequests;
+    uint32_t resultCounts[MA_COMBAINLOCATION_MAX_RESULT_TYPES] = {0};
+    size_t resultCountsSize = MA_COMBAINLOCATION_MAX_RESULT_TYPES;
+    uint64_t bytesOut;
+    uint64_t bytesIn;
+    uint64_t uncompressedBytesOut;
+    uint64_t uncompressedBytesIn;
+    uint32_t apsRemoved;
+    uint64_t bytesRemoved;
+    ma_combainLocation_GetStats(
+        &requests,
+        &serverRequests,
+        resultCounts,
+        &resultCountsSize,
+        &bytesOut,
+        &bytesIn,
+        &uncompressedBytesOut,
+        &uncompressedBytesIn,
+        &apsRemoved,
+        &bytesRemoved);
+
+    printf("Requests: %u, sent to the server: %u\n", requests, serverRequests);
+    printf(
+        "Results: success=%u, error=%u, parseFailure=%u, communicationFailure=%u, timeout=%u\n",
+        resultCounts[MA_COMBAINLOCATION_RESULT_SUCCESS],
+        resultCounts[MA_COMBAINLOCATION_RESULT_ERROR],
+        resultCounts[MA_COMBAINLOCATION_RESULT_RESPONSE_PARSE_FAILURE],
+        resultCounts[MA_COMBAINLOCATION_RESULT_COMMUNICATION_FAILURE],
+        resultCounts[MA_COMBAINLOCATION_RESULT_TIMEOUT]);
+    printf(
+        "Bytes on the wire: out=%" PRIu64 ", in=%" PRIu64 " (uncompressed: out=%" PRIu64
+        ", in=%" PRIu64 ")\n",
+        bytesOut,
+        bytesIn,
+        uncompressedBytesOut,
+        uncompressedBytesIn);
+    printf("AP selection: removed %u APs, %" PRIu64 " bytes\n", apsRemoved, bytesRemoved);
+
+    ma_combainLocation_CircuitState_t circuitState;
+    uint32_t consecutiveFailures;
+    uint32_t circuitTrips;
+    uint32_t retries;
+    uint32_t fastFailures;
+    uint32_t cancelled;
+    uint32_t connectionsOpened;
+    uint32_t connectionsReused;
+    uint32_t http2Requests;
+    ma_combainLocation_GetConnectionStats(
+        &circuitState,
+        &consecutiveFailures,
+        &circuitTrips,
+        &retries,
+        &fastFailures,
+        &cancelled,
+        &connectionsOpened,
+        &connectionsReused,
+        &http2Requests);
+    printf(
+        "Connections: opened=%u, reused=%u, http2Requests=%u\n",
+        connectionsOpened,
+        connectionsReused,
+        http2Requests);
+    printf(
+        "Circuit: %s, consecutiveFailures=%u, trips=%u, retries=%u, fastFailures=%u, "
+        "cancelled=%u\n",
+        circuitState == MA_COMBAINLOCATION_CIRCUIT_CLOSED ? "closed" :
+        circuitState == MA_COMBAINLOCATION_CIRCUIT_OPEN   ? "open" :
+                                                            "half open",
+        consecutiveFailures,
+        circuitTrips,
+        retries,
+        fastFailures,
+        cancelled);
+
+    printf("\nLatency in ms. Percentiles are histogram bucket bounds.\n");
+    printf("%-10s %8s %10s %10s %10s %10s\n", "stage", "count", "mean", "p50", "p95", "p99");
+    int stage;
+    for (stage = MA_COMBAINLOCATION_STAGE_QUEUE; stage <= MA_COMBAINLOCATION_STAGE_TOTAL; stage++)
+    {
+        uint32_t bucketCounts[MA_COMBAINLOCATION_LATENCY_HISTOGRAM_BUCKETS];
+        size_t numBuckets = MA_COMBAINLOCATION_LATENCY_HISTOGRAM_BUCKETS;
+        uint32_t count;
+        uint64_t totalMicroseconds;
+        if (ma_combainLocation_GetLatencyHistogram(
+                stage, bucketCounts, &numBuckets, &count, &totalMicroseconds) != LE_OK)
+        {
+            fprintf(stderr, "Couldn't get the latency histogram for stage %d\n", stage);
+            exit(1);
+        }
+
+        if (count == 0)
+        {
+            printf("%-10s %8u %10s %10s %10s %10s\n", StageName(stage), count, "-", "-", "-", "-");
+            continue;
+        }
+
+        char p50[16];
+        char p95[16];
+        char p99[16];
+        FormatPercentile(bucketCounts, numBuckets, count, 0.50, p50, sizeof(p50));
+        FormatPercentile(bucketCounts, numBuckets, count, 0.95, p95, sizeof(p95));
+        FormatPercentile(bucketCounts, numBuckets, count, 0.99, p99, sizeof(p99));
+        printf(
+            "%-10s %8u %10.3f %10s %10s %10s\n",
+            StageName(stage),
+            count,
+            (double)totalMicroseconds / count / 1000.0,
+            p50,
+            p95,
+            p99);
+    }
 }
 
 static void LocationResultHandler(
@@ -127,6 +304,11 @@ static void LocationResultHandler(
         exit(1);
         break;
 
+    case MA_COMBAINLOCATION_RESULT_TIMEOUT:
+        fprintf(stderr, "Request wasn't sent to the Combain server before its deadline\n");
+        exit(1);
+        break;
+
     default:
         fprintf(stderr, "Received unhandled result type (%d)\n", result);
         exit(1);
@@ -229,6 +411,64 @@ static uint16_t MccMncStrToInt(const char *s)
     return out;
 }
 
+// APs which have been read from the scan but not yet appended to the request. They are appended in
+// batches to save an IPC round trip per AP.
+static struct
+{
+    uint8_t bssids[MA_COMBAINLOCATION_WIFI_BSSID_BATCH_BYTES];
+    uint8_t ssids[MA_COMBAINLOCATION_WIFI_SSID_BATCH_BYTES];
+    uint8_t ssidLengths[MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND];
+    int16_t signalStrengths[MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND];
+    size_t numAps;
+    size_t ssidBytes;
+} WifiApBatch;
+
+static void FlushWifiApBatch(void)
+{
+    if (WifiApBatch.numAps == 0)
+    {
+        return;
+    }
+
+    const le_result_t res = ma_combainLocation_AppendWifiAccessPoints(
+        State.combainHandle,
+        WifiApBatch.bssids,
+        WifiApBatch.numAps * MA_COMBAINLOCATION_WIFI_BSSID_BYTES,
+        WifiApBatch.ssids,
+        WifiApBatch.ssidBytes,
+        WifiApBatch.ssidLengths,
+        WifiApBatch.numAps,
+        WifiApBatch.signalStrengths,
+        WifiApBatch.numAps);
+    if (res != LE_OK)
+    {
+        fprintf(stderr, "Failed to append WiFi scan results to combain request\n");
+        exit(1);
+    }
+    WifiApBatch.numAps = 0;
+    WifiApBatch.ssidBytes = 0;
+}
+
+static void AddToWifiApBatch(
+    const uint8_t *bssid, const uint8_t *ssid, size_t ssidLen, int16_t signalStrength)
+{
+    if (WifiApBatch.numAps == MA_COMBAINLOCATION_MAX_WIFI_APS_PER_APPEND)
+    {
+        FlushWifiApBatch();
+    }
+
+    const size_t i = WifiApBatch.numAps;
+    memcpy(
+        &WifiApBatch.bssids[i * MA_COMBAINLOCATION_WIFI_BSSID_BYTES],
+        bssid,
+        MA_COMBAINLOCATION_WIFI_BSSID_BYTES);
+    memcpy(&WifiApBatch.ssids[WifiApBatch.ssidBytes], ssid, ssidLen);
+    WifiApBatch.ssidLengths[i] = ssidLen;
+    WifiApBatch.signalStrengths[i] = signalStrength;
+    WifiApBatch.ssidBytes += ssidLen;
+    WifiApBatch.numAps++;
+}
+
 static void WifiEventHandler(le_wifiClient_Event_t event, void *context)
 {
     LE_INFO("Called WifiEventHanler() with event=%d", event);
@@ -277,16 +517,11 @@ static void WifiEventHandler(le_wifiClient_Event_t event, void *context)
                     exit(1);
                 }
 
-                res = ma_combainLocation_AppendWifiAccessPoint(
-                    State.combainHandle, bssidBytes, 6, ssid, ssidLen, signalStrength);
-                if (res != LE_OK)
-                {
-                    fprintf(stderr, "Failed to append WiFi scan results to combain request\n");
-                    exit(1);
-                }
+                AddToWifiApBatch(bssidBytes, ssid, ssidLen, signalStrength);
 
                 ap = le_wifiClient_GetNextAccessPoint();
             }
+            FlushWifiApBatch();
 
             TrySubmitRequest();
         }
@@ -309,6 +544,8 @@ COMPONENT_INIT
     le_arg_SetFlagVar(&CliArgs.useWifi, "w", "wifi");
     le_arg_SetFlagVar(&CliArgs.useCellular, "c", "cellular");
     le_arg_SetStringVar(&CliArgs.combainApiKey, "k", "api-key");
+    le_arg_AddPositionalCallback(CommandArgHandler);
+    le_arg_AllowLessPositionalArgsThanCallbacks();
     le_arg_Scan();
 
     if (CliArgs.helpRequested)
@@ -317,6 +554,18 @@ COMPONENT_INIT
         exit(0);
     }
 
+    if (CliArgs.command)
+    {
+        if (strcmp(CliArgs.command, "stats") != 0)
+        {
+            fprintf(stderr, "Error: Unknown command \"%s\".  See --help\n", CliArgs.command);
+            Usage(stderr);
+            exit(1);
+        }
+        PrintStats();
+        exit(0);
+    }
+
     if (!CliArgs.combainApiKey)
     {
         fprintf(stderr, "Error: No Combain API key specified.  See --help\n");